@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_ARCHIVE_FORMAT_H__
+#define __GEM5FS_ARCHIVE_FORMAT_H__
+
+/*
+ *  Layout of the images written by gem5fs-pack and served by gem5's
+ *  archive backend. An image is an ArchiveHeader, the ArchiveEntry table,
+ *  the entry names and then the data of the files and symlinks, each
+ *  aligned to GEM5FS_ARCHIVE_ALIGN bytes. Offsets are from the start of
+ *  the image.
+ *
+ *  Entry 0 is the root. Entries are numbered breadth first with the
+ *  entries of each directory sorted by name, so the children of a
+ *  directory are the firstChild..firstChild+childCount-1 entries and a
+ *  name is looked up with a binary search among them.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+namespace gem5fs {
+#endif
+
+#define GEM5FS_ARCHIVE_MAGIC "GEM5FSAR"
+#define GEM5FS_ARCHIVE_VERSION 1
+#define GEM5FS_ARCHIVE_BYTE_ORDER 0x01020304
+#define GEM5FS_ARCHIVE_ALIGN 64
+
+struct ArchiveHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;     // GEM5FS_ARCHIVE_BYTE_ORDER as written by the packer
+    uint32_t entryCount;
+    uint32_t reserved;
+    uint64_t entryOffset;
+    uint64_t nameOffset;
+    uint64_t nameSize;
+    uint64_t size;          // Of the whole image
+};
+
+struct ArchiveEntry
+{
+    uint32_t parent;        // The root is its own parent
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t nameOffset;    // From the start of the names, not terminated
+    uint32_t nameLength;
+    uint32_t mtimeNsec;
+    uint64_t mtime;
+    uint64_t dataOffset;    // File data or symlink target
+    uint64_t size;
+    uint32_t firstChild;
+    uint32_t childCount;
+};
+
+#ifdef __cplusplus
+}; // namespace gem5fs
+#endif
+
+#endif // __GEM5FS_ARCHIVE_FORMAT_H__
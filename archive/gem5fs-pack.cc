@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+/*
+ *  gem5fs-pack writes a directory tree into one image that gem5 can serve
+ *  read-only with GEM5FS_BACKEND=archive:image. Entries are written in a
+ *  fixed order, so packing the same tree twice gives the same image.
+ *  Directories, regular files and symlinks are packed; anything else is
+ *  skipped with a warning, and hard links are packed once per name.
+ *
+ *  Usage: gem5fs-pack directory image
+ */
+
+#include "archive/format.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace gem5fs;
+
+/* An entry to pack, and where it came from. */
+struct PackEntry
+{
+    ArchiveEntry entry;
+    std::string path;
+};
+
+static std::vector<PackEntry> entries;
+static std::string names;
+
+static uint64_t Align(uint64_t offset)
+{
+    return (offset + GEM5FS_ARCHIVE_ALIGN - 1) & ~(uint64_t)(GEM5FS_ARCHIVE_ALIGN - 1);
+}
+
+static bool AddEntry(const std::string& path, const std::string& name, uint32_t parent)
+{
+    struct stat statbuf;
+    PackEntry pack;
+
+    if (lstat(path.c_str(), &statbuf) != 0)
+    {
+        fprintf(stderr, "gem5fs-pack: %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!S_ISDIR(statbuf.st_mode) && !S_ISREG(statbuf.st_mode) && !S_ISLNK(statbuf.st_mode))
+    {
+        fprintf(stderr, "gem5fs-pack: skipping %s, not a file, directory or symlink\n", path.c_str());
+        return true;
+    }
+
+    memset(&pack.entry, 0, sizeof(pack.entry));
+    pack.entry.parent = parent;
+    pack.entry.mode = statbuf.st_mode;
+    pack.entry.uid = statbuf.st_uid;
+    pack.entry.gid = statbuf.st_gid;
+    pack.entry.nameOffset = names.size();
+    pack.entry.nameLength = name.size();
+    pack.entry.mtime = statbuf.st_mtim.tv_sec;
+    pack.entry.mtimeNsec = statbuf.st_mtim.tv_nsec;
+    pack.entry.size = S_ISDIR(statbuf.st_mode) ? 0 : statbuf.st_size;
+    pack.path = path;
+
+    names += name;
+    entries.push_back(pack);
+
+    return true;
+}
+
+/*
+ *  Add the entries of every directory, breadth first, so that each
+ *  directory's entries come out next to each other and sorted by name.
+ */
+static bool ScanTree(const char *root)
+{
+    if (!AddEntry(root, "", 0))
+        return false;
+
+    if (!S_ISDIR(entries[0].entry.mode))
+    {
+        fprintf(stderr, "gem5fs-pack: %s is not a directory\n", root);
+        return false;
+    }
+
+    for (size_t index = 0; index < entries.size(); ++index)
+    {
+        if (!S_ISDIR(entries[index].entry.mode))
+            continue;
+
+        std::string path = entries[index].path;
+        std::vector<std::string> children;
+        DIR *dir = opendir(path.c_str());
+        struct dirent *dentry;
+
+        if (dir == NULL)
+        {
+            fprintf(stderr, "gem5fs-pack: %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        while ((dentry = readdir(dir)) != NULL)
+        {
+            if (strcmp(dentry->d_name, ".") != 0 && strcmp(dentry->d_name, "..") != 0)
+                children.push_back(dentry->d_name);
+        }
+
+        closedir(dir);
+
+        /* The backend does its binary search with the same byte order. */
+        std::sort(children.begin(), children.end());
+
+        entries[index].entry.firstChild = entries.size();
+
+        for (size_t child = 0; child < children.size(); ++child)
+        {
+            if (!AddEntry(path + "/" + children[child], children[child], index))
+                return false;
+        }
+
+        entries[index].entry.childCount = entries.size() - entries[index].entry.firstChild;
+    }
+
+    return true;
+}
+
+static bool WriteAll(int fd, const void *buf, size_t size, uint64_t offset)
+{
+    const char *data = (const char *)buf;
+
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        data += written;
+        size -= written;
+        offset += written;
+    }
+
+    return true;
+}
+
+/* Copy the data of a file or the target of a symlink into the image. */
+static bool CopyData(int image, const PackEntry& pack)
+{
+    if (S_ISLNK(pack.entry.mode))
+    {
+        std::vector<char> target(pack.entry.size + 1);
+        ssize_t length = readlink(pack.path.c_str(), target.data(), target.size());
+
+        if (length != (ssize_t)pack.entry.size)
+        {
+            fprintf(stderr, "gem5fs-pack: %s changed while packing\n", pack.path.c_str());
+            return false;
+        }
+
+        return WriteAll(image, target.data(), length, pack.entry.dataOffset);
+    }
+
+    int fd = open(pack.path.c_str(), O_RDONLY);
+    std::vector<char> buf(1 << 20);
+    uint64_t copied = 0;
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "gem5fs-pack: %s: %s\n", pack.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    while (copied < pack.entry.size)
+    {
+        size_t want = std::min((uint64_t)buf.size(), pack.entry.size - copied);
+        ssize_t got = pread(fd, buf.data(), want, copied);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+        {
+            fprintf(stderr, "gem5fs-pack: %s: %s\n", pack.path.c_str(),
+                    got < 0 ? strerror(errno) : "changed while packing");
+            ::close(fd);
+            return false;
+        }
+
+        if (!WriteAll(image, buf.data(), got, pack.entry.dataOffset + copied))
+        {
+            fprintf(stderr, "gem5fs-pack: writing image: %s\n", strerror(errno));
+            ::close(fd);
+            return false;
+        }
+
+        copied += got;
+    }
+
+    ::close(fd);
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s directory image\n", argv[0]);
+        return 1;
+    }
+
+    if (!ScanTree(argv[1]))
+        return 1;
+
+    if (entries.size() > UINT32_MAX)
+    {
+        fprintf(stderr, "gem5fs-pack: too many entries\n");
+        return 1;
+    }
+
+    ArchiveHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GEM5FS_ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = GEM5FS_ARCHIVE_VERSION;
+    header.byteOrder = GEM5FS_ARCHIVE_BYTE_ORDER;
+    header.entryCount = entries.size();
+    header.entryOffset = Align(sizeof(header));
+    header.nameOffset = header.entryOffset + entries.size() * sizeof(ArchiveEntry);
+    header.nameSize = names.size();
+
+    /* Lay out the data of the files and symlinks after the names. */
+    uint64_t offset = Align(header.nameOffset + header.nameSize);
+
+    for (size_t index = 0; index < entries.size(); ++index)
+    {
+        ArchiveEntry& entry = entries[index].entry;
+
+        if (!S_ISDIR(entry.mode))
+        {
+            entry.dataOffset = offset;
+            offset = Align(offset + entry.size);
+        }
+    }
+
+    header.size = offset;
+
+    std::vector<ArchiveEntry> table;
+
+    for (size_t index = 0; index < entries.size(); ++index)
+        table.push_back(entries[index].entry);
+
+    int image = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (image < 0)
+    {
+        fprintf(stderr, "gem5fs-pack: %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    /* Padding is left as holes, which read back as zeros. */
+    if (!WriteAll(image, &header, sizeof(header), 0)
+        || !WriteAll(image, table.data(), table.size() * sizeof(ArchiveEntry), header.entryOffset)
+        || !WriteAll(image, names.data(), names.size(), header.nameOffset)
+        || ftruncate(image, header.size) != 0)
+    {
+        fprintf(stderr, "gem5fs-pack: writing %s: %s\n", argv[2], strerror(errno));
+        ::close(image);
+        return 1;
+    }
+
+    for (size_t index = 0; index < entries.size(); ++index)
+    {
+        if (!S_ISDIR(entries[index].entry.mode) && !CopyData(image, entries[index]))
+        {
+            ::close(image);
+            return 1;
+        }
+    }
+
+    if (::close(image) != 0)
+    {
+        fprintf(stderr, "gem5fs-pack: writing %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    printf("%s: %zu entries, %llu bytes\n", argv[2], entries.size(),
+           (unsigned long long)header.size);
+
+    return 0;
+}
@@ -46,12 +46,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
@@ -61,6 +64,23 @@
 void *m5_mem = NULL;
 #endif
 
+/* Mountpoint and options, shared with fuse as private_data. */
+static struct gem5fs_state *gem5fs_data = NULL;
+
+#define GEM5FS_OPT(templ, field, value) { templ, offsetof(struct gem5fs_state, field), value }
+
+static struct fuse_opt gem5fs_opts[] = {
+    GEM5FS_OPT("hostasync", hostasync, 1),
+    GEM5FS_OPT("auto_cache", auto_cache, 1),
+    GEM5FS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    GEM5FS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    GEM5FS_OPT("entry_cache=%lf", entry_cache, 0),
+    GEM5FS_OPT("attr_cache=%lf", attr_cache, 0),
+    GEM5FS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    GEM5FS_OPT("negative_cache=%lf", negative_cache, 0),
+    FUSE_OPT_END
+};
+
 /* Copied from m5.c -- Hopefully this is moved to it's own header/source pair someday. */
 static void
 map_m5_mem()
@@ -96,570 +116,2881 @@ static int gem5fs_error(const char *operation, int error)
 }
 
 /*
- *  Sends a request to gem5 via pseudo instruction and returns a response if
- *  specified by the caller. Requests are sent with the input data input_data
- *  of size input_size. If NULL, no input data is sent. The response is placed
- *  in the buffer response_data of size response_size. This buffer is allocated
- *  here and NOT freed. The caller should free this buffer after processing the
- *  response data. If this buffer is NULL, no response data is requested or
- *  allocated.
+ *  Touch every page of a buffer gem5 is going to write into.
+ *
+ *  I suspect that the malloc function is lazy and just 
+ *  returns a pointer to a free region of memory and doesn't
+ *  actually do things like update the pagetable, etc. For 
+ *  some directories with more than a dozen files, the gem5
+ *  translation fails. Writing to each page here makes sure
+ *  the pagetable is updated* preventing a fault in gem5.
+ *
+ *  * = Partially conjecture.
+ */
+static void gem5fs_touch(void *buf, size_t size)
+{
+    volatile char *page = (volatile char *)buf;
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset;
+
+    if (size == 0)
+        return;
+
+    for (offset = 0; offset < size; offset += pagesize)
+        page[offset] = 0;
+
+    page[size - 1] = 0;
+}
+
+/*
+ *  Fill in the file operation struct for a request. The request applies to
+ *  the entry named path in the given node, or to the node itself if path
+ *  is empty.
+ */
+static void gem5fs_build_request(struct FileOperation *request, Operation op, uint64_t node, const char *path, void *input_data, unsigned int input_size,
+                                 void *response_buf, unsigned int response_capacity)
+{
+    memset(request, 0, sizeof(struct FileOperation));
+    request->oper = op;
+    request->opType = RequestOperation;
+    request->node = node;
+    request->path = (uintptr_t)path;
+    request->pathLength = strlen(path);
+    request->opStruct = (uintptr_t)input_data;
+    request->structSize = input_size;
+    request->responseBuf = (uintptr_t)response_buf;
+    request->responseCapacity = (response_buf != NULL) ? response_capacity : 0;
+}
+
+/*
+ *  State of the submission/completion rings shared with gem5. Requests from
+ *  any FUSE thread are queued in the submission ring. Whichever thread finds
+ *  the doorbell free rings it for everything queued so far, so requests that
+ *  arrive while a doorbell is in progress are batched into the next one.
+ */
+struct gem5fs_ring_slot
+{
+    int busy;                          // Slot is owned by a waiting thread
+    int done;                          // Completion has been reaped
+    struct FileOperation response;     // Copy of the completion
+};
+
+struct gem5fs_ring
+{
+    struct RingHeader *header;
+    struct RingSubmission *sq;
+    struct RingCompletion *cq;
+    unsigned int entries;
+    uint32_t sq_tail;                  // Guest copies of the indices it owns
+    uint32_t cq_head;
+
+    pthread_mutex_t lock;              // Protects everything below
+    pthread_cond_t cond;               // Signals completions and free slots
+    int doorbell_busy;                 // A thread is in SubmitRing
+    unsigned int in_flight;            // Number of busy slots
+    struct gem5fs_ring_slot slots[GEM5FS_RING_ENTRIES];
+};
+
+static struct gem5fs_ring *gem5fs_ring = NULL;
+
+/*
+ *  Map the rings and register them with gem5. If gem5 does not support
+ *  rings, requests fall back to one pseudo instruction each.
  */
-int gem5fs_syscall(Operation op, const char *path, void *input_data, unsigned int input_size, uint8_t **response_data, unsigned int *response_size)
+static void gem5fs_ring_setup()
 {
+    struct RingSetupOperation setupOp;
     struct FileOperation request;
     struct FileOperation response;
+    struct FileOperation wire;
+    struct gem5fs_ring *ring;
+    size_t ring_size = GEM5FS_RING_SIZE(GEM5FS_RING_ENTRIES);
+    void *region;
+
+    ring = calloc(1, sizeof(struct gem5fs_ring));
+    if (ring == NULL)
+        return;
+
+    /* gem5 translates the ring on every doorbell, so keep it resident. */
+    region = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        perror("Can't mmap gem5fs ring");
+        free(ring);
+        return;
+    }
+
+    (void)mlock(region, ring_size);
+    memset(region, 0, ring_size);
+
+    ring->header = (struct RingHeader *)region;
+    ring->sq = (struct RingSubmission *)(ring->header + 1);
+    ring->cq = (struct RingCompletion *)(ring->sq + GEM5FS_RING_ENTRIES);
+    ring->entries = GEM5FS_RING_ENTRIES;
+    ring->header->entries = gem5fs_le32(GEM5FS_RING_ENTRIES);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    memset(&setupOp, 0, sizeof(struct RingSetupOperation));
+    setupOp.ring = gem5fs_le64((uintptr_t)ring->header);
+    setupOp.entries = gem5fs_le32(ring->entries);
+
+    gem5fs_build_request(&request, SetupRing, 0, "", (void*)&setupOp, sizeof(struct RingSetupOperation), NULL, 0);
+
+    wire = request;
+    gem5fs_header_le(&wire);
+
+    m5_gem5fs_call((void*)&setupOp, (void*)&wire, (void*)&response);
+    gem5fs_header_le(&response);
+
+    if (response.oper == ErrorCode)
+    {
+        fprintf(stderr, "gem5fs: gem5 does not support rings, using direct calls.\n");
+        munmap(region, ring_size);
+        free(ring);
+        return;
+    }
+
+    printf("gem5fs registered %d entry ring at %p\n", ring->entries, region);
+
+    gem5fs_ring = ring;
+}
+
+/*
+ *  Move all posted completions to their slots. Called with the ring lock.
+ */
+static void gem5fs_ring_reap(struct gem5fs_ring *ring)
+{
+    unsigned int mask = ring->entries - 1;
+
+    while (ring->cq_head != gem5fs_le32(ring->header->cqTail))
+    {
+        struct RingCompletion *completion = &ring->cq[ring->cq_head & mask];
+        struct gem5fs_ring_slot *slot = &ring->slots[gem5fs_le64(completion->userData)];
+
+        slot->response = completion->response;
+        slot->done = 1;
+
+        ring->cq_head++;
+        ring->header->cqHead = gem5fs_le32(ring->cq_head);
+    }
+}
+
+/*
+ *  Queue a request in the submission ring and wait for its completion.
+ *  This takes the place of m5_gem5fs_call when the rings are registered.
+ */
+static void gem5fs_ring_call(struct gem5fs_ring *ring, void *input_data, struct FileOperation *request, struct FileOperation *response)
+{
+    struct RingSubmission *submission;
+    unsigned int mask = ring->entries - 1;
+    unsigned int slot;
+
+    pthread_mutex_lock(&ring->lock);
+
+    while (ring->in_flight == ring->entries)
+        pthread_cond_wait(&ring->cond, &ring->lock);
 
-    printf("gem5fs_syscall called on %s\n", path);
+    for (slot = 0; ring->slots[slot].busy; ++slot)
+        ;
+
+    ring->slots[slot].busy = 1;
+    ring->slots[slot].done = 0;
+    ring->in_flight++;
+
+    submission = &ring->sq[ring->sq_tail & mask];
+    submission->request = *request;
+    submission->input = gem5fs_le64((uintptr_t)input_data);
+    submission->userData = gem5fs_le64(slot);
+
+    __sync_synchronize();
+    ring->sq_tail++;
+    ring->header->sqTail = gem5fs_le32(ring->sq_tail);
+
+    while (!ring->slots[slot].done)
+    {
+        if (ring->doorbell_busy)
+        {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+            continue;
+        }
+
+        /* Ring the doorbell for everything queued so far. */
+        struct FileOperation doorbell;
+        struct FileOperation doorbell_response;
+
+        gem5fs_build_request(&doorbell, SubmitRing, 0, "", NULL, 0, NULL, 0);
+        gem5fs_header_le(&doorbell);
+
+        ring->doorbell_busy = 1;
+        pthread_mutex_unlock(&ring->lock);
+
+        m5_gem5fs_call(NULL, (void*)&doorbell, (void*)&doorbell_response);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->doorbell_busy = 0;
+
+        gem5fs_ring_reap(ring);
+        pthread_cond_broadcast(&ring->cond);
+    }
+
+    *response = ring->slots[slot].response;
+
+    ring->slots[slot].busy = 0;
+    ring->in_flight--;
+    pthread_cond_broadcast(&ring->cond);
+
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ *  Incremented whenever file data is changed through this mount. Data
+ *  prefetched at open is only used while this has not changed. Changes
+ *  bump it both before and after the host sees them, so a read racing
+ *  with a change is never tagged with the generation that follows it.
+ */
+static volatile unsigned int gem5fs_write_generation = 0;
+
+static void gem5fs_data_changed()
+{
+    __sync_fetch_and_add(&gem5fs_write_generation, 1);
+}
+
+/* Write-back of buffered writes, defined with the write operations. */
+static int gem5fs_writeback_node(fuse_ino_t ino);
+static void gem5fs_writeback_register(fuse_ino_t ino, struct gem5fs_file *file);
+
+/*
+ *  Send a request through the rings if registered, directly otherwise.
+ *  The request is converted to the wire format here and the response is
+ *  converted back.
+ */
+static void gem5fs_send(void *input_data, struct FileOperation *request, struct FileOperation *response)
+{
+    struct FileOperation wire = *request;
+
+    gem5fs_header_le(&wire);
+
+    if (gem5fs_ring != NULL)
+        gem5fs_ring_call(gem5fs_ring, input_data, &wire, response);
+    else
+        m5_gem5fs_call(input_data, (void*)&wire, (void*)response);
+
+    gem5fs_header_le(response);
+}
+
+/* Check if gem5 agreed to a feature at negotiation. */
+static int gem5fs_has_feature(uint64_t feature)
+{
+    return (gem5fs_data != NULL && (gem5fs_data->features & feature) != 0);
+}
+
+/*
+ *  Operations that can block on slow host storage. With the hostasync
+ *  option these may run on gem5's worker pool while the guest keeps
+ *  running, at the cost of at least one extra pseudo instruction to poll.
+ */
+static int gem5fs_async_op(Operation op)
+{
+    if (!gem5fs_has_feature(GEM5FS_FEATURE_ASYNC))
+        return 0;
+
+    switch (op)
+    {
+        case Open:
+        case Read:
+        case Write:
+        case ReadV:
+        case WriteV:
+        case Fsync:
+        case GetStats:
+        case ReadDir:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ *  Sends a single request to gem5 via pseudo instruction. If response_buf
+ *  is not NULL, gem5 writes the response data directly into it as long as
+ *  it fits in response_capacity bytes. The full size of the response data
+ *  is returned in response->structSize. When this is larger than the
+ *  capacity, gem5 keeps the data buffered and it has to be collected with
+ *  gem5fs_get_result.
+ */
+static int gem5fs_request(Operation op, uint64_t node, const char *path, void *input_data, unsigned int input_size,
+                          void *response_buf, unsigned int response_capacity, struct FileOperation *response)
+{
+    struct FileOperation request;
+    useconds_t delay = GEM5FS_POLL_MIN_US;
+
+    printf("gem5fs_syscall called on node %llu '%s'\n", (unsigned long long)node, path);
 
     /* Build the file operation struct. */
-    request.oper = op;
-    request.opType = RequestOperation;
-    request.path = (char*)path;
-    request.pathLength = strlen(path);
-    request.opStruct = input_data;
-    request.structSize = input_size;
+    gem5fs_build_request(&request, op, node, path, input_data, input_size, response_buf, response_capacity);
+
+    if (gem5fs_async_op(op))
+        request.opType = AsyncRequestOperation;
 
     /* Call the operation on the host. */
-    m5_gem5fs_call(input_data, (void*)&request, (void*)&response);
+    gem5fs_send(input_data, &request, response);
+
+    /* Poll with backoff until the worker pool is done with the request. */
+    while (response->opType == PendingOperation)
+    {
+        usleep(delay);
+
+        if (delay < GEM5FS_POLL_MAX_US)
+            delay *= 2;
+
+        gem5fs_build_request(&request, PollResult, node, path, NULL, 0, response_buf, response_capacity);
+        request.result = response->result;
+
+        gem5fs_send(NULL, &request, response);
+    }
 
     /* Check the result. */
-    if (response.oper == ErrorCode)
+    if (response->oper == ErrorCode)
     {
-        return gem5fs_error(__func__, response.errnum);
+        return gem5fs_error(__func__, response->errnum);
     }
 
+    return 0;
+}
+
+/*
+ *  Collects response data gem5 kept buffered, either because it did not
+ *  fit in the request's response buffer or because gem5 does not write
+ *  responses in place. response->result has the address of the buffered
+ *  data in gem5's memory space and buf must hold response->structSize bytes.
+ */
+static void gem5fs_get_result(struct FileOperation *response, void *buf)
+{
+    struct FileOperation request;
+
+    gem5fs_build_request(&request, GetResult, 0, "", buf, response->structSize, NULL, 0);
+    request.result = response->result;
+    gem5fs_header_le(&request);
+
+    gem5fs_touch(buf, response->structSize);
+
+    printf("gem5fs_syscall fetching %d buffered bytes into %p\n", response->structSize, buf);
+
+    /* Get the result and place it in buf. */
+    m5_gem5fs_call(NULL, (void*)&request, buf);
+}
+
+/*
+ *  Sends a request to gem5 via pseudo instruction and returns a response if
+ *  specified by the caller. Requests are sent with the input data input_data
+ *  of size input_size. If NULL, no input data is sent. The response is placed
+ *  in the buffer response_data of size response_size. This buffer is allocated
+ *  here and NOT freed. The caller should free this buffer after processing the
+ *  response data. If this buffer is NULL, no response data is requested or
+ *  allocated.
+ *
+ *  The buffer is handed to gem5 with the request, so only responses larger
+ *  than GEM5FS_RESPONSE_CAPACITY need a second GetResult call.
+ */
+int gem5fs_syscall(Operation op, uint64_t node, const char *path, void *input_data, unsigned int input_size, uint8_t **response_data, unsigned int *response_size)
+{
+    struct FileOperation response;
+    uint8_t *buf;
+    int rv;
+
     /*
      *  If response_data is NULL we'll assume that the operation
-     *  doesn't have any response data, such as mkdir, rmdir, etc
-     *  and well return here.
+     *  doesn't have any response data, such as mkdir, rmdir, etc.
      */
     if (response_data == NULL)
-        return 0;
+        return gem5fs_request(op, node, path, input_data, input_size, NULL, 0, &response);
 
-    /* 
-     *  Request was successful, but we need to allocate space
-     *  in the FUSE filesystem's memory space in to which the 
-     *  pseudo op will copy. 
-     *
-     *  request.result has the pointer to the FileOperation
-     *  in gem5's memory space, so we need to send this.
-     *
-     *  structSize will tell us how much space we need to 
-     *  allocate to get the result. 
-     */
-    request.oper = GetResult;
-    request.opType = RequestOperation;
-    request.path = (char*)path;
-    request.pathLength = strlen(path);
-    request.opStruct = (uint8_t*)malloc(response.structSize);
-    request.structSize = response.structSize;
-    request.result = response.result;
+    buf = (uint8_t*)malloc(GEM5FS_RESPONSE_CAPACITY);
+    if (buf == NULL)
+        return gem5fs_error(__func__, ENOMEM);
 
-    /*
-     *  I suspect that the malloc function is lazy and just 
-     *  returns a pointer to a free region of memory and doesn't
-     *  actually do things like update the pagetable, etc. For 
-     *  some directories with more than a dozen files, the gem5
-     *  translation fails. Here i'm using memset to zero out
-     *  the data, which in turn accesses it and the pagetable is
-     *  updated* preventing a fault in gem5
-     *
-     *  * = Partially conjecture.
-     */
-    memset(request.opStruct, 0, response.structSize);
+    gem5fs_touch(buf, GEM5FS_RESPONSE_CAPACITY);
 
-    printf("gem5fs_syscall allocated %d byte buffer at %p\n", response.structSize, request.opStruct);
-    
-    /* Get the result and place it in request.opStruct. */
-    m5_gem5fs_call(NULL, (void*)&request, (void*)request.opStruct);
+    if ((rv = gem5fs_request(op, node, path, input_data, input_size, buf, GEM5FS_RESPONSE_CAPACITY, &response)) != 0)
+    {
+        free(buf);
+        return rv;
+    }
+
+    /* Still buffered in gem5, retry with a buffer of the right size. */
+    if (response.result != 0)
+    {
+        if (response.structSize > GEM5FS_RESPONSE_CAPACITY)
+        {
+            free(buf);
+
+            buf = (uint8_t*)malloc(response.structSize);
+            if (buf == NULL)
+                return gem5fs_error(__func__, ENOMEM);
+        }
+
+        gem5fs_get_result(&response, buf);
+    }
 
     printf("gem5fs_syscall returned %d bytes of data.\n", response.structSize); 
 
-    /*
-     *  The result's struct contains the stat struct from
-     *  the host system, copy this to FUSE's statbuf.
-     */
-    //memcpy(*response_data, request.opStruct, request.structSize);
-    *response_data = request.opStruct;
+    *response_data = buf;
 
     if (response_size != NULL)
         *response_size = response.structSize;
 
-    /* We're done with this memory. */
-    //free(request.opStruct);
-
     return 0;
 }
 
-/** Get file attributes. */
-int gem5fs_getattr(const char *path, struct stat *statbuf)
+/*
+ *  Same as gem5fs_syscall, but the response is placed directly in the
+ *  caller's buffer response_buf of response_capacity bytes. The size of the
+ *  response data is returned in response_size. If the response was not
+ *  written in place it is fetched with a retry, and truncated to
+ *  response_capacity if it does not fit.
+ */
+int gem5fs_syscall_buf(Operation op, uint64_t node, const char *path, void *input_data, unsigned int input_size, void *response_buf, unsigned int response_capacity, unsigned int *response_size)
 {
+    struct FileOperation response;
+    uint8_t *tmpBuf;
     int rv;
-    int response_size;
-    struct stat *tmpStat;
 
-    if ((rv = gem5fs_syscall(GetAttr, path, NULL, 0, (uint8_t**)&tmpStat, &response_size)) == 0)
+    gem5fs_touch(response_buf, response_capacity);
+
+    if ((rv = gem5fs_request(op, node, path, input_data, input_size, response_buf, response_capacity, &response)) != 0)
+        return rv;
+
+    if (response.result != 0 && response.structSize <= response_capacity)
     {
-        memcpy(statbuf, tmpStat, response_size);
-        free(tmpStat);
+        gem5fs_get_result(&response, response_buf);
     }
+    else if (response.result != 0)
+    {
+        tmpBuf = (uint8_t*)malloc(response.structSize);
+        if (tmpBuf == NULL)
+            return gem5fs_error(__func__, ENOMEM);
 
-    return rv;
+        gem5fs_get_result(&response, tmpBuf);
+        memcpy(response_buf, tmpBuf, response_capacity);
+        free(tmpBuf);
+
+        response.structSize = response_capacity;
+    }
+
+    if (response_size != NULL)
+        *response_size = response.structSize;
+
+    return 0;
 }
 
-/** Read the target of a symbolic link */
-int gem5fs_readlink(const char *path, char *link, size_t size)
+/*
+ *  Drop lookups of many nodes. The nodes and counts are given in native
+ *  byte order and are converted here.
+ */
+static void gem5fs_forget_nodes(struct WireForget *forgets, size_t count)
 {
-    int rv;
-    char *buf;
-    unsigned int bufsiz;
-    size_t modsize;
-    char *mountpoint = ((struct gem5fs_state *)fuse_get_context()->private_data)->rootdir;
+    size_t i, batch;
 
-    modsize = size - strlen(mountpoint);
-
-    /* Just pass in the size of the buffer. */
-    if ((rv = gem5fs_syscall(ReadLink, path, (void*)&modsize, sizeof(size_t), (uint8_t**)&buf, &bufsiz)) == 0)
+    if (!gem5fs_has_feature(GEM5FS_FEATURE_READDIR_PLUS))
     {
-        if (buf[0] == '/')
+        for (i = 0; i < count; ++i)
         {
-            strcpy(link, mountpoint);
-            strcat(link, buf);
-        }
-        else
-        {
-            strcpy(link, buf);
+            uint64_t wireLookups = gem5fs_le64(forgets[i].nlookup);
+
+            (void)gem5fs_syscall(Forget, forgets[i].node, "", (void*)&wireLookups, sizeof(uint64_t), NULL, NULL);
         }
-        free(buf);
+
+        return;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        forgets[i].node = gem5fs_le64(forgets[i].node);
+        forgets[i].nlookup = gem5fs_le64(forgets[i].nlookup);
     }
 
-    return rv; 
+    for (i = 0; i < count; i += batch)
+    {
+        batch = (count - i < GEM5FS_FORGET_BATCH) ? count - i : GEM5FS_FORGET_BATCH;
+
+        (void)gem5fs_syscall(ForgetMulti, 0, "", (void*)(forgets + i), batch * sizeof(struct WireForget), NULL, NULL);
+    }
 }
 
-/** Create a file node */
-int gem5fs_mknod(const char *path, mode_t mode, dev_t dev)
+/*
+ *  Cache of the nodes the guest holds lookups of in gem5, with their
+ *  attributes, and of the names that lead to them. gem5 counts every
+ *  Lookup and every ReadDirPlus entry against the node. The counts are
+ *  kept here and only sent back with Forget once neither the kernel nor a
+ *  cached name uses the node, so a lookup of a cached name or a getattr
+ *  of a node with cached attributes is answered without a request to
+ *  gem5. Names are cached for entry_cache seconds and attributes for
+ *  attr_cache seconds. Both are dropped when they are changed through
+ *  this mount.
+ */
+struct gem5fs_node
 {
-    int rv = 0;
+    uint64_t node;
+    uint64_t nlookup;               // Lookups gem5 counted for the guest
+    uint64_t kernel;                // Lookups the kernel holds
+    unsigned int names;             // Cached names of the node
+    struct stat attr;
+    double attr_expires;            // 0 if attr is not valid
+    int pages_valid;                // The kernel may cache pages of pages_stat
+    struct stat pages_stat;         // Host file at the last open
+    struct gem5fs_file *writable;   // Open files that can write the node
+    unsigned int dirty;             // Files in writable with buffered writes
+    struct gem5fs_node *next;
+};
 
-    printf("%s called\n", __func__);
+struct gem5fs_name
+{
+    fuse_ino_t parent;
+    char *name;
+    struct gem5fs_node *node;
+    double expires;
+    struct gem5fs_name *next;
+};
 
-    return rv; 
-}
+static struct gem5fs_node *gem5fs_node_table[GEM5FS_CACHE_BUCKETS];
+static struct gem5fs_name *gem5fs_name_table[GEM5FS_CACHE_BUCKETS];
+static unsigned int gem5fs_name_inserts = 0;
+static pthread_mutex_t gem5fs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/** Create a directory */
-int gem5fs_mkdir(const char *path, mode_t mode)
+/* Lookups to drop, collected while holding gem5fs_cache_lock. */
+struct gem5fs_forget_list
 {
-    printf("gem5fs_mkdir with mode %d (%X)\n", mode, mode);
+    struct WireForget *forgets;
+    size_t count;
+    size_t capacity;
+};
 
-    return gem5fs_syscall(MakeDirectory, path, (void*)&mode, sizeof(mode_t), NULL, NULL); 
+static double gem5fs_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-/** Remove a file */
-int gem5fs_unlink(const char *path)
+static unsigned int gem5fs_name_hash(fuse_ino_t parent, const char *name)
 {
-    return gem5fs_syscall(Unlink, path, NULL, 0, NULL, NULL);
+    unsigned int hash = 2166136261u ^ (unsigned int)parent;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+
+    return hash % GEM5FS_CACHE_BUCKETS;
 }
 
-/** Remove a directory */
-int gem5fs_rmdir(const char *path)
+static void gem5fs_forget_later(struct gem5fs_forget_list *list, uint64_t node, uint64_t nlookup)
 {
-    return gem5fs_syscall(RemoveDirectory, path, NULL, 0, NULL, NULL);
+    if (list->count == list->capacity)
+    {
+        size_t capacity = (list->capacity == 0) ? GEM5FS_FORGET_BATCH : list->capacity * 2;
+        struct WireForget *forgets = (struct WireForget *)realloc(list->forgets, capacity * sizeof(struct WireForget));
+
+        /* gem5 only keeps the node around a little longer. */
+        if (forgets == NULL)
+            return;
+
+        list->forgets = forgets;
+        list->capacity = capacity;
+    }
+
+    list->forgets[list->count].node = node;
+    list->forgets[list->count].nlookup = nlookup;
+    list->count++;
 }
 
-/** Create a symbolic link */
-int gem5fs_symlink(const char *path, const char *link)
+/* Send the collected forgets, after gem5fs_cache_lock is released. */
+static void gem5fs_forget_flush(struct gem5fs_forget_list *list)
 {
-    return gem5fs_syscall(MakeSymLink, path, (void*)link, strlen(link), NULL, NULL);
+    if (list->count > 0)
+        gem5fs_forget_nodes(list->forgets, list->count);
+
+    free(list->forgets);
+    memset(list, 0, sizeof(struct gem5fs_forget_list));
 }
 
-/** Rename a file */
-int gem5fs_rename(const char *path, const char *newpath)
+/* Find a node in the cache. Called with gem5fs_cache_lock held. */
+static struct gem5fs_node *gem5fs_node_find(uint64_t node)
 {
-    return gem5fs_syscall(Rename, path, (void*)newpath, strlen(newpath), NULL, NULL); 
+    struct gem5fs_node *entry;
+
+    for (entry = gem5fs_node_table[node % GEM5FS_CACHE_BUCKETS]; entry != NULL; entry = entry->next)
+    {
+        if (entry->node == node)
+            return entry;
+    }
+
+    return NULL;
 }
 
-/** Create a hard link to a file */
-int gem5fs_link(const char *path, const char *newpath)
+/* Find a node or add it with no lookups. Called with the lock held. */
+static struct gem5fs_node *gem5fs_node_get(uint64_t node)
 {
-    int rv = 0;
+    struct gem5fs_node *entry = gem5fs_node_find(node);
+    unsigned int bucket = node % GEM5FS_CACHE_BUCKETS;
 
-    printf("%s called\n", __func__);
+    if (entry != NULL)
+        return entry;
+
+    if ((entry = (struct gem5fs_node *)calloc(1, sizeof(struct gem5fs_node))) == NULL)
+        return NULL;
+
+    entry->node = node;
+    entry->next = gem5fs_node_table[bucket];
+    gem5fs_node_table[bucket] = entry;
 
-    return rv; 
+    return entry;
 }
 
-/** Change the permission bits of a file */
-int gem5fs_chmod(const char *path, mode_t mode)
+/*
+ *  Give gem5's lookups of a node back once nothing uses it anymore.
+ *  Called with the lock held.
+ */
+static void gem5fs_node_put(struct gem5fs_node *entry, struct gem5fs_forget_list *list)
 {
-    printf("gem5fs_chmod to mode %d (%X)\n", mode, mode);
+    struct gem5fs_node **link = &gem5fs_node_table[entry->node % GEM5FS_CACHE_BUCKETS];
+
+    if (entry->kernel > 0 || entry->names > 0 || entry->writable != NULL)
+        return;
+
+    while (*link != entry)
+        link = &(*link)->next;
 
-    return gem5fs_syscall(ChangePermission, path, (void*)&mode, sizeof(mode_t), NULL, NULL); 
+    *link = entry->next;
+
+    if (entry->nlookup > 0)
+        gem5fs_forget_later(list, entry->node, entry->nlookup);
+
+    free(entry);
 }
 
-/** Change the owner and group of a file */
-int gem5fs_chown(const char *path, uid_t uid, gid_t gid)
+/*
+ *  Unlink the cached name in parent from the table. Called with the lock
+ *  held.
+ */
+static struct gem5fs_name *gem5fs_name_remove(fuse_ino_t parent, const char *name)
 {
-    struct ChownOperation chownOp;
+    struct gem5fs_name **link = &gem5fs_name_table[gem5fs_name_hash(parent, name)];
+    struct gem5fs_name *entry;
 
-    chownOp.uid = uid;
-    chownOp.gid = gid;
+    for (entry = *link; entry != NULL; link = &entry->next, entry = entry->next)
+    {
+        if (entry->parent == parent && strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next;
+            return entry;
+        }
+    }
 
-    return gem5fs_syscall(ChangeOwner, path, (void*)&chownOp, sizeof(struct ChownOperation), NULL, NULL);
+    return NULL;
 }
 
-/** Change the size of a file */
-int gem5fs_truncate(const char *path, off_t newsize)
+/* Free a name unlinked from the table. Called with the lock held. */
+static void gem5fs_name_free(struct gem5fs_name *entry, struct gem5fs_forget_list *list)
 {
-    return gem5fs_syscall(Truncate, path, (void*)&newsize, sizeof(off_t), NULL, NULL); 
+    entry->node->names--;
+    gem5fs_node_put(entry->node, list);
+
+    free(entry->name);
+    free(entry);
 }
 
-/** Change the access and/or modification times of a file */
-int gem5fs_utimens(const char *path, const struct timespec tv[2])
+/* Drop every expired name. Called with the lock held. */
+static void gem5fs_cache_sweep(struct gem5fs_forget_list *list)
 {
-    int rv = 0;
+    double now = gem5fs_now();
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < GEM5FS_CACHE_BUCKETS; ++bucket)
+    {
+        struct gem5fs_name **link = &gem5fs_name_table[bucket];
+
+        while (*link != NULL)
+        {
+            struct gem5fs_name *entry = *link;
+
+            if (entry->expires > now)
+            {
+                link = &entry->next;
+                continue;
+            }
+
+            *link = entry->next;
+            gem5fs_name_free(entry, list);
+        }
+    }
+}
+
+/*
+ *  Names that gem5 said do not exist, such as the paths compilers, the
+ *  dynamic loader and interpreters probe while searching. They are kept
+ *  for negative_cache seconds, at most GEM5FS_NEGATIVE_MAX at a time with
+ *  the oldest dropped first, and dropped as soon as the name is created
+ *  through this mount.
+ */
+struct gem5fs_negative
+{
+    fuse_ino_t parent;
+    char *name;
+    double expires;
+    struct gem5fs_negative *next;   // Next in the hash bucket
+    struct gem5fs_negative *older;
+    struct gem5fs_negative *newer;
+};
+
+static struct gem5fs_negative *gem5fs_negative_table[GEM5FS_CACHE_BUCKETS];
+static struct gem5fs_negative *gem5fs_negative_oldest = NULL;
+static struct gem5fs_negative *gem5fs_negative_newest = NULL;
+static unsigned int gem5fs_negative_count = 0;
+
+/* Unlink and free a negative entry. Called with the lock held. */
+static void gem5fs_negative_free(struct gem5fs_negative *entry)
+{
+    struct gem5fs_negative **link = &gem5fs_negative_table[gem5fs_name_hash(entry->parent, entry->name)];
+
+    while (*link != entry)
+        link = &(*link)->next;
+
+    *link = entry->next;
+
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        gem5fs_negative_oldest = entry->newer;
+
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        gem5fs_negative_newest = entry->older;
+
+    gem5fs_negative_count--;
+
+    free(entry->name);
+    free(entry);
+}
+
+/* Find the negative entry for a name. Called with the lock held. */
+static struct gem5fs_negative *gem5fs_negative_find(fuse_ino_t parent, const char *name)
+{
+    struct gem5fs_negative *entry;
+
+    for (entry = gem5fs_negative_table[gem5fs_name_hash(parent, name)]; entry != NULL; entry = entry->next)
+    {
+        if (entry->parent == parent && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Drop the negative entry for a name, if any. Called with the lock held. */
+static void gem5fs_negative_drop(fuse_ino_t parent, const char *name)
+{
+    struct gem5fs_negative *entry = gem5fs_negative_find(parent, name);
+
+    if (entry != NULL)
+        gem5fs_negative_free(entry);
+}
+
+/* Fill in the entry for FUSE from a cached node. */
+static void gem5fs_fill_entry(struct fuse_entry_param *e, struct gem5fs_node *node)
+{
+    /* Handles are never reused, so the generation is always 0. */
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = node->node;
+    e->generation = 0;
+    e->attr = node->attr;
+    e->attr_timeout = gem5fs_data->attr_timeout;
+    e->entry_timeout = gem5fs_data->entry_timeout;
+}
+
+/*
+ *  Keep a lookup of name in parent that gem5 just counted, by Lookup or
+ *  ReadDirPlus. If e is not NULL, the lookup is for the kernel and e is
+ *  filled in, otherwise only the cached name holds it. Called with the
+ *  lock held. Returns -ENOMEM, with the lookup already given back, if
+ *  there was no memory.
+ */
+static int gem5fs_cache_entry(fuse_ino_t parent, const char *name, const struct NodeEntry *wire, struct fuse_entry_param *e, struct gem5fs_forget_list *list)
+{
+    struct gem5fs_node *node = gem5fs_node_get(gem5fs_le64(wire->node));
+    struct gem5fs_name *entry;
+    double now = gem5fs_now();
+    unsigned int bucket;
+
+    if (node == NULL)
+    {
+        gem5fs_forget_later(list, gem5fs_le64(wire->node), 1);
+        return -ENOMEM;
+    }
+
+    node->nlookup++;
+    node->attr_expires = now + gem5fs_data->attr_cache;
+    gem5fs_negative_drop(parent, name);
+    gem5fs_decode_stat(&node->attr, &wire->attr);
+
+    /* Another node may have had the name before. */
+    if ((entry = gem5fs_name_remove(parent, name)) != NULL && entry->node != node)
+    {
+        gem5fs_name_free(entry, list);
+        entry = NULL;
+    }
+
+    if (entry == NULL && gem5fs_data->entry_cache > 0)
+    {
+        entry = (struct gem5fs_name *)calloc(1, sizeof(struct gem5fs_name));
+
+        if (entry != NULL && (entry->name = strdup(name)) == NULL)
+        {
+            free(entry);
+            entry = NULL;
+        }
+
+        if (entry != NULL)
+        {
+            entry->parent = parent;
+            entry->node = node;
+            node->names++;
+        }
+    }
+
+    if (entry != NULL)
+    {
+        entry->expires = now + gem5fs_data->entry_cache;
+
+        bucket = gem5fs_name_hash(parent, name);
+        entry->next = gem5fs_name_table[bucket];
+        gem5fs_name_table[bucket] = entry;
+
+        if (++gem5fs_name_inserts % GEM5FS_CACHE_SWEEP == 0)
+            gem5fs_cache_sweep(list);
+    }
+
+    if (e != NULL)
+    {
+        node->kernel++;
+        gem5fs_fill_entry(e, node);
+    }
+
+    /* Nothing holds a listed entry if names are not cached. */
+    gem5fs_node_put(node, list);
+
+    return 0;
+}
+
+/*
+ *  Answer a lookup from the cache. Returns 1 and fills in e if the name
+ *  and the attributes of its node are cached, the kernel then holds one
+ *  more lookup of the node.
+ */
+static int gem5fs_cache_lookup(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    struct gem5fs_forget_list list;
+    struct gem5fs_name *entry, **link;
+    double now = gem5fs_now();
+    int hit = 0;
+
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    link = &gem5fs_name_table[gem5fs_name_hash(parent, name)];
+
+    for (entry = *link; entry != NULL; link = &entry->next, entry = entry->next)
+    {
+        if (entry->parent != parent || strcmp(entry->name, name) != 0)
+            continue;
+
+        if (entry->expires <= now)
+        {
+            *link = entry->next;
+            gem5fs_name_free(entry, &list);
+        }
+        else if (entry->node->attr_expires > now)
+        {
+            entry->node->kernel++;
+            gem5fs_fill_entry(e, entry->node);
+            hit = 1;
+        }
+
+        break;
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
+
+    return hit;
+}
+
+/* Get the cached attributes of a node. Returns 1 if they were cached. */
+static int gem5fs_cache_getattr(fuse_ino_t ino, struct stat *statbuf)
+{
+    struct gem5fs_node *node;
+    int hit = 0;
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((node = gem5fs_node_find(ino)) != NULL && node->attr_expires > gem5fs_now())
+    {
+        *statbuf = node->attr;
+        hit = 1;
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    return hit;
+}
+
+/* Cache the attributes of a node if the guest holds it. */
+static void gem5fs_cache_setattr(fuse_ino_t ino, const struct stat *statbuf)
+{
+    struct gem5fs_node *node;
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((node = gem5fs_node_find(ino)) != NULL)
+    {
+        node->attr = *statbuf;
+        node->attr_expires = gem5fs_now() + gem5fs_data->attr_cache;
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+}
+
+/* Drop the cached attributes of a node that is about to change. */
+static void gem5fs_cache_invalidate(fuse_ino_t ino)
+{
+    struct gem5fs_node *node;
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((node = gem5fs_node_find(ino)) != NULL)
+        node->attr_expires = 0;
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+}
+
+/*
+ *  Decide if the kernel may keep the pages it cached of a node at earlier
+ *  opens, with auto_cache. That is the case if the host file still has
+ *  the same device, inode, size and modification time as at the last
+ *  open. st is the host file now, or NULL if it is not known.
+ */
+static int gem5fs_cache_keep_pages(fuse_ino_t ino, const struct stat *st)
+{
+    struct gem5fs_node *node;
+    const struct stat *old;
+    int keep = 0;
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((node = gem5fs_node_find(ino)) != NULL)
+    {
+        old = &node->pages_stat;
+
+        keep = node->pages_valid && st != NULL
+               && old->st_dev == st->st_dev && old->st_ino == st->st_ino
+               && old->st_size == st->st_size
+               && old->st_mtim.tv_sec == st->st_mtim.tv_sec
+               && old->st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+
+        node->pages_valid = (st != NULL);
+        if (st != NULL)
+            node->pages_stat = *st;
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    return keep;
+}
+
+/*
+ *  Drop a cached name that is about to change on the host, along with
+ *  the attributes of its node and of the parent. A rename may also
+ *  create the name, so it is dropped from the negative cache as well.
+ */
+static void gem5fs_cache_drop(fuse_ino_t parent, const char *name)
+{
+    struct gem5fs_name *entry;
+    struct gem5fs_node *node;
+    struct gem5fs_forget_list list;
+
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((node = gem5fs_node_find(parent)) != NULL)
+        node->attr_expires = 0;
+
+    if ((entry = gem5fs_name_remove(parent, name)) != NULL)
+    {
+        entry->node->attr_expires = 0;
+        gem5fs_name_free(entry, &list);
+    }
+
+    gem5fs_negative_drop(parent, name);
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
+}
+
+/* The kernel dropped nlookup lookups of a node. Called with the lock. */
+static void gem5fs_cache_forget(uint64_t ino, uint64_t nlookup, struct gem5fs_forget_list *list)
+{
+    struct gem5fs_node *node = gem5fs_node_find(ino);
+
+    if (node == NULL)
+    {
+        gem5fs_forget_later(list, ino, nlookup);
+        return;
+    }
+
+    node->kernel -= (nlookup < node->kernel) ? nlookup : node->kernel;
+    gem5fs_node_put(node, list);
+}
+
+/* Remember that name does not exist in parent. */
+static void gem5fs_negative_add(fuse_ino_t parent, const char *name)
+{
+    struct gem5fs_negative *entry;
+    unsigned int bucket;
+
+    if (gem5fs_data->negative_cache <= 0)
+        return;
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    gem5fs_negative_drop(parent, name);
+
+    if (gem5fs_negative_count == GEM5FS_NEGATIVE_MAX)
+        gem5fs_negative_free(gem5fs_negative_oldest);
+
+    entry = (struct gem5fs_negative *)calloc(1, sizeof(struct gem5fs_negative));
+
+    if (entry != NULL && (entry->name = strdup(name)) == NULL)
+    {
+        free(entry);
+        entry = NULL;
+    }
+
+    if (entry != NULL)
+    {
+        entry->parent = parent;
+        entry->expires = gem5fs_now() + gem5fs_data->negative_cache;
+
+        bucket = gem5fs_name_hash(parent, name);
+        entry->next = gem5fs_negative_table[bucket];
+        gem5fs_negative_table[bucket] = entry;
+
+        entry->older = gem5fs_negative_newest;
+        if (gem5fs_negative_newest != NULL)
+            gem5fs_negative_newest->newer = entry;
+        else
+            gem5fs_negative_oldest = entry;
+        gem5fs_negative_newest = entry;
+
+        gem5fs_negative_count++;
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+}
+
+/* Returns 1 if name is known not to exist in parent. */
+static int gem5fs_negative_lookup(fuse_ino_t parent, const char *name)
+{
+    struct gem5fs_negative *entry;
+    int hit = 0;
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((entry = gem5fs_negative_find(parent, name)) != NULL)
+    {
+        if (entry->expires > gem5fs_now())
+            hit = 1;
+        else
+            gem5fs_negative_free(entry);
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    return hit;
+}
+
+/* Forget that name does not exist before it is created through this mount. */
+static void gem5fs_negative_forget(fuse_ino_t parent, const char *name)
+{
+    pthread_mutex_lock(&gem5fs_cache_lock);
+    gem5fs_negative_drop(parent, name);
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+}
+
+/*
+ *  Reply to a lookup of a name that does not exist. With negative_timeout
+ *  the kernel caches the missing name as well.
+ */
+static void gem5fs_reply_negative(fuse_req_t req)
+{
+    struct fuse_entry_param e;
+
+    if (gem5fs_data->negative_timeout <= 0)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.ino = 0;
+    e.entry_timeout = gem5fs_data->negative_timeout;
+
+    fuse_reply_entry(req, &e);
+}
+
+/*
+ *  Look up name in the parent node and fill in the entry for FUSE. gem5
+ *  counts the lookup, the cache keeps it until FUSE balances it with
+ *  forget.
+ */
+static int gem5fs_do_lookup(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    int rv;
+    struct NodeEntry entry;
+    struct gem5fs_forget_list list;
+
+    if ((rv = gem5fs_syscall_buf(Lookup, parent, name, NULL, 0, (void*)&entry, sizeof(struct NodeEntry), NULL)) != 0)
+        return rv;
+
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    rv = gem5fs_cache_entry(parent, name, &entry, e, &list);
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
+
+    return rv;
+}
+
+/* Reply to a request that created name in parent with its new entry. */
+static void gem5fs_reply_new_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    int rv;
+    struct fuse_entry_param e;
+
+    if ((rv = gem5fs_do_lookup(parent, name, &e)) != 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+/* Get the attributes of a node and cache them. */
+static int gem5fs_do_getattr(fuse_ino_t ino, struct stat *statbuf)
+{
+    int rv;
+    struct WireStat wire;
+
+    if ((rv = gem5fs_syscall_buf(GetAttr, ino, "", NULL, 0, (void*)&wire, sizeof(struct WireStat), NULL)) == 0)
+    {
+        gem5fs_decode_stat(statbuf, &wire);
+        gem5fs_cache_setattr(ino, statbuf);
+    }
+
+    return rv;
+}
+
+/** Look up a directory entry by name and get its attributes */
+void gem5fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    int rv;
+    struct fuse_entry_param e;
+
+    /* Names that were just looked up or listed need no request. */
+    if (gem5fs_cache_lookup(parent, name, &e))
+    {
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    /* Neither do names that were just found missing. */
+    if (gem5fs_negative_lookup(parent, name))
+    {
+        gem5fs_reply_negative(req);
+        return;
+    }
+
+    if ((rv = gem5fs_do_lookup(parent, name, &e)) == -ENOENT)
+    {
+        gem5fs_negative_add(parent, name);
+        gem5fs_reply_negative(req);
+    }
+    else if (rv != 0)
+    {
+        fuse_reply_err(req, -rv);
+    }
+    else
+    {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+/** Forget about an inode */
+void gem5fs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    struct gem5fs_forget_list list;
+
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+    gem5fs_cache_forget(ino, nlookup, &list);
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
+
+    fuse_reply_none(req);
+}
+
+/** Forget about multiple inodes */
+void gem5fs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    struct gem5fs_forget_list list;
+    size_t i;
+
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    for (i = 0; i < count; ++i)
+        gem5fs_cache_forget(forgets[i].ino, forgets[i].nlookup, &list);
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
+
+    fuse_reply_none(req);
+}
+
+/** Get file attributes */
+void gem5fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int rv;
+    struct stat statbuf;
+
+    /* The size and times must include writes buffered for the node. */
+    gem5fs_writeback_node(ino);
+
+    if (gem5fs_cache_getattr(ino, &statbuf))
+        fuse_reply_attr(req, &statbuf, gem5fs_data->attr_timeout);
+    else if ((rv = gem5fs_do_getattr(ino, &statbuf)) != 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_attr(req, &statbuf, gem5fs_data->attr_timeout);
+}
+
+/** Set file attributes */
+void gem5fs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    int rv = 0;
+    struct stat statbuf;
+
+    gem5fs_cache_invalidate(ino);
+
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        uint32_t wireMode = gem5fs_le32(attr->st_mode);
+
+        printf("gem5fs_chmod to mode %d (%X)\n", attr->st_mode, attr->st_mode);
+
+        rv = gem5fs_syscall(ChangePermission, ino, "", (void*)&wireMode, sizeof(uint32_t), NULL, NULL);
+    }
+
+    if (rv == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    {
+        struct ChownOperation chownOp;
+
+        /* -1 leaves the owner or group unchanged. */
+        chownOp.uid = gem5fs_le32((to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1);
+        chownOp.gid = gem5fs_le32((to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1);
+
+        rv = gem5fs_syscall(ChangeOwner, ino, "", (void*)&chownOp, sizeof(struct ChownOperation), NULL, NULL);
+    }
+
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+        /* Buffered writes must not land after the truncate. */
+        gem5fs_writeback_node(ino);
+        gem5fs_data_changed();
+
+        if (fi != NULL)
+        {
+            struct ftruncOperation ftOp;
+
+            memset(&ftOp, 0, sizeof(struct ftruncOperation));
+            ftOp.length = gem5fs_les64(attr->st_size);
+            ftOp.fd = gem5fs_les32(((struct gem5fs_file *)(uintptr_t)fi->fh)->hostfd);
+
+            rv = gem5fs_syscall(Ftruncate, ino, "", (void*)&ftOp, sizeof(struct ftruncOperation), NULL, NULL);
+        }
+        else
+        {
+            int64_t length = gem5fs_les64(attr->st_size);
+
+            rv = gem5fs_syscall(Truncate, ino, "", (void*)&length, sizeof(int64_t), NULL, NULL);
+        }
+
+        gem5fs_data_changed();
+    }
+
+    /* Access and modification times are not supported and left alone. */
+
+    if (rv == 0)
+        rv = gem5fs_do_getattr(ino, &statbuf);
+
+    if (rv != 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_attr(req, &statbuf, gem5fs_data->attr_timeout);
+}
+
+/** Read the target of a symbolic link */
+void gem5fs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    int rv;
+    char *buf;
+    unsigned int bufsiz;
+    uint64_t modsize;
+    char link[PATH_MAX];
+    char *mountpoint = gem5fs_data->rootdir;
+
+    modsize = gem5fs_le64(PATH_MAX - strlen(mountpoint));
+
+    /* Just pass in the size of the buffer. */
+    if ((rv = gem5fs_syscall(ReadLink, ino, "", (void*)&modsize, sizeof(uint64_t), (uint8_t**)&buf, &bufsiz)) != 0)
+    {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    /* Absolute links point into the host's root, which is mounted here. */
+    if (buf[0] == '/')
+    {
+        strcpy(link, mountpoint);
+        strcat(link, buf);
+    }
+    else
+    {
+        strcpy(link, buf);
+    }
+    free(buf);
+
+    fuse_reply_readlink(req, link);
+}
+
+/** Create a file node */
+void gem5fs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    printf("%s called\n", __func__);
+
+    /* Regular files are made with create, special files aren't supported. */
+    fuse_reply_err(req, ENOSYS);
+}
+
+/** Create a directory */
+void gem5fs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    int rv;
+    uint32_t wireMode = gem5fs_le32(mode);
+
+    printf("gem5fs_mkdir with mode %d (%X)\n", mode, mode);
+
+    gem5fs_cache_invalidate(parent);
+    gem5fs_negative_forget(parent, name);
+
+    if ((rv = gem5fs_syscall(MakeDirectory, parent, name, (void*)&wireMode, sizeof(uint32_t), NULL, NULL)) != 0)
+        fuse_reply_err(req, -rv);
+    else
+        gem5fs_reply_new_entry(req, parent, name);
+}
+
+/** Remove a file */
+void gem5fs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    gem5fs_cache_drop(parent, name);
+
+    fuse_reply_err(req, -gem5fs_syscall(Unlink, parent, name, NULL, 0, NULL, NULL));
+}
+
+/** Remove a directory */
+void gem5fs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    gem5fs_cache_drop(parent, name);
+
+    fuse_reply_err(req, -gem5fs_syscall(RemoveDirectory, parent, name, NULL, 0, NULL, NULL));
+}
+
+/** Create a symbolic link */
+void gem5fs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+    int rv;
+
+    gem5fs_cache_invalidate(parent);
+    gem5fs_negative_forget(parent, name);
+
+    if ((rv = gem5fs_syscall(MakeSymLink, parent, name, (void*)link, strlen(link), NULL, NULL)) != 0)
+        fuse_reply_err(req, -rv);
+    else
+        gem5fs_reply_new_entry(req, parent, name);
+}
+
+/** Rename a file */
+void gem5fs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+{
+    struct RenameOperation renameOp;
+
+    gem5fs_cache_drop(parent, name);
+    gem5fs_cache_drop(newparent, newname);
+
+    memset(&renameOp, 0, sizeof(struct RenameOperation));
+    renameOp.newNode = gem5fs_le64(newparent);
+    renameOp.newName = gem5fs_le64((uintptr_t)newname);
+    renameOp.newNameLength = gem5fs_le32(strlen(newname));
+
+    fuse_reply_err(req, -gem5fs_syscall(Rename, parent, name, (void*)&renameOp, sizeof(struct RenameOperation), NULL, NULL));
+}
+
+/** Create a hard link to a file */
+void gem5fs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+    printf("%s called\n", __func__);
+
+    fuse_reply_err(req, ENOSYS);
+}
+
+/*
+ *  Opens a file on the host and saves its host file descriptor.
+ */
+static int gem5fs_open_host(fuse_ino_t ino, int flags, struct gem5fs_file *file)
+{
+    int rv;
+    uint32_t wireFlags = gem5fs_encode_open_flags(flags);
+    int32_t wirefd;
+
+    if ((rv = gem5fs_syscall_buf(Open, ino, "", (void*)&wireFlags, sizeof(uint32_t), (void*)&wirefd, sizeof(int32_t), NULL)) == 0)
+        file->hostfd = gem5fs_les32(wirefd);
+
+    return rv;
+}
+
+/*
+ *  Opens a read-only file, gets its attributes and reads its first
+ *  GEM5FS_PREFETCH_SIZE bytes with a single compound request. Small input
+ *  files can then be read without any more requests until release.
+ */
+static int gem5fs_open_prefetch(fuse_ino_t ino, int flags, struct gem5fs_file *file)
+{
+    struct CompoundStep steps[3];
+    struct CompoundOperation compoundOp;
+    struct DataOperation dataOp;
+    struct FileOperation response;
+    struct WireStat wireStat;
+    unsigned int generation = gem5fs_write_generation;
+    uint32_t wireFlags = gem5fs_encode_open_flags(flags);
+    int32_t wirefd = -1;
+    int32_t statfd = -1;
+    int i, rv;
+
+    /* Older gem5 builds can't run the steps together. */
+    if (!gem5fs_has_feature(GEM5FS_FEATURE_COMPOUND))
+        return gem5fs_open_host(ino, flags, file);
+
+    file->prefetch = (char*)malloc(GEM5FS_PREFETCH_SIZE);
+    if (file->prefetch == NULL)
+        return gem5fs_open_host(ino, flags, file);
+
+    gem5fs_touch(file->prefetch, GEM5FS_PREFETCH_SIZE);
+    memset(steps, 0, sizeof(steps));
+
+    /* Step 0: open the file. */
+    gem5fs_build_request(&steps[0].request, Open, ino, "", (void*)&wireFlags, sizeof(uint32_t), (void*)&wirefd, sizeof(int32_t));
+    steps[0].input = gem5fs_le64((uintptr_t)&wireFlags);
+    steps[0].fdStep = gem5fs_les32(-1);
+
+    /* Step 1: fstat the fd from step 0. */
+    gem5fs_build_request(&steps[1].request, FGetAttr, 0, "", (void*)&statfd, sizeof(int32_t), (void*)&wireStat, sizeof(struct WireStat));
+    steps[1].input = gem5fs_le64((uintptr_t)&statfd);
+    steps[1].fdStep = gem5fs_les32(0);
+    steps[1].fdOffset = gem5fs_le32(0);
+
+    /* Step 2: read the start of the file from the fd from step 0. */
+    memset(&dataOp, 0, sizeof(struct DataOperation));
+    dataOp.hostfd = gem5fs_les32(-1);
+    dataOp.size = gem5fs_le64(GEM5FS_PREFETCH_SIZE);
+    dataOp.offset = 0;
+    dataOp.data = 0;
+
+    gem5fs_build_request(&steps[2].request, Read, 0, "", (void*)&dataOp, sizeof(struct DataOperation), (void*)file->prefetch, GEM5FS_PREFETCH_SIZE);
+    steps[2].input = gem5fs_le64((uintptr_t)&dataOp);
+    steps[2].fdStep = gem5fs_les32(0);
+    steps[2].fdOffset = gem5fs_le32(offsetof(struct DataOperation, hostfd));
+
+    for (i = 0; i < 3; ++i)
+        gem5fs_header_le(&steps[i].request);
+
+    memset(&compoundOp, 0, sizeof(struct CompoundOperation));
+    compoundOp.count = gem5fs_le32(3);
+    compoundOp.steps = gem5fs_le64((uintptr_t)steps);
+
+    /*
+     *  The steps have their own responses, checked below. A failed step
+     *  also fails the compound, but if gem5 rejected the compound itself
+     *  no step has a response and the file is opened on its own instead.
+     */
+    rv = gem5fs_request(Compound, 0, "", (void*)&compoundOp, sizeof(struct CompoundOperation), NULL, 0, &response);
+
+    for (i = 0; i < 3; ++i)
+        gem5fs_header_le(&steps[i].response);
+
+    if (rv != 0 && steps[0].response.opType != ResponseOperation)
+    {
+        free(file->prefetch);
+        file->prefetch = NULL;
+
+        return gem5fs_open_host(ino, flags, file);
+    }
+
+    if (steps[0].response.oper == ErrorCode)
+    {
+        free(file->prefetch);
+        file->prefetch = NULL;
+
+        return gem5fs_error(__func__, steps[0].response.errnum);
+    }
+
+    file->hostfd = gem5fs_les32(wirefd);
+
+    /* The file is open, only the prefetch is lost if the rest failed. */
+    if (steps[1].response.oper == ErrorCode || steps[2].response.oper == ErrorCode)
+    {
+        free(file->prefetch);
+        file->prefetch = NULL;
+
+        return 0;
+    }
+
+    gem5fs_decode_stat(&file->stat, &wireStat);
+    file->prefetch_size = steps[2].response.structSize;
+    file->generation = generation;
+
+    printf("gem5fs_open prefetched %d bytes of node %lu\n", (int)file->prefetch_size, (unsigned long)ino);
+
+    return 0;
+}
+
+/*
+ *  Check if the kernel may keep the pages it cached of the file, with
+ *  auto_cache. Prefetching opens already got the host file's attributes,
+ *  other opens get them with one more request.
+ */
+static int gem5fs_open_keep_cache(fuse_ino_t ino, struct gem5fs_file *file)
+{
+    struct WireStat wireStat;
+    int32_t wirefd;
+
+    if (file->prefetch == NULL)
+    {
+        wirefd = gem5fs_les32(file->hostfd);
+
+        if (gem5fs_syscall_buf(FGetAttr, 0, "", (void*)&wirefd, sizeof(int32_t), (void*)&wireStat, sizeof(struct WireStat), NULL) != 0)
+            return gem5fs_cache_keep_pages(ino, NULL);
+
+        gem5fs_decode_stat(&file->stat, &wireStat);
+    }
+
+    gem5fs_cache_setattr(ino, &file->stat);
+
+    return gem5fs_cache_keep_pages(ino, &file->stat);
+}
+
+/** File open operation */
+void gem5fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int rv;
+    struct gem5fs_file *file;
+
+    file = (struct gem5fs_file *)calloc(1, sizeof(struct gem5fs_file));
+    if (file == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /* The prefetch and auto_cache must see writes buffered elsewhere. */
+    gem5fs_writeback_node(ino);
+
+    if ((fi->flags & O_ACCMODE) == O_RDONLY)
+        rv = gem5fs_open_prefetch(ino, fi->flags, file);
+    else
+        rv = gem5fs_open_host(ino, fi->flags, file);
+
+    if (rv != 0)
+    {
+        free(file);
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    printf("gem5fs_open got fd %d\n", file->hostfd);
+    pthread_mutex_init(&file->lock, NULL);
+    file->refs = 1;
+    fi->fh = (uintptr_t)file;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        gem5fs_writeback_register(ino, file);
+
+    if (gem5fs_data->auto_cache)
+        fi->keep_cache = gem5fs_open_keep_cache(ino, file);
+
+    fuse_reply_open(req, fi);
+}
+
+/*
+ *  Check if a read can be answered from the data prefetched at open. That
+ *  is the case if it covers this read, or if it holds the entire file, and
+ *  nothing was written since.
+ */
+static int gem5fs_prefetch_hit(struct gem5fs_file *file, size_t size, off_t offset)
+{
+    return (file->prefetch != NULL && file->generation == gem5fs_write_generation
+            && (offset + size <= file->prefetch_size || file->prefetch_size < GEM5FS_PREFETCH_SIZE));
+}
+
+/*
+ *  Read data from an open file into buf. Reads larger than
+ *  GEM5FS_MAX_DATA_SIZE are split into several requests. Returns the
+ *  number of bytes read or -errno.
+ */
+static int gem5fs_read_data(struct gem5fs_file *file, char *buf, size_t size, off_t offset, uint32_t flags)
+{
+    int rv = 0;
+    struct DataOperation dataOp;
+    unsigned int bufSize;
+    size_t done = 0;
+
+    do
+    {
+        size_t chunk = (size - done < GEM5FS_MAX_DATA_SIZE) ? size - done : GEM5FS_MAX_DATA_SIZE;
+
+        memset(&dataOp, 0, sizeof(struct DataOperation));
+        dataOp.hostfd = gem5fs_les32(file->hostfd);
+        dataOp.flags = gem5fs_le32(flags);
+        dataOp.size = gem5fs_le64(chunk);
+        dataOp.offset = gem5fs_les64(offset + done);
+        dataOp.data = 0;
+
+        /* gem5 reads straight into the buffer. */
+        if ((rv = gem5fs_syscall_buf(Read, 0, "", (void*)&dataOp, sizeof(struct DataOperation), (void*)(buf + done), chunk, &bufSize)) != 0)
+            return rv;
+
+        printf("gem5fs_read got %d bytes\n", bufSize);
+
+        done += bufSize;
+
+        /* A short read is the end of the file. */
+        if (bufSize < chunk)
+            break;
+    } while (done < size);
+
+    return done;
+}
+
+/*
+ *  Read data from an open file into a vector of buffers. Large reads are
+ *  split into buffers of at most GEM5FS_SEGMENT_SIZE bytes, which gem5
+ *  fills with a single vectored request. The caller frees the buffers.
+ */
+static int gem5fs_read_vector(struct gem5fs_file *file, struct fuse_bufvec **bufp, size_t size, off_t offset)
+{
+    int rv;
+    struct fuse_bufvec *bufv;
+    struct WireSegment segments[GEM5FS_MAX_SEGMENTS];
+    struct VectorOperation vecOp;
+    size_t count, segsize, remaining, i;
+    int64_t bytes_read;
+
+    count = (size + GEM5FS_SEGMENT_SIZE - 1) / GEM5FS_SEGMENT_SIZE;
+    if (count > GEM5FS_MAX_SEGMENTS)
+        count = GEM5FS_MAX_SEGMENTS;
+
+    segsize = (size + count - 1) / count;
+    count = (size + segsize - 1) / segsize;
+
+    bufv = (struct fuse_bufvec *)calloc(1, sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+    if (bufv == NULL)
+        return gem5fs_error(__func__, ENOMEM);
+
+    bufv->count = count;
+    remaining = size;
+
+    for (i = 0; i < count; ++i)
+    {
+        size_t length = (remaining < segsize) ? remaining : segsize;
+
+        bufv->buf[i].size = length;
+        bufv->buf[i].fd = -1;
+        bufv->buf[i].mem = malloc(length);
+
+        if (bufv->buf[i].mem == NULL)
+        {
+            rv = gem5fs_error(__func__, ENOMEM);
+            goto fail;
+        }
+
+        gem5fs_touch(bufv->buf[i].mem, length);
+
+        segments[i].base = gem5fs_le64((uintptr_t)bufv->buf[i].mem);
+        segments[i].length = gem5fs_le64(length);
+
+        remaining -= length;
+    }
+
+    memset(&vecOp, 0, sizeof(struct VectorOperation));
+    vecOp.hostfd = gem5fs_les32(file->hostfd);
+    vecOp.count = gem5fs_le32(count);
+    vecOp.offset = gem5fs_les64(offset);
+    vecOp.segments = gem5fs_le64((uintptr_t)segments);
+
+    if ((rv = gem5fs_syscall_buf(ReadV, 0, "", (void*)&vecOp, sizeof(struct VectorOperation), (void*)&bytes_read, sizeof(int64_t), NULL)) != 0)
+        goto fail;
+
+    /* Trim the buffers to what was actually read. */
+    remaining = gem5fs_les64(bytes_read);
+
+    for (i = 0; i < count; ++i)
+    {
+        if (bufv->buf[i].size > remaining)
+            bufv->buf[i].size = remaining;
+
+        remaining -= bufv->buf[i].size;
+    }
+
+    printf("gem5fs_read_vector got %d bytes in %d buffers\n", (int)gem5fs_les64(bytes_read), (int)count);
+
+    *bufp = bufv;
+
+    return 0;
+
+fail:
+    for (i = 0; i < count; ++i)
+        free(bufv->buf[i].mem);
+    free(bufv);
+
+    return rv;
+}
+
+/*
+ *  Answer a read that continues a sequential stream. Each time the data
+ *  read ahead runs out, the window doubles up to GEM5FS_READAHEAD_MAX and
+ *  the next window is read with a single request, so a long stream takes
+ *  few requests. Returns 1 if the read was answered, 0 if it should go to
+ *  gem5 as it is.
+ */
+static int gem5fs_readahead(fuse_req_t req, struct gem5fs_file *file, size_t size, off_t offset)
+{
+    int rv, replied = 0;
+    int sequential;
+    off_t end;
+
+    pthread_mutex_lock(&file->lock);
+
+    sequential = (offset == file->next_offset);
+    file->next_offset = offset + size;
+
+    /* Anything written through this mount may be in the window. */
+    if (file->readahead_generation != gem5fs_write_generation)
+        file->readahead_size = 0;
+
+    end = file->readahead_offset + file->readahead_size;
+
+    if (offset >= file->readahead_offset && offset < end
+        && (offset + (off_t)size <= end || file->readahead_eof))
+    {
+        if (size > (size_t)(end - offset))
+            size = end - offset;
+
+        fuse_reply_buf(req, file->readahead + (offset - file->readahead_offset), size);
+        replied = 1;
+    }
+    else if (!sequential)
+    {
+        file->readahead_window = 0;
+    }
+    else
+    {
+        size_t window = (file->readahead_window == 0) ? GEM5FS_READAHEAD_MIN : file->readahead_window * 2;
+
+        if (window > GEM5FS_READAHEAD_MAX)
+            window = GEM5FS_READAHEAD_MAX;
+
+        file->readahead_window = window;
+
+        if (window > file->readahead_capacity)
+        {
+            free(file->readahead);
+            file->readahead_size = 0;
+            file->readahead_capacity = 0;
+
+            if ((file->readahead = (char*)malloc(window)) != NULL)
+            {
+                gem5fs_touch(file->readahead, window);
+                file->readahead_capacity = window;
+            }
+        }
+
+        if (window > size && file->readahead != NULL)
+        {
+            file->readahead_generation = gem5fs_write_generation;
+
+            if ((rv = gem5fs_read_data(file, file->readahead, window, offset, GEM5FS_DATA_WILLNEED)) < 0)
+            {
+                file->readahead_size = 0;
+                fuse_reply_err(req, -rv);
+            }
+            else
+            {
+                file->readahead_offset = offset;
+                file->readahead_size = rv;
+                file->readahead_eof = ((size_t)rv < window);
+
+                fuse_reply_buf(req, file->readahead, (size < (size_t)rv) ? size : (size_t)rv);
+            }
+
+            replied = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&file->lock);
+
+    return replied;
+}
+
+/** Read data from an open file */
+void gem5fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int rv;
+    struct gem5fs_file *file = (struct gem5fs_file *)(uintptr_t)fi->fh;
+    struct fuse_bufvec *bufv;
+    char *buf;
+    size_t i;
+
+    /* Reads from the host must see writes buffered for the node. */
+    gem5fs_writeback_node(ino);
+
+    /* Reply straight from the data prefetched at open. */
+    if (gem5fs_prefetch_hit(file, size, offset))
+    {
+        if (offset >= (off_t)file->prefetch_size)
+            size = 0;
+        else if (size > file->prefetch_size - offset)
+            size = file->prefetch_size - offset;
+
+        fuse_reply_buf(req, file->prefetch + offset, size);
+        return;
+    }
+
+    if (size > 0 && gem5fs_readahead(req, file, size, offset))
+        return;
+
+    /* Large reads go to FUSE as a vector of buffers without flattening. */
+    if (gem5fs_has_feature(GEM5FS_FEATURE_VECTORED) && size > 0)
+    {
+        if ((rv = gem5fs_read_vector(file, &bufv, size, offset)) != 0)
+        {
+            fuse_reply_err(req, -rv);
+            return;
+        }
+
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+
+        for (i = 0; i < bufv->count; ++i)
+            free(bufv->buf[i].mem);
+        free(bufv);
+
+        return;
+    }
+
+    buf = (char*)malloc(size);
+    if (buf == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if ((rv = gem5fs_read_data(file, buf, size, offset, 0)) < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_buf(req, buf, rv);
+
+    free(buf);
+}
+
+/*
+ *  Write data to an open file. Writes larger than GEM5FS_MAX_DATA_SIZE
+ *  are split into several requests. Returns the number of bytes written
+ *  or -errno.
+ */
+static int gem5fs_write_data(struct gem5fs_file *file, const char *buf, size_t size, off_t offset)
+{
+    int rv;
+    struct DataOperation dataOp;
+    int64_t bytes_written;
+    size_t done = 0;
+
+    printf("gem5fs_write called buf %p size %d offset %d\n", buf, (int)size, (int)offset);
+
+    gem5fs_data_changed();
+
+    do
+    {
+        size_t chunk = (size - done < GEM5FS_MAX_DATA_SIZE) ? size - done : GEM5FS_MAX_DATA_SIZE;
+
+        memset(&dataOp, 0, sizeof(struct DataOperation));
+        dataOp.hostfd = gem5fs_les32(file->hostfd);
+        dataOp.size = gem5fs_le64(chunk);
+        dataOp.offset = gem5fs_les64(offset + done);
+        dataOp.data = gem5fs_le64((uintptr_t)(buf + done));
+
+        if ((rv = gem5fs_syscall_buf(Write, 0, "", (void*)&dataOp, sizeof(struct DataOperation), (void*)&bytes_written, sizeof(int64_t), NULL)) != 0)
+            break;
+
+        printf("gem5fs_write wrote %d bytes\n", (int)gem5fs_les64(bytes_written));
+
+        done += gem5fs_les64(bytes_written);
+
+        if ((size_t)gem5fs_les64(bytes_written) < chunk)
+            break;
+    } while (done < size);
+
+    gem5fs_data_changed();
+
+    if (rv != 0)
+        return (done > 0) ? (int)done : rv;
+
+    return done;
+}
+
+/*
+ *  Open files that can be written hang off their cached node, so buffered
+ *  writes to a node can be written out before anything reads the node
+ *  from the host. The lists are guarded by gem5fs_cache_lock. Files with
+ *  buffered writes are also counted here, so the common case of nothing
+ *  being buffered takes no lock at all.
+ */
+static volatile unsigned int gem5fs_dirty_files = 0;
+
+static void gem5fs_writeback_register(fuse_ino_t ino, struct gem5fs_file *file)
+{
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    /* A file that is not on a node is never buffered. */
+    if ((file->node = gem5fs_node_get(ino)) != NULL)
+    {
+        file->next_writable = file->node->writable;
+        file->node->writable = file;
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+}
+
+static void gem5fs_writeback_unregister(struct gem5fs_file *file)
+{
+    struct gem5fs_forget_list list;
+    struct gem5fs_file **link;
+
+    if (file->node == NULL)
+        return;
+
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
+
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    for (link = &file->node->writable; *link != NULL; link = &(*link)->next_writable)
+    {
+        if (*link == file)
+        {
+            *link = file->next_writable;
+            break;
+        }
+    }
+
+    gem5fs_node_put(file->node, &list);
+    file->node = NULL;
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
+}
+
+/* Drop a reference to an open file, freeing it with the last one. */
+static void gem5fs_file_put(struct gem5fs_file *file)
+{
+    if (__sync_sub_and_fetch(&file->refs, 1) > 0)
+        return;
+
+    pthread_mutex_destroy(&file->lock);
+    free(file->writeback);
+    free(file->readahead);
+    free(file->prefetch);
+    free(file);
+}
+
+/*
+ *  Count a file as having buffered writes, or no longer having any.
+ *  Called with the file's lock held.
+ */
+static void gem5fs_writeback_dirty(struct gem5fs_file *file, int dirty)
+{
+    if (file->dirty == dirty)
+        return;
+
+    file->dirty = dirty;
+
+    if (dirty)
+    {
+        __sync_fetch_and_add(&file->node->dirty, 1);
+        __sync_fetch_and_add(&gem5fs_dirty_files, 1);
+    }
+    else
+    {
+        __sync_fetch_and_sub(&file->node->dirty, 1);
+        __sync_fetch_and_sub(&gem5fs_dirty_files, 1);
+    }
+}
+
+/*
+ *  Write out a file's buffered writes. A failure is kept and reported by
+ *  the next flush, fsync or release. Called with the file's lock held.
+ */
+static void gem5fs_writeback_flush(struct gem5fs_file *file)
+{
+    size_t done = 0;
+    int rv;
+
+    while (done < file->writeback_size)
+    {
+        rv = gem5fs_write_data(file, file->writeback + done, file->writeback_size - done, file->writeback_offset + done);
+
+        if (rv <= 0)
+        {
+            if (file->writeback_error == 0)
+                file->writeback_error = (rv < 0) ? rv : -EIO;
+            break;
+        }
+
+        done += rv;
+    }
+
+    file->writeback_size = 0;
+
+    if (file->dirty)
+        gem5fs_writeback_dirty(file, 0);
+}
+
+/* Write out a file's buffered writes and take any error from doing so. */
+static int gem5fs_writeback_sync(struct gem5fs_file *file)
+{
+    int rv;
+
+    pthread_mutex_lock(&file->lock);
+
+    gem5fs_writeback_flush(file);
+
+    rv = file->writeback_error;
+    file->writeback_error = 0;
+
+    pthread_mutex_unlock(&file->lock);
+
+    return rv;
+}
+
+/*
+ *  Write out the buffered writes of every open of a node. The files are
+ *  collected under gem5fs_cache_lock and written out holding only their
+ *  own lock, with a reference so a release can't free them meanwhile.
+ *  Returns the number of files that had any.
+ */
+static int gem5fs_writeback_node(fuse_ino_t ino)
+{
+    struct gem5fs_file *files[GEM5FS_WRITEBACK_BATCH];
+    struct gem5fs_node *node;
+    struct gem5fs_file *file;
+    unsigned int count, i;
+    int flushed = 0;
+
+    do
+    {
+        if (gem5fs_dirty_files == 0)
+            break;
+
+        count = 0;
+
+        pthread_mutex_lock(&gem5fs_cache_lock);
+
+        if ((node = gem5fs_node_find(ino)) != NULL && node->dirty > 0)
+        {
+            for (file = node->writable; file != NULL && count < GEM5FS_WRITEBACK_BATCH; file = file->next_writable)
+            {
+                if (!file->dirty)
+                    continue;
+
+                __sync_fetch_and_add(&file->refs, 1);
+                files[count++] = file;
+            }
+        }
+
+        pthread_mutex_unlock(&gem5fs_cache_lock);
+
+        for (i = 0; i < count; ++i)
+        {
+            pthread_mutex_lock(&files[i]->lock);
+
+            if (files[i]->writeback_size > 0)
+            {
+                gem5fs_writeback_flush(files[i]);
+                flushed++;
+            }
+
+            pthread_mutex_unlock(&files[i]->lock);
+
+            gem5fs_file_put(files[i]);
+        }
+    } while (count == GEM5FS_WRITEBACK_BATCH);
+
+    if (flushed > 0)
+        gem5fs_cache_invalidate(ino);
+
+    return flushed;
+}
+
+/*
+ *  Find room for a write of size bytes at offset in the file's write-back
+ *  buffer. A write that does not touch the buffered range, or that would
+ *  grow it past GEM5FS_WRITEBACK_SIZE, writes the buffer out first.
+ *  Returns where to copy the data to, or NULL if the write can't be
+ *  buffered. Called with the file's lock held.
+ */
+static char *gem5fs_writeback_reserve(struct gem5fs_file *file, size_t size, off_t offset)
+{
+    off_t end = file->writeback_offset + file->writeback_size;
+
+    if (size >= GEM5FS_WRITEBACK_SIZE)
+        return NULL;
+
+    if (file->writeback_size > 0
+        && (offset < file->writeback_offset || offset > end
+            || offset + (off_t)size > file->writeback_offset + GEM5FS_WRITEBACK_SIZE))
+        gem5fs_writeback_flush(file);
+
+    if (file->node == NULL)
+        return NULL;
+
+    if (file->writeback == NULL && (file->writeback = (char*)malloc(GEM5FS_WRITEBACK_SIZE)) == NULL)
+        return NULL;
+
+    if (file->writeback_size == 0)
+        file->writeback_offset = offset;
+
+    return file->writeback + (offset - file->writeback_offset);
+}
+
+/*
+ *  Add a write copied to where gem5fs_writeback_reserve said to the
+ *  buffered range. Called with the file's lock held.
+ */
+static void gem5fs_writeback_commit(struct gem5fs_file *file, size_t size, off_t offset)
+{
+    if (offset + (off_t)size > file->writeback_offset + (off_t)file->writeback_size)
+        file->writeback_size = offset + size - file->writeback_offset;
+
+    if (file->writeback_size > 0)
+        gem5fs_writeback_dirty(file, 1);
 
-    printf("%s called\n", __func__);
+    gem5fs_data_changed();
 
-    return rv; 
+    if (file->writeback_size == GEM5FS_WRITEBACK_SIZE)
+        gem5fs_writeback_flush(file);
 }
 
-/** File open operation */
-int gem5fs_open(const char *path, struct fuse_file_info *fi)
+/** Write data to an open file */
+void gem5fs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int rv;
-    int *hostfd;
+    int rv = size;
+    struct gem5fs_file *file = (struct gem5fs_file *)(uintptr_t)fi->fh;
+    char *dst;
 
-    if ((rv = gem5fs_syscall(Open, path, (void*)&(fi->flags), sizeof(int), (uint8_t**)&hostfd, NULL)) == 0)
+    gem5fs_cache_invalidate(ino);
+
+    /* Small writes are merged in the write-back buffer. */
+    pthread_mutex_lock(&file->lock);
+
+    if ((dst = gem5fs_writeback_reserve(file, size, offset)) != NULL)
+    {
+        memcpy(dst, buf, size);
+        gem5fs_writeback_commit(file, size, offset);
+    }
+    else
     {
-        printf("gem5fs_open got fd %d\n", *hostfd);
-        fi->fh = *hostfd;
-        free(hostfd);
+        gem5fs_writeback_flush(file);
+        rv = gem5fs_write_data(file, buf, size, offset);
     }
 
-    return rv;
+    pthread_mutex_unlock(&file->lock);
+
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_write(req, rv);
 }
 
-/** Read data from an open file */
-int gem5fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/*
+ *  Write data from a vector of buffers to an open file. Small writes are
+ *  copied into the write-back buffer. Otherwise memory buffers are sent
+ *  to gem5 as they are with one vectored request, and anything else, such
+ *  as a spliced pipe, is copied into a single buffer first.
+ */
+void gem5fs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
 {
-    int rv = 0;
-    struct DataOperation dataOp;
-    char *tmpBuf;
-    unsigned int bufSize;
+    int rv;
+    struct gem5fs_file *file = (struct gem5fs_file *)(uintptr_t)fi->fh;
+    struct WireSegment segments[GEM5FS_MAX_SEGMENTS];
+    struct VectorOperation vecOp;
+    size_t size = fuse_buf_size(buf);
+    size_t count = 0, i;
+    size_t skip = buf->off;
+    int64_t bytes_written;
+    int flat = !gem5fs_has_feature(GEM5FS_FEATURE_VECTORED)
+               || (buf->count - buf->idx) > GEM5FS_MAX_SEGMENTS;
+    char *mem;
+
+    gem5fs_cache_invalidate(ino);
+
+    pthread_mutex_lock(&file->lock);
+
+    if ((mem = gem5fs_writeback_reserve(file, size, offset)) != NULL)
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        ssize_t copied;
 
-    printf("gem5fs_read setting up dataOp\n");
+        dst.buf[0].mem = mem;
 
-    dataOp.hostfd = fi->fh;
-    dataOp.size = size;
-    dataOp.offset = offset;
-    dataOp.data = NULL;
+        if ((copied = fuse_buf_copy(&dst, buf, 0)) >= 0)
+            gem5fs_writeback_commit(file, copied, offset);
 
-    printf("gem5fs_read dataOp address is %p\n", &dataOp);
+        pthread_mutex_unlock(&file->lock);
 
-    if ((rv = gem5fs_syscall(Read, path, (void*)&dataOp, sizeof(struct DataOperation), (uint8_t**)&tmpBuf, &bufSize)) == 0)
-    {
-        printf("gem5fs_read got %d bytes\n", bufSize);
-        memcpy(buf, tmpBuf, bufSize);
-        free(tmpBuf);
+        if (copied < 0)
+            fuse_reply_err(req, -copied);
+        else
+            fuse_reply_write(req, copied);
+
+        return;
     }
 
-    return bufSize; 
-}
+    /* Earlier buffered writes go first. */
+    gem5fs_writeback_flush(file);
 
-/** Write data to an open file */
-int gem5fs_write(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
-{
-    int rv;
-    struct DataOperation dataOp;
-    ssize_t *bytes_written;
+    pthread_mutex_unlock(&file->lock);
+
+    for (i = buf->idx; !flat && i < buf->count; ++i)
+    {
+        if (buf->buf[i].flags & FUSE_BUF_IS_FD)
+        {
+            flat = 1;
+            break;
+        }
 
-    printf("gem5fs_write called path %s buf %p size %d offset %d\n", path, buf, size, offset);
+        if (buf->buf[i].size > skip)
+        {
+            segments[count].base = gem5fs_le64((uintptr_t)buf->buf[i].mem + skip);
+            segments[count].length = gem5fs_le64(buf->buf[i].size - skip);
+            count++;
+        }
+
+        skip = 0;
+    }
 
-    dataOp.hostfd = fi->fh;
-    dataOp.size = size;
-    dataOp.offset = offset;
-    dataOp.data = buf;
+    if (flat)
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        ssize_t copied;
+
+        dst.buf[0].mem = malloc(size);
+        if (dst.buf[0].mem == NULL)
+        {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
 
-    printf("gem5fs_write calling gem5fs_syscall\n");
+        if ((copied = fuse_buf_copy(&dst, buf, 0)) < 0)
+            rv = copied;
+        else
+            rv = gem5fs_write_data(file, (const char*)dst.buf[0].mem, copied, offset);
 
-    if ((rv = gem5fs_syscall(Write, path, (void*)&dataOp, sizeof(struct DataOperation), (uint8_t**)&bytes_written, NULL)) == 0)
+        free(dst.buf[0].mem);
+    }
+    else
     {
-        rv = *bytes_written;
-        free(bytes_written);
+        gem5fs_data_changed();
+
+        memset(&vecOp, 0, sizeof(struct VectorOperation));
+        vecOp.hostfd = gem5fs_les32(file->hostfd);
+        vecOp.count = gem5fs_le32(count);
+        vecOp.offset = gem5fs_les64(offset);
+        vecOp.segments = gem5fs_le64((uintptr_t)segments);
+
+        if ((rv = gem5fs_syscall_buf(WriteV, 0, "", (void*)&vecOp, sizeof(struct VectorOperation), (void*)&bytes_written, sizeof(int64_t), NULL)) == 0)
+        {
+            rv = gem5fs_les64(bytes_written);
+
+            printf("gem5fs_write_buf wrote %d bytes from %d buffers\n", rv, (int)count);
+        }
 
-        printf("gem5fs_write wrote %d bytes\n", rv);
+        gem5fs_data_changed();
     }
 
-    return rv;
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        fuse_reply_write(req, rv);
 }
 
 /** Get file system statistics */
-int gem5fs_statfs(const char *path, struct statvfs *statv)
+void gem5fs_statfs(fuse_req_t req, fuse_ino_t ino)
 {
     int rv;
-    int response_size;
-    struct statvfs *tmpStat;
+    struct WireStatvfs wire;
+    struct statvfs statv;
 
-    if ((rv = gem5fs_syscall(GetStats, path, NULL, 0, (uint8_t**)&tmpStat, &response_size)) == 0)
+    if ((rv = gem5fs_syscall_buf(GetStats, ino, "", NULL, 0, (void*)&wire, sizeof(struct WireStatvfs), NULL)) != 0)
     {
-        memcpy(statv, tmpStat, response_size);
-        free(tmpStat);
+        fuse_reply_err(req, -rv);
+        return;
     }
 
-    return rv;
+    gem5fs_decode_statvfs(&statv, &wire);
+    fuse_reply_statfs(req, &statv);
 }
 
 /** Possibly flush cached data */
-int gem5fs_flush(const char *path, struct fuse_file_info *fi)
+void gem5fs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    /* We don't cache data. */
-    return 0; 
+    /* Data buffered for this file is written out when it is closed. */
+    fuse_reply_err(req, -gem5fs_writeback_sync((struct gem5fs_file *)(uintptr_t)fi->fh));
 }
 
 /** Release an open file */
-int gem5fs_release(const char *path, struct fuse_file_info *fi)
+void gem5fs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    return gem5fs_syscall(Release, path, (void*)&(fi->fh), sizeof(int), NULL, NULL);
+    int rv, wbrv;
+    struct gem5fs_file *file = (struct gem5fs_file *)(uintptr_t)fi->fh;
+    int32_t wirefd = gem5fs_les32(file->hostfd);
+
+    wbrv = gem5fs_writeback_sync(file);
+    gem5fs_writeback_unregister(file);
+
+    rv = gem5fs_syscall(Release, ino, "", (void*)&wirefd, sizeof(int32_t), NULL, NULL);
+    if (wbrv != 0)
+        rv = wbrv;
+
+    /* A write-back of the node may still hold the file. */
+    gem5fs_file_put(file);
+
+    fuse_reply_err(req, -rv);
 }
 
 /** Synchronize file contents */
-int gem5fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+void gem5fs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
+    int rv;
     struct SyncOperation syncOp;
+    struct gem5fs_file *file = (struct gem5fs_file *)(uintptr_t)fi->fh;
+
+    if ((rv = gem5fs_writeback_sync(file)) == 0)
+    {
+        syncOp.datasync = gem5fs_le32(datasync ? 1 : 0);
+        syncOp.fd = gem5fs_les32(file->hostfd);
 
-    syncOp.datasync = (datasync ? 1 : 0);
-    syncOp.fd = fi->fh;
+        rv = gem5fs_syscall(Fsync, ino, "", (void*)&syncOp, sizeof(struct SyncOperation), NULL, NULL);
+    }
 
-    return gem5fs_syscall(Fsync, path, (void*)&syncOp, sizeof(struct SyncOperation), NULL, NULL);
+    fuse_reply_err(req, -rv);
 }
 
 /** Set extended attributes */
-int gem5fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+void gem5fs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
 {
     struct XAttrOperation xattrOp;
 
-    xattrOp.name = (char*)name;
-    xattrOp.value = (char*)value;
-    xattrOp.name_size = strlen(name);
-    xattrOp.value_size = size;
-    xattrOp.flags = flags;
+    memset(&xattrOp, 0, sizeof(struct XAttrOperation));
+    xattrOp.name = gem5fs_le64((uintptr_t)name);
+    xattrOp.value = gem5fs_le64((uintptr_t)value);
+    xattrOp.name_size = gem5fs_le64(strlen(name));
+    xattrOp.value_size = gem5fs_le64(size);
+    xattrOp.flags = gem5fs_les32(flags);
 
-    return gem5fs_syscall(SetXAttr, path, (void*)&xattrOp, sizeof(struct XAttrOperation), NULL, NULL);
+    fuse_reply_err(req, -gem5fs_syscall(SetXAttr, ino, "", (void*)&xattrOp, sizeof(struct XAttrOperation), NULL, NULL));
 }
 
-/** Get extended attributes */
-int gem5fs_getxattr(const char *path, const char *name, char *value, size_t size)
+/*
+ *  Get a value or list of extended attributes into a buffer of size bytes.
+ *  A size of 0 only asks for the size needed. Replies with the data, or
+ *  with the size if that was asked for.
+ */
+static void gem5fs_reply_xattr_op(fuse_req_t req, Operation op, fuse_ino_t ino, const char *name, size_t size)
 {
+    int rv;
     struct XAttrOperation xattrOp;
+    char *value = NULL;
+    int64_t value_size;
 
-    xattrOp.name = (char*)name;
-    xattrOp.value = (char*)value;
-    xattrOp.name_size = strlen(name);
-    xattrOp.value_size = size;
-    xattrOp.flags = 0;
+    if (size > 0 && (value = (char*)malloc(size)) == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    /* The pseudo instruction will copy data into value => NULL response */
-    return gem5fs_syscall(GetXAttr, path, (void*)&xattrOp, sizeof(struct XAttrOperation), NULL, NULL);
+    memset(&xattrOp, 0, sizeof(struct XAttrOperation));
+    xattrOp.name = gem5fs_le64((uintptr_t)name);
+    xattrOp.value = gem5fs_le64((uintptr_t)value);
+    xattrOp.name_size = gem5fs_le64((name != NULL) ? strlen(name) : 0);
+    xattrOp.value_size = gem5fs_le64(size);
+
+    /* The pseudo instruction copies the data into value, the response is its size. */
+    if ((rv = gem5fs_syscall_buf(op, ino, "", (void*)&xattrOp, sizeof(struct XAttrOperation), (void*)&value_size, sizeof(int64_t), NULL)) != 0)
+        fuse_reply_err(req, -rv);
+    else if (size == 0)
+        fuse_reply_xattr(req, gem5fs_les64(value_size));
+    else
+        fuse_reply_buf(req, value, gem5fs_les64(value_size));
+
+    free(value);
 }
 
-/** List extended attributes */
-int gem5fs_listxattr(const char *path, char *list, size_t size)
+/** Get extended attributes */
+void gem5fs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
-    struct XAttrOperation xattrOp;
-
-    xattrOp.name = NULL;;
-    xattrOp.value = list;
-    xattrOp.name_size = 0;
-    xattrOp.value_size = size;
-    xattrOp.flags = 0;
+    gem5fs_reply_xattr_op(req, GetXAttr, ino, name, size);
+}
 
-    return gem5fs_syscall(ListXAttr, path, (void*)&xattrOp, sizeof(struct XAttrOperation), NULL, NULL);
+/** List extended attributes */
+void gem5fs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    gem5fs_reply_xattr_op(req, ListXAttr, ino, NULL, size);
 }
 
 /** Remove extended attributes */
-int gem5fs_removexattr(const char *path, const char *name)
+void gem5fs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
     struct XAttrOperation xattrOp;
 
-    xattrOp.name = (char*)name;
-    xattrOp.value = NULL;
-    xattrOp.name_size = strlen(name);
-    xattrOp.value_size = 0;
-    xattrOp.flags = 0;
+    memset(&xattrOp, 0, sizeof(struct XAttrOperation));
+    xattrOp.name = gem5fs_le64((uintptr_t)name);
+    xattrOp.name_size = gem5fs_le64(strlen(name));
 
-    return gem5fs_syscall(RemoveXAttr, path, (void*)&xattrOp, sizeof(struct XAttrOperation), NULL, NULL);
+    fuse_reply_err(req, -gem5fs_syscall(RemoveXAttr, ino, "", (void*)&xattrOp, sizeof(struct XAttrOperation), NULL, NULL));
 }
 
-int gem5fs_opendir(const char *path, struct fuse_file_info *fi)
+/*
+ *  Decode the directory entry at pos in a listing into name, which holds
+ *  256 bytes, and the inode and type bits of st. Returns the position of
+ *  the next entry, or 0 at the end of the listing or if it is malformed.
+ *  The cookie resuming a streamed listing after the entry is put in
+ *  cookie. For ReadDirPlus listings, entry is set to the entry's lookup.
+ */
+static size_t gem5fs_dir_entry(struct gem5fs_dir *dir, size_t pos, char *name, struct stat *st, uint64_t *cookie, struct NodeEntry **entry)
 {
-    int rv = 0;
+    struct WireDirent *wire;
+    const char *wire_name;
+    size_t name_length, next;
 
-    printf("%s called\n", __func__);
+    if (entry != NULL)
+        *entry = NULL;
 
-    return rv; 
-}
+    if (!dir->packed)
+    {
+        if (pos + 256 > dir->size)
+            return 0;
 
-int gem5fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-	       struct fuse_file_info *fi)
-{
-    int rv;
-    int entry_count, entry;
-    char *all_entries, *cur_entry;
+        /* The type and inode number are filled in by lookup. */
+        memcpy(name, dir->entries + pos, 256);
+        name[255] = '\0';
+
+        st->st_ino = GEM5FS_UNKNOWN_INO;
+        st->st_mode = 0;
+        *cookie = 0;
+
+        return pos + 256;
+    }
 
-    if ((rv = gem5fs_syscall(ReadDir, path, NULL, 0, (uint8_t**)&all_entries, &entry_count)) == 0)
+    if (dir->plus)
     {
-        /*
-         *  The response is multiple 256 byte directory names 
-         *  concatenated into a single array.
-         */
-        entry_count /= 256;
-        cur_entry = all_entries;
+        struct WireDirentPlus *plus = (struct WireDirentPlus *)(dir->entries + pos);
 
-        for (entry = 0; entry < entry_count; ++entry)
-        {
-            char d_name[256];
-            memcpy(d_name, cur_entry, 256);
-            printf("gem5fs_readdir filling directory %s\n", d_name);
+        if (pos + sizeof(struct WireDirentPlus) > dir->size)
+            return 0;
 
-            if (filler(buf, d_name, NULL, 0) != 0)
-                return gem5fs_error(__func__, ENOMEM);
+        wire = &plus->dirent;
+        wire_name = (const char *)(plus + 1);
 
-            cur_entry += 256;
-        }
+        if (entry != NULL)
+            *entry = &plus->entry;
+    }
+    else
+    {
+        wire = (struct WireDirent *)(dir->entries + pos);
+        wire_name = (const char *)(wire + 1);
 
-        free(all_entries);
+        if (pos + sizeof(struct WireDirent) > dir->size)
+            return 0;
     }
 
-    return rv;
-}
+    name_length = gem5fs_le16(wire->nameLength);
+    next = pos + gem5fs_le16(wire->recordLength);
 
-int gem5fs_releasedir(const char *path, struct fuse_file_info *fi)
-{
-    int rv = 0;
+    if (next <= pos || next > dir->size || name_length > 255
+        || wire_name + name_length >= dir->entries + next)
+        return 0;
 
-    return rv; 
-}
+    memcpy(name, wire_name, name_length);
+    name[name_length] = '\0';
 
-int gem5fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
-{
-    int rv = 0;
+    /* Only the type bits of the mode are used. */
+    st->st_ino = gem5fs_le64(wire->ino);
+    st->st_mode = DTTOIF(gem5fs_le32(wire->type));
+    *cookie = gem5fs_le64(wire->cookie);
 
-    return rv; 
+    return next;
 }
 
-void *gem5fs_init(struct fuse_conn_info *conn)
+/*
+ *  Keep the lookups ReadDirPlus did for the kernel's lookups, which
+ *  usually follow right after the listing.
+ */
+static void gem5fs_keep_dir_entries(fuse_ino_t ino, struct gem5fs_dir *dir)
 {
-    return ((struct gem5fs_state *)fuse_get_context()->private_data);
-}
+    struct gem5fs_forget_list list;
+    struct NodeEntry *entry;
+    struct stat st;
+    char d_name[256];
+    uint64_t cookie;
+    size_t pos = 0;
 
-void gem5fs_destroy(void *userdata)
-{
-    printf("%s called\n", __func__);
+    memset(&list, 0, sizeof(struct gem5fs_forget_list));
 
-}
+    pthread_mutex_lock(&gem5fs_cache_lock);
 
-int gem5fs_access(const char *path, int mask)
-{
-    return gem5fs_syscall(Access, path, (void*)&mask, sizeof(int), NULL, NULL); 
+    while (pos < dir->size && (pos = gem5fs_dir_entry(dir, pos, d_name, &st, &cookie, &entry)) != 0)
+    {
+        if (entry != NULL && entry->node != 0)
+            (void)gem5fs_cache_entry(ino, d_name, entry, NULL, &list);
+    }
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
+
+    gem5fs_forget_flush(&list);
 }
 
-int gem5fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+/*
+ *  Open a directory. If gem5 can keep it open, readdir fetches one chunk
+ *  of entries at a time, so memory use does not depend on the size of
+ *  the directory, and offsets are gem5's cookies. Otherwise the whole
+ *  directory is read here and readdir is answered from this listing, with
+ *  offsets that are byte positions in it.
+ */
+void gem5fs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     int rv;
-    int *hostfd;
+    struct gem5fs_dir *dir;
+    unsigned int size;
 
-    if ((rv = gem5fs_syscall(Create, path, (void*)&mode, sizeof(mode_t), (uint8_t**)&hostfd, NULL)) == 0)
+    dir = (struct gem5fs_dir *)calloc(1, sizeof(struct gem5fs_dir));
+    if (dir == NULL)
     {
-        printf("gem5fs_open got fd %d\n", *hostfd);
-        fi->fh = *hostfd;
-        free(hostfd);
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    return rv;
+    /*
+     *  The response is either packed WireDirents, with or without the
+     *  entries' lookups, or multiple 256 byte directory names concatenated
+     *  into a single array.
+     */
+    dir->plus = gem5fs_has_feature(GEM5FS_FEATURE_READDIR_PLUS);
+    dir->packed = dir->plus || gem5fs_has_feature(GEM5FS_FEATURE_PACKED_DIRENTS);
+
+    if (gem5fs_has_feature(GEM5FS_FEATURE_DIR_STREAMS))
+    {
+        uint64_t handle;
+
+        if ((rv = gem5fs_syscall_buf(OpenDir, ino, "", NULL, 0, (void*)&handle, sizeof(uint64_t), NULL)) != 0)
+        {
+            free(dir);
+            fuse_reply_err(req, -rv);
+            return;
+        }
+
+        dir->handle = gem5fs_le64(handle);
+        fi->fh = (uintptr_t)dir;
+
+        fuse_reply_open(req, fi);
+        return;
+    }
+
+    if ((rv = gem5fs_syscall(dir->plus ? ReadDirPlus : ReadDir, ino, "", NULL, 0, (uint8_t**)&dir->entries, &size)) != 0)
+    {
+        free(dir);
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    dir->size = size;
+    fi->fh = (uintptr_t)dir;
+
+    if (dir->plus)
+        gem5fs_keep_dir_entries(ino, dir);
+
+    fuse_reply_open(req, fi);
 }
 
-int gem5fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+/*
+ *  Fetch the chunk of an open directory that follows the entry with the
+ *  given cookie into dir->entries. The chunk is sized so that it fills
+ *  about size bytes of FUSE directory entries.
+ */
+static int gem5fs_read_dir_chunk(fuse_ino_t ino, struct gem5fs_dir *dir, size_t size, uint64_t cookie)
 {
-    struct ftruncOperation ftOp;
+    int rv;
+    struct DirReadOperation readOp;
+    unsigned int chunk_size;
+    size_t capacity = size;
 
-    ftOp.length = offset;
-    ftOp.fd = fi->fh;
+    /* Plus records are larger than the FUSE entries they turn into. */
+    if (dir->plus)
+        capacity *= 4;
 
-    return gem5fs_syscall(Ftruncate, path, (void*)&ftOp, sizeof(struct ftruncOperation), NULL, NULL);
+    free(dir->entries);
+    dir->entries = (char*)malloc(capacity);
+    dir->size = 0;
+
+    if (dir->entries == NULL)
+        return gem5fs_error(__func__, ENOMEM);
+
+    memset(&readOp, 0, sizeof(struct DirReadOperation));
+    readOp.handle = gem5fs_le64(dir->handle);
+    readOp.cookie = gem5fs_le64(cookie);
+    readOp.capacity = gem5fs_le32(capacity);
+
+    if ((rv = gem5fs_syscall_buf(dir->plus ? ReadDirPlus : ReadDir, ino, "", (void*)&readOp, sizeof(struct DirReadOperation),
+                                 (void*)dir->entries, capacity, &chunk_size)) != 0)
+        return rv;
+
+    dir->size = chunk_size;
+
+    if (dir->plus)
+        gem5fs_keep_dir_entries(ino, dir);
+
+    return 0;
 }
 
-int gem5fs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+void gem5fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     int rv;
-    int response_size;
-    struct stat *tmpStat;
+    struct gem5fs_dir *dir = (struct gem5fs_dir *)(uintptr_t)fi->fh;
+    struct stat st;
+    size_t used = 0;
+    size_t pos = offset;
+    char *buf;
 
-    if ((rv = gem5fs_syscall(GetAttr, path, (void*)&(fi->fh), sizeof(fi->fh), (uint8_t**)&tmpStat, &response_size)) == 0)
+    /* A streamed directory is listed from the offset's cookie on. */
+    if (dir->handle != 0)
     {
-        memcpy(statbuf, tmpStat, response_size);
-        free(tmpStat);
+        if ((rv = gem5fs_read_dir_chunk(ino, dir, size, offset)) != 0)
+        {
+            fuse_reply_err(req, -rv);
+            return;
+        }
+
+        pos = 0;
     }
 
-    return rv;
-}
+    buf = (char*)malloc(size);
+    if (buf == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-int gem5fs_lock(const char *path, struct fuse_file_info *ffi, int cmd, struct flock *f_lock)
-{
-    int rv = 0;
+    memset(&st, 0, sizeof(struct stat));
 
-    printf("%s called\n", __func__);
+    /*
+     *  The offset of each entry is the cookie of the next one for streamed
+     *  directories and the position of the next one otherwise.
+     */
+    while (pos < dir->size)
+    {
+        char d_name[256];
+        size_t next, entry_size;
+        uint64_t cookie;
 
-    return rv;
+        if ((next = gem5fs_dir_entry(dir, pos, d_name, &st, &cookie, NULL)) == 0)
+            break;
+
+        entry_size = fuse_add_direntry(req, buf + used, size - used, d_name, &st, (dir->handle != 0) ? (off_t)cookie : (off_t)next);
+        if (entry_size > size - used)
+            break;
+
+        printf("gem5fs_readdir filling directory %s\n", d_name);
+
+        used += entry_size;
+        pos = next;
+    }
+
+    fuse_reply_buf(req, buf, used);
+
+    free(buf);
 }
 
-int gem5fs_bmap(const char *path, size_t blocksize, uint64_t *idx)
+void gem5fs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     int rv = 0;
+    struct gem5fs_dir *dir = (struct gem5fs_dir *)(uintptr_t)fi->fh;
 
-    printf("%s called\n", __func__);
+    if (dir->handle != 0)
+    {
+        uint64_t handle = gem5fs_le64(dir->handle);
+
+        rv = gem5fs_syscall(ReleaseDir, ino, "", (void*)&handle, sizeof(uint64_t), NULL, NULL);
+    }
 
-    return rv; 
+    free(dir->entries);
+    free(dir);
+
+    fuse_reply_err(req, -rv);
 }
 
-int gem5fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *ffi, unsigned int flags, void *data)
+void gem5fs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-    int rv = 0;
+    fuse_reply_err(req, 0);
+}
 
-    printf("%s called\n", __func__);
+void gem5fs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    struct gem5fs_node *root;
 
-    return rv;
+    /*
+     *  The rings are registered here rather than in main since the daemon
+     *  forks before the session loop calls init and the rings must belong
+     *  to the process making the requests.
+     */
+    if (gem5fs_has_feature(GEM5FS_FEATURE_RING))
+        gem5fs_ring_setup();
+
+    /*
+     *  Ask for the largest requests the kernel and libfuse can do, which
+     *  libfuse trims to its buffer size. Without big_writes the kernel
+     *  sends one write per page.
+     */
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+
+    conn->max_write = UINT_MAX;
+
+    printf("gem5fs_init: max_write %u max_readahead %u big_writes %d\n", conn->max_write,
+           conn->max_readahead, (conn->want & FUSE_CAP_BIG_WRITES) ? 1 : 0);
+
+    /* The kernel holds the root without looking it up. */
+    pthread_mutex_lock(&gem5fs_cache_lock);
+
+    if ((root = gem5fs_node_get(FUSE_ROOT_ID)) != NULL)
+        root->kernel = 1;
+
+    pthread_mutex_unlock(&gem5fs_cache_lock);
 }
 
-int gem5fs_poll(const char *path, struct fuse_file_info *ffi, struct fuse_pollhandle *ph, unsigned *reventsp)
+void gem5fs_destroy(void *userdata)
 {
-    int rv = 0;
-
     printf("%s called\n", __func__);
 
-    return rv;
 }
 
-int gem5fs_flock(const char *path, struct fuse_file_info *ffi, int op)
+void gem5fs_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-    int rv = 0;
-
-    printf("%s called\n", __func__);
+    int32_t wireMask = gem5fs_les32(mask);
 
-    return rv;
+    fuse_reply_err(req, -gem5fs_syscall(Access, ino, "", (void*)&wireMask, sizeof(int32_t), NULL, NULL));
 }
 
-int gem5fs_fallocate(const char *path, int mode, off_t off, off_t len, struct fuse_file_info *ffi)
+void gem5fs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
 {
-    int rv = 0;
+    int rv;
+    struct gem5fs_file *file;
+    struct fuse_entry_param e;
+    uint32_t wireMode = gem5fs_le32(mode);
+    int32_t wirefd;
 
-    printf("%s called\n", __func__);
+    file = (struct gem5fs_file *)calloc(1, sizeof(struct gem5fs_file));
+    if (file == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    return rv;
+    gem5fs_cache_invalidate(parent);
+    gem5fs_negative_forget(parent, name);
+
+    if ((rv = gem5fs_syscall_buf(Create, parent, name, (void*)&wireMode, sizeof(uint32_t), (void*)&wirefd, sizeof(int32_t), NULL)) != 0)
+    {
+        free(file);
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    file->hostfd = gem5fs_les32(wirefd);
+
+    printf("gem5fs_create got fd %d\n", file->hostfd);
+
+    /* FUSE needs the new entry along with the open file. */
+    if ((rv = gem5fs_do_lookup(parent, name, &e)) != 0)
+    {
+        (void)gem5fs_syscall(Release, 0, "", (void*)&wirefd, sizeof(int32_t), NULL, NULL);
+        free(file);
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    pthread_mutex_init(&file->lock, NULL);
+    file->refs = 1;
+    fi->fh = (uintptr_t)file;
+
+    gem5fs_writeback_register(e.ino, file);
+
+    fuse_reply_create(req, &e, fi);
 }
 
-struct fuse_operations gem5fs_oper = {
+struct fuse_lowlevel_ops gem5fs_oper = {
+  .init = gem5fs_init,
+  .destroy = gem5fs_destroy,
+  .lookup = gem5fs_lookup,
+  .forget = gem5fs_forget,
   .getattr = gem5fs_getattr,
+  .setattr = gem5fs_setattr,
   .readlink = gem5fs_readlink,
   .mknod = gem5fs_mknod,
   .mkdir = gem5fs_mkdir,
@@ -668,108 +2999,184 @@ struct fuse_operations gem5fs_oper = {
   .symlink = gem5fs_symlink,
   .rename = gem5fs_rename,
   .link = gem5fs_link,
-  .chmod = gem5fs_chmod,
-  .chown = gem5fs_chown,
-  .truncate = gem5fs_truncate,
   .open = gem5fs_open,
   .read = gem5fs_read,
   .write = gem5fs_write,
-  .statfs = gem5fs_statfs,
   .flush = gem5fs_flush,
   .release = gem5fs_release,
   .fsync = gem5fs_fsync,
-  .setxattr = gem5fs_setxattr,
-  .getxattr = gem5fs_getxattr,
-  .listxattr = gem5fs_listxattr,
-  .removexattr = gem5fs_removexattr,
   .opendir = gem5fs_opendir,
   .readdir = gem5fs_readdir,
   .releasedir = gem5fs_releasedir,
   .fsyncdir = gem5fs_fsyncdir,
-  .init = gem5fs_init,
-  .destroy = gem5fs_destroy,
+  .statfs = gem5fs_statfs,
+  .setxattr = gem5fs_setxattr,
+  .getxattr = gem5fs_getxattr,
+  .listxattr = gem5fs_listxattr,
+  .removexattr = gem5fs_removexattr,
   .access = gem5fs_access,
   .create = gem5fs_create,
-  .ftruncate = NULL,              // Call truncate instead
-  .fgetattr = gem5fs_fgetattr,
-  .lock = gem5fs_lock,
-  .utimens = gem5fs_utimens,
-  .bmap = gem5fs_bmap,
-  .ioctl = gem5fs_ioctl,
-  .poll = gem5fs_poll,
-//  .write_buf = NULL,              // Call write instead
-//  .read_buf = NULL,               // Call read instead
-//  .flock = gem5fs_flock,
-//  .fallocate = gem5fs_fallocate
-
+  .write_buf = gem5fs_write_buf,
+  .forget_multi = gem5fs_forget_multi,
+//  .getlk = NULL,                  // Locks are local to the guest
+//  .setlk = NULL,
+//  .bmap = NULL,
+//  .ioctl = NULL,
+//  .poll = NULL,
+//  .flock = NULL,
+//  .fallocate = NULL
 };
 
+/*
+ *  Tell gem5 the protocol version and features this FUSE fs supports and
+ *  keep the ones gem5 agreed to. Features gem5 does not offer fall back
+ *  to plain requests.
+ */
+static int gem5fs_negotiate()
+{
+    int rv;
+    struct NegotiateOperation negOp;
+    struct NegotiateOperation reply;
+    uint64_t wanted = GEM5FS_FEATURE_INLINE_RESPONSE
+                    | GEM5FS_FEATURE_RING
+                    | GEM5FS_FEATURE_COMPOUND
+                    | GEM5FS_FEATURE_VECTORED
+                    | GEM5FS_FEATURE_NODE_HANDLES
+                    | GEM5FS_FEATURE_PACKED_DIRENTS
+                    | GEM5FS_FEATURE_READDIR_PLUS
+                    | GEM5FS_FEATURE_DIR_STREAMS;
+
+    if (gem5fs_data->hostasync)
+        wanted |= GEM5FS_FEATURE_ASYNC;
+
+    negOp.magic = gem5fs_le32(GEM5FS_PROTOCOL_MAGIC);
+    negOp.version = gem5fs_le32(GEM5FS_PROTOCOL_VERSION);
+    negOp.features = gem5fs_le64(wanted);
+
+    if ((rv = gem5fs_syscall_buf(Negotiate, 0, "", (void*)&negOp, sizeof(struct NegotiateOperation), (void*)&reply, sizeof(struct NegotiateOperation), NULL)) != 0)
+        return rv;
+
+    if (gem5fs_le32(reply.magic) != GEM5FS_PROTOCOL_MAGIC)
+        return gem5fs_error(__func__, EPROTO);
+
+    gem5fs_data->version = gem5fs_le32(reply.version);
+    gem5fs_data->features = gem5fs_le64(reply.features);
+
+    printf("gem5fs negotiated protocol version %d, features %#llx\n", gem5fs_data->version, (unsigned long long)gem5fs_data->features);
+
+    /* Every callback names its file by node handle. */
+    if (!gem5fs_has_feature(GEM5FS_FEATURE_NODE_HANDLES))
+    {
+        fprintf(stderr, "gem5fs: gem5 does not support node handles.\n");
+        return gem5fs_error(__func__, EPROTO);
+    }
+
+    if (gem5fs_data->hostasync && !gem5fs_has_feature(GEM5FS_FEATURE_ASYNC))
+        fprintf(stderr, "gem5fs: gem5 has no worker threads, ignoring hostasync.\n");
+
+    return 0;
+}
+
 void gem5fs_usage()
 {
-    fprintf(stderr, "Usage: gem5fs <mountpoint>\n");
+    fprintf(stderr, "Usage: gem5fs [options] <mountpoint>\n"
+                    "\n"
+                    "gem5fs options:\n"
+                    "    -o hostasync           run slow host operations on gem5's worker threads\n"
+                    "    -o auto_cache          keep cached file data while the host file is unchanged\n"
+                    "    -o entry_timeout=T     cache names for T seconds (1.0)\n"
+                    "    -o attr_timeout=T      cache attributes for T seconds (1.0)\n"
+                    "    -o entry_cache=T       keep looked up names in gem5fs for T seconds (1.0)\n"
+                    "    -o attr_cache=T        keep attributes in gem5fs for T seconds (1.0)\n"
+                    "    -o negative_timeout=T  cache missing names in the kernel for T seconds (0.0)\n"
+                    "    -o negative_cache=T    keep missing names in gem5fs for T seconds (1.0)\n");
     abort();
 }
 
 int main(int argc, char *argv[])
 {
-    int fuse_stat;
-    struct gem5fs_state *gem5fs_data;
+    int rv = -1;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *chan;
+    struct fuse_session *session;
+    char *mountpoint;
+    int multithreaded, foreground;
 
     /*
-     *  Usage is gem5fs <path> 
+     *  Usage is gem5fs [options] <path> 
      */
     if(argc < 2)
     	gem5fs_usage();
 
-    gem5fs_data = malloc(sizeof(struct gem5fs_state));
+    gem5fs_data = calloc(1, sizeof(struct gem5fs_state));
     if (gem5fs_data == NULL) {
         fprintf(stderr, "Could not allocate memory for internal data.\n");
         abort();
     }
 
+    gem5fs_data->entry_timeout = 1.0;
+    gem5fs_data->attr_timeout = 1.0;
+    gem5fs_data->entry_cache = 1.0;
+    gem5fs_data->attr_cache = 1.0;
+    gem5fs_data->negative_timeout = 0.0;
+    gem5fs_data->negative_cache = 1.0;
+
+    /* Pull out the gem5fs options, the rest are passed to fuse. */
+    if (fuse_opt_parse(&args, gem5fs_data, gem5fs_opts, NULL) == -1)
+        gem5fs_usage();
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL)
+        gem5fs_usage();
+
     /* mmap m5op memory space if needed. */
     map_m5_mem();
 
     /* Determine the mountpoint of the filesystem, e.g., '/host' */
-    gem5fs_data->rootdir = realpath(argv[argc-1], NULL);
+    gem5fs_data->rootdir = realpath(mountpoint, NULL);
     printf("gem5fs attempting mount at '%s'.\n", gem5fs_data->rootdir);
 
+    /* Agree on a protocol version and features before anything else. */
+    if (gem5fs_negotiate() != 0)
+    {
+        fprintf(stderr, "Protocol negotiation with gem5 failed. Check warning output in gem5. Exiting.\n");
+        abort();
+    }
+
     /* Tell gem5 the mountpoint. */
     int set_rv = 0;
 
-    set_rv = gem5fs_syscall(SetMountpoint, "", (void*)gem5fs_data->rootdir, strlen(gem5fs_data->rootdir)+1, NULL, NULL);
-    
-    /* Check sizes */
-    struct TestOperation testOp;
-    int test_rv = 0;
-
-    testOp.size_t_size = sizeof(size_t);
-    testOp.mode_t_size = sizeof(mode_t);
-    testOp.uid_t_size = sizeof(uid_t);
-    testOp.gid_t_size = sizeof(gid_t);
-    testOp.struct_stat_size = sizeof(struct stat);
-    testOp.struct_statvfs_size = sizeof(struct statvfs);
-    testOp.char_size = sizeof(char);
-    testOp.off_t_size = sizeof(off_t);
-    testOp.int_size = sizeof(int);
-    testOp.DataOperation_size = sizeof(struct DataOperation);
-    testOp.ChownOperation_size = sizeof(struct ChownOperation);
-    testOp.SyncOperation_size = sizeof(struct SyncOperation);
-    testOp.XAttrOperation_size = sizeof(struct XAttrOperation);
-    testOp.ftruncOperation_size = sizeof(struct ftruncOperation);
-    testOp.TestOperation_size = sizeof(struct TestOperation);
-
-    test_rv = gem5fs_syscall(TestGem5, "", (void*)&testOp, sizeof(struct TestOperation), NULL, NULL);
-    if (test_rv != 0)
-    {
-        fprintf(stderr, "Type size sanity check failed. Check warning output in gem5. Exiting.\n");
-        abort();
-    }
+    set_rv = gem5fs_syscall(SetMountpoint, 0, "", (void*)gem5fs_data->rootdir, strlen(gem5fs_data->rootdir)+1, NULL, NULL);
+
     printf("gem5fs mounted at '%s'\n", gem5fs_data->rootdir);
 
     /* Turn over control to fuse. */
-    fuse_stat = fuse_main(argc, argv, &gem5fs_oper, gem5fs_data);
-    fprintf(stderr, "fuse_main returned %d.\n", fuse_stat);
+    if ((chan = fuse_mount(mountpoint, &args)) != NULL)
+    {
+        session = fuse_lowlevel_new(&args, &gem5fs_oper, sizeof(gem5fs_oper), gem5fs_data);
+
+        if (session != NULL)
+        {
+            if (fuse_set_signal_handlers(session) != -1)
+            {
+                fuse_session_add_chan(session, chan);
+
+                if (fuse_daemonize(foreground) != -1)
+                    rv = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(chan);
+            }
+
+            fuse_session_destroy(session);
+        }
+
+        fuse_unmount(mountpoint, chan);
+    }
+
+    fprintf(stderr, "fuse session returned %d.\n", rv);
+
+    free(mountpoint);
+    fuse_opt_free_args(&args);
     
-    return fuse_stat;
+    return rv ? 1 : 0;
 }
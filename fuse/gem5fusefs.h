@@ -43,9 +43,127 @@
 
 #define FUSE_USE_VERSION 26
 
-/* Keep track of the mountpoint here. */
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ *  Size of the buffer sent with each request for gem5 to write the
+ *  response into. Larger responses take a second GetResult call.
+ */
+#define GEM5FS_RESPONSE_CAPACITY 4096
+
+/*
+ *  Bytes read together with the open of a read-only file. Reads that fall
+ *  inside this window are answered without another request to gem5.
+ */
+#define GEM5FS_PREFETCH_SIZE (64 * 1024)
+
+/*
+ *  Largest buffer gem5fs_read_vector passes to fuse_reply_data. Larger
+ *  reads are split into several buffers that gem5 fills with one vectored
+ *  request.
+ */
+#define GEM5FS_SEGMENT_SIZE (64 * 1024)
+
+/*
+ *  Bounds on the window read ahead of a sequential stream of reads. The
+ *  window starts at the minimum and doubles each time it is refilled.
+ */
+#define GEM5FS_READAHEAD_MIN (256 * 1024)
+#define GEM5FS_READAHEAD_MAX (8 * 1024 * 1024)
+
+/*
+ *  Size of the buffer that merges small writes to an open file. Writes
+ *  that touch the buffered range are added to it and written to gem5 as
+ *  one Write when the buffer fills, a write elsewhere comes in, or the
+ *  file is flushed, synced or released.
+ */
+#define GEM5FS_WRITEBACK_SIZE (1024 * 1024)
+
+/* Open files of a node written out together, under one lock hold. */
+#define GEM5FS_WRITEBACK_BATCH 16
+
+struct gem5fs_node;
+
+/* Per open file state, kept in fuse_file_info's fh field. */
+struct gem5fs_file {
+    int hostfd;                 // File descriptor on the host
+    unsigned int generation;    // gem5fs_write_generation at open
+    char *prefetch;             // First bytes of the file or NULL
+    size_t prefetch_size;       // Valid bytes in prefetch
+    struct stat stat;           // Attributes at open
+    pthread_mutex_t lock;       // Guards the readahead and write-back state
+    char *readahead;            // Data read ahead of sequential reads or NULL
+    size_t readahead_capacity;  // Bytes allocated for readahead
+    off_t readahead_offset;     // File offset of readahead
+    size_t readahead_size;      // Valid bytes in readahead
+    int readahead_eof;          // readahead ends at the end of the file
+    unsigned int readahead_generation; // gem5fs_write_generation when read
+    size_t readahead_window;    // Bytes read ahead next, 0 if not sequential
+    off_t next_offset;          // Where the next sequential read starts
+    int refs;                   // The open and write-backs using the file
+    struct gem5fs_node *node;   // Cached node of a writable file or NULL
+    int dirty;                  // writeback holds data, counted in the node
+    char *writeback;            // Buffered writes or NULL
+    off_t writeback_offset;     // File offset of writeback
+    size_t writeback_size;      // Buffered bytes in writeback
+    int writeback_error;        // -errno of a failed write-back, or 0
+    struct gem5fs_file *next_writable;
+};
+
+/*
+ *  Open directory, kept in fuse_file_info's fh field. Either gem5 keeps
+ *  the directory open and readdir fetches a chunk at a time, or the whole
+ *  listing is read at opendir.
+ */
+struct gem5fs_dir {
+    uint64_t handle;            // gem5's handle, 0 if not streaming
+    char *entries;              // Listing or chunk as sent by gem5
+    size_t size;                // Bytes in entries
+    int packed;                 // WireDirents rather than 256 byte names
+    int plus;                   // WireDirentPlus records from ReadDirPlus
+};
+
+/*
+ *  Looked up nodes and names are cached in hash tables. Expired names are
+ *  swept out every GEM5FS_CACHE_SWEEP insertions, and forgets for the
+ *  nodes nothing uses anymore are sent in batches of GEM5FS_FORGET_BATCH.
+ */
+#define GEM5FS_CACHE_BUCKETS 4096
+#define GEM5FS_CACHE_SWEEP 1024
+#define GEM5FS_FORGET_BATCH 256
+
+/* Most names kept in the negative lookup cache at once. */
+#define GEM5FS_NEGATIVE_MAX 8192
+
+/*
+ *  Inode number given to readdir entries. The kernel ignores it without
+ *  use_ino and gets the real one, the node handle, from lookup.
+ */
+#define GEM5FS_UNKNOWN_INO 0xffffffff
+
+/*
+ *  Bounds in microseconds on the wait between polls for a request that is
+ *  still running on gem5's worker pool. The wait doubles after each poll.
+ */
+#define GEM5FS_POLL_MIN_US 20
+#define GEM5FS_POLL_MAX_US 10000
+
+/* Keep track of the mountpoint and options here. */
 struct gem5fs_state {
     char *rootdir;
+    int hostasync;              // Run slow operations on gem5's workers
+    int auto_cache;             // Keep the page cache of unchanged files
+    uint32_t version;           // Protocol version agreed on with gem5
+    uint64_t features;          // GEM5FS_FEATURE_ bits agreed on with gem5
+    double entry_timeout;       // Seconds the kernel may cache names
+    double attr_timeout;        // Seconds the kernel may cache attributes
+    double entry_cache;         // Seconds gem5fs caches names
+    double attr_cache;          // Seconds gem5fs caches attributes
+    double negative_timeout;    // Seconds the kernel may cache missing names
+    double negative_cache;      // Seconds gem5fs caches missing names
 };
 
 #endif // __GEM5FS_FUSE_GEM5FUSEFS_H__
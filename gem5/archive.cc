@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+/* st_dev of every entry, so NodeTable keys them by entry alone. */
+#define GEM5FS_ARCHIVE_DEV 0x67356673
+
+/*
+ *  An open directory of an archive. Positions 0 and 1 are . and .., and
+ *  the directory's entries follow in order.
+ */
+class ArchiveDir : public BackendDir
+{
+  public:
+    ArchiveDir(const ArchiveBackend *archive, uint32_t index)
+        : archive(archive), index(index), position(0) {}
+
+    struct dirent *read()
+    {
+        const ArchiveEntry& dir = archive->entry(index);
+        uint32_t child;
+
+        if (position >= (long)dir.childCount + 2)
+            return NULL;
+
+        memset(&dentry, 0, sizeof(dentry));
+
+        if (position < 2)
+        {
+            child = (position == 0) ? index : dir.parent;
+            strcpy(dentry.d_name, (position == 0) ? "." : "..");
+        }
+        else
+        {
+            child = dir.firstChild + position - 2;
+
+            std::string name = archive->name(child);
+            strncpy(dentry.d_name, name.c_str(), sizeof(dentry.d_name) - 1);
+        }
+
+        position++;
+
+        dentry.d_ino = child + 1;
+        dentry.d_off = position;
+        dentry.d_reclen = sizeof(dentry);
+        dentry.d_type = IFTODT(archive->entry(child).mode);
+
+        return &dentry;
+    }
+
+    long tell() { return position; }
+    void seek(long position) { this->position = position; }
+
+    int node() { return index + 1; }
+
+  private:
+    const ArchiveBackend *archive;
+    uint32_t index;
+    long position;
+    struct dirent dentry;
+};
+
+ArchiveBackend::ArchiveBackend(const char *path)
+{
+    int fd = ::open(path, O_RDONLY);
+    struct stat statbuf;
+    ArchiveHeader header;
+
+    if (fd < 0 || ::fstat(fd, &statbuf) != 0)
+        fatal("gem5fs: can't open archive %s: %s.\n", path, strerror(errno));
+
+    if ((size_t)statbuf.st_size < sizeof(header)
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, GEM5FS_ARCHIVE_MAGIC, sizeof(header.magic)) != 0)
+        fatal("gem5fs: %s is not a gem5fs-pack image.\n", path);
+
+    if (header.version != GEM5FS_ARCHIVE_VERSION || header.byteOrder != GEM5FS_ARCHIVE_BYTE_ORDER)
+        fatal("gem5fs: archive %s was packed for another version or byte order.\n", path);
+
+    if (header.size > (uint64_t)statbuf.st_size || header.entryCount == 0
+        || header.entryOffset > header.size
+        || header.entryCount > (header.size - header.entryOffset) / sizeof(ArchiveEntry)
+        || header.nameOffset > header.size || header.nameSize > header.size - header.nameOffset)
+        fatal("gem5fs: archive %s is truncated or damaged.\n", path);
+
+    void *mapping = mmap(NULL, header.size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (mapping == MAP_FAILED)
+        fatal("gem5fs: can't map archive %s: %s.\n", path, strerror(errno));
+
+    ::close(fd);
+
+    image = (const char *)mapping;
+    imageSize = header.size;
+    entries = (const ArchiveEntry *)(image + header.entryOffset);
+    entryCount = header.entryCount;
+    names = image + header.nameOffset;
+
+    /* Check every offset once, so lookups and reads can trust them. */
+    for (uint32_t index = 0; index < entryCount; ++index)
+    {
+        const ArchiveEntry& entry = entries[index];
+
+        if (entry.parent >= entryCount
+            || entry.nameOffset > header.nameSize
+            || entry.nameLength > header.nameSize - entry.nameOffset
+            || entry.firstChild > entryCount
+            || entry.childCount > entryCount - entry.firstChild
+            || (!S_ISDIR(entry.mode) && entry.childCount != 0)
+            || (!S_ISDIR(entry.mode) && (entry.dataOffset > imageSize
+                                         || entry.size > imageSize - entry.dataOffset)))
+            fatal("gem5fs: archive %s has a bad entry %d.\n", path, index);
+    }
+
+    if (!S_ISDIR(entries[0].mode))
+        fatal("gem5fs: the root of archive %s is not a directory.\n", path);
+
+    /* A directory's st_nlink counts the .. of each subdirectory. */
+    links.assign(entryCount, 1);
+
+    for (uint32_t index = 0; index < entryCount; ++index)
+    {
+        if (S_ISDIR(entries[index].mode))
+        {
+            links[index] += 1;
+
+            if (index != 0)
+                links[entries[index].parent]++;
+        }
+    }
+
+    DPRINTF(gem5fs, "gem5fs: serving archive %s, %d entries\n", path, entryCount);
+}
+
+ArchiveBackend::~ArchiveBackend()
+{
+    munmap((void *)image, imageSize);
+}
+
+std::string ArchiveBackend::name(uint32_t index) const
+{
+    return std::string(names + entries[index].nameOffset, entries[index].nameLength);
+}
+
+int64_t ArchiveBackend::handleEntry(int handle) const
+{
+    if (handle < 1 || (uint32_t)handle > entryCount)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return handle - 1;
+}
+
+int64_t ArchiveBackend::findChild(uint32_t dir, const char *name, size_t length) const
+{
+    uint32_t low = entries[dir].firstChild;
+    uint32_t high = low + entries[dir].childCount;
+
+    /* Same order as the std::sort of names in gem5fs-pack. */
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        const ArchiveEntry& entry = entries[middle];
+        int cmp = memcmp(names + entry.nameOffset, name, std::min((size_t)entry.nameLength, length));
+
+        if (cmp == 0)
+            cmp = (entry.nameLength < length) ? -1 : (entry.nameLength > length);
+
+        if (cmp == 0)
+            return middle;
+        else if (cmp < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return -1;
+}
+
+int64_t ArchiveBackend::resolve(int dir, const char *name) const
+{
+    int64_t current = 0;
+
+    if (dir != AT_FDCWD && name[0] != '/')
+    {
+        current = handleEntry(dir);
+
+        if (current < 0)
+            return -1;
+    }
+
+    while (*name != '\0')
+    {
+        if (*name == '/')
+        {
+            name++;
+            continue;
+        }
+
+        size_t length = strcspn(name, "/");
+
+        if (!S_ISDIR(entries[current].mode))
+        {
+            errno = ENOTDIR;
+            return -1;
+        }
+
+        if (length == 2 && name[0] == '.' && name[1] == '.')
+        {
+            current = entries[current].parent;
+        }
+        else if (length != 1 || name[0] != '.')
+        {
+            current = findChild(current, name, length);
+
+            if (current < 0)
+            {
+                errno = ENOENT;
+                return -1;
+            }
+        }
+
+        name += length;
+    }
+
+    return current;
+}
+
+void ArchiveBackend::fillStat(uint32_t index, struct stat *statbuf) const
+{
+    const ArchiveEntry& entry = entries[index];
+
+    memset(statbuf, 0, sizeof(*statbuf));
+
+    statbuf->st_dev = GEM5FS_ARCHIVE_DEV;
+    statbuf->st_ino = index + 1;
+    statbuf->st_mode = entry.mode;
+    statbuf->st_nlink = links[index];
+    statbuf->st_uid = entry.uid;
+    statbuf->st_gid = entry.gid;
+    statbuf->st_size = entry.size;
+    statbuf->st_blksize = 4096;
+    statbuf->st_blocks = (entry.size + 511) / 512;
+    statbuf->st_atim.tv_sec = statbuf->st_mtim.tv_sec = statbuf->st_ctim.tv_sec = entry.mtime;
+    statbuf->st_atim.tv_nsec = statbuf->st_mtim.tv_nsec = statbuf->st_ctim.tv_nsec = entry.mtimeNsec;
+}
+
+int ArchiveBackend::openNode(int dir, const char *name)
+{
+    int64_t index = resolve(dir, name);
+
+    return (index < 0) ? -1 : index + 1;
+}
+
+int ArchiveBackend::stat(int dir, const char *name, struct stat *statbuf)
+{
+    int64_t index = resolve(dir, name);
+
+    if (index < 0)
+        return -1;
+
+    fillStat(index, statbuf);
+
+    return 0;
+}
+
+ssize_t ArchiveBackend::readLink(int dir, const char *name, char *buf, size_t size)
+{
+    int64_t index = resolve(dir, name);
+
+    if (index < 0)
+        return -1;
+
+    if (!S_ISLNK(entries[index].mode))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t length = std::min((size_t)entries[index].size, size);
+
+    memcpy(buf, image + entries[index].dataOffset, length);
+
+    return length;
+}
+
+int ArchiveBackend::access(int dir, const char *name, int mask)
+{
+    int64_t index = resolve(dir, name);
+
+    if (index < 0)
+        return -1;
+
+    if (mask & W_OK)
+    {
+        errno = EROFS;
+        return -1;
+    }
+
+    if ((mask & X_OK) && !(entries[index].mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ArchiveBackend::statfs(int dir, const char *name, struct statvfs *statbuf)
+{
+    if (resolve(dir, name) < 0)
+        return -1;
+
+    memset(statbuf, 0, sizeof(*statbuf));
+
+    statbuf->f_bsize = 4096;
+    statbuf->f_frsize = 4096;
+    statbuf->f_blocks = (imageSize + 4095) / 4096;
+    statbuf->f_files = entryCount;
+    statbuf->f_fsid = GEM5FS_ARCHIVE_DEV;
+    statbuf->f_flag = ST_RDONLY;
+    statbuf->f_namemax = 255;
+
+    return 0;
+}
+
+/* The image is never changed. */
+static int ReadOnly()
+{
+    errno = EROFS;
+    return -1;
+}
+
+int ArchiveBackend::truncate(int dir, const char *name, off_t length) { return ReadOnly(); }
+int ArchiveBackend::chmod(int dir, const char *name, mode_t mode) { return ReadOnly(); }
+int ArchiveBackend::chown(int dir, const char *name, uid_t uid, gid_t gid) { return ReadOnly(); }
+int ArchiveBackend::mkdir(int dir, const char *name, mode_t mode) { return ReadOnly(); }
+int ArchiveBackend::rmdir(int dir, const char *name) { return ReadOnly(); }
+int ArchiveBackend::unlink(int dir, const char *name) { return ReadOnly(); }
+int ArchiveBackend::symlink(const char *target, int dir, const char *name) { return ReadOnly(); }
+int ArchiveBackend::rename(int dir, const char *name, int newDir, const char *newName) { return ReadOnly(); }
+
+int ArchiveBackend::setXAttr(int dir, const char *name, const char *xname, const void *value, size_t size, int flags)
+{
+    return ReadOnly();
+}
+
+ssize_t ArchiveBackend::getXAttr(int dir, const char *name, const char *xname, void *value, size_t size)
+{
+    /* Images don't keep extended attributes. */
+    if (resolve(dir, name) >= 0)
+        errno = ENODATA;
+
+    return -1;
+}
+
+ssize_t ArchiveBackend::listXAttr(int dir, const char *name, char *list, size_t size)
+{
+    return (resolve(dir, name) < 0) ? -1 : 0;
+}
+
+int ArchiveBackend::removeXAttr(int dir, const char *name, const char *xname)
+{
+    return ReadOnly();
+}
+
+BackendDir *ArchiveBackend::openDir(int dir, const char *name)
+{
+    int64_t index = resolve(dir, name);
+
+    if (index < 0)
+        return NULL;
+
+    if (!S_ISDIR(entries[index].mode))
+    {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    return new ArchiveDir(this, index);
+}
+
+int ArchiveBackend::open(int dir, const char *name, int flags, mode_t mode)
+{
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC)))
+        return ReadOnly();
+
+    int64_t index = resolve(dir, name);
+
+    if (index < 0)
+        return -1;
+
+    if (S_ISLNK(entries[index].mode))
+    {
+        errno = ELOOP;
+        return -1;
+    }
+
+    return index + 1;
+}
+
+int ArchiveBackend::close(int fd)
+{
+    return (handleEntry(fd) < 0) ? -1 : 0;
+}
+
+ssize_t ArchiveBackend::read(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    int64_t index = handleEntry(fd);
+
+    if (index < 0)
+        return -1;
+
+    const ArchiveEntry& entry = entries[index];
+
+    if (S_ISDIR(entry.mode))
+    {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if (offset < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t position = offset;
+    size_t done = 0;
+
+    for (int i = 0; i < iovcnt && position < entry.size; ++i)
+    {
+        size_t length = std::min((uint64_t)iov[i].iov_len, entry.size - position);
+
+        memcpy(iov[i].iov_base, image + entry.dataOffset + position, length);
+
+        position += length;
+        done += length;
+    }
+
+    return done;
+}
+
+ssize_t ArchiveBackend::write(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    /* Files are only opened for reading. */
+    if (handleEntry(fd) >= 0)
+        errno = EBADF;
+
+    return -1;
+}
+
+int ArchiveBackend::ftruncate(int fd, off_t length)
+{
+    return (handleEntry(fd) < 0) ? -1 : ReadOnly();
+}
+
+int ArchiveBackend::fsync(int fd, bool datasync)
+{
+    return (handleEntry(fd) < 0) ? -1 : 0;
+}
+
+int ArchiveBackend::fstat(int fd, struct stat *statbuf)
+{
+    int64_t index = handleEntry(fd);
+
+    if (index < 0)
+        return -1;
+
+    fillStat(index, statbuf);
+
+    return 0;
+}
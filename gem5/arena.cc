@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/arena.h"
+
+#include "base/misc.hh"
+
+using namespace gem5fs;
+
+/* Block sizes of each class, not counting the header. */
+static const size_t classSizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+
+#define GEM5FS_ARENA_CLASSES (sizeof(classSizes) / sizeof(classSizes[0]))
+#define GEM5FS_ARENA_SLAB_SIZE (256 * 1024)
+
+/* Marks blocks too large for any class, these are malloc'ed. */
+#define GEM5FS_ARENA_LARGE 0xffffffff
+
+/*
+ *  Every block starts with its class so release knows where it goes. The
+ *  header is 16 bytes so the block itself stays 16 byte aligned.
+ */
+struct BlockHeader
+{
+    uint32_t sizeClass;
+    uint32_t reserved;
+    uint64_t reserved2;
+};
+
+ResponseArena *ResponseArena::get()
+{
+    static ResponseArena *arena = new ResponseArena();
+
+    return arena;
+}
+
+ResponseArena::ResponseArena()
+    : freeLists(GEM5FS_ARENA_CLASSES, NULL)
+{
+}
+
+/*
+ *  Carve a new slab into blocks of a class. Called with the lock held.
+ */
+void ResponseArena::refill(unsigned int sizeClass)
+{
+    size_t blockSize = sizeof(BlockHeader) + classSizes[sizeClass];
+    size_t count = GEM5FS_ARENA_SLAB_SIZE / blockSize;
+    uint8_t *slab = (uint8_t*)malloc(count * blockSize);
+
+    if (slab == NULL)
+        fatal("gem5fs: out of memory for response data.\n");
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        BlockHeader *header = (BlockHeader*)(slab + i * blockSize);
+        FreeBlock *block = (FreeBlock*)(header + 1);
+
+        header->sizeClass = sizeClass;
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    }
+}
+
+void *ResponseArena::allocate(size_t size)
+{
+    unsigned int sizeClass = 0;
+
+    while (sizeClass < GEM5FS_ARENA_CLASSES && size > classSizes[sizeClass])
+        sizeClass++;
+
+    if (sizeClass == GEM5FS_ARENA_CLASSES)
+    {
+        BlockHeader *header = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+
+        if (header == NULL)
+            fatal("gem5fs: out of memory for response data.\n");
+
+        header->sizeClass = GEM5FS_ARENA_LARGE;
+
+        return header + 1;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (freeLists[sizeClass] == NULL)
+        refill(sizeClass);
+
+    FreeBlock *block = freeLists[sizeClass];
+    freeLists[sizeClass] = block->next;
+
+    return block;
+}
+
+void ResponseArena::release(void *block)
+{
+    if (block == NULL)
+        return;
+
+    BlockHeader *header = (BlockHeader*)block - 1;
+
+    if (header->sizeClass == GEM5FS_ARENA_LARGE)
+    {
+        free(header);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    FreeBlock *freed = (FreeBlock*)block;
+    freed->next = freeLists[header->sizeClass];
+    freeLists[header->sizeClass] = freed;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_ARENA_H__
+#define __GEM5FS_GEM5_ARENA_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <mutex>
+#include <vector>
+
+namespace gem5fs {
+
+/*
+ *  Allocator for response data and buffered responses. Small blocks come
+ *  from a few size classes carved out of large slabs and go back on a free
+ *  list for their class when released, so a steady stream of responses
+ *  reuses the same memory instead of going through malloc each time.
+ *  Slabs are never returned, so gem5's footprint stays at the peak number
+ *  of responses in flight. Larger blocks are plain malloc.
+ *
+ *  Worker threads allocate responses that the simulation thread releases,
+ *  so the free lists are shared under a lock.
+ */
+class ResponseArena
+{
+  public:
+    static ResponseArena *get();
+
+    /* Allocate a block of at least size bytes, aligned for any wire struct. */
+    void *allocate(size_t size);
+
+    /* Return a block from allocate. NULL is ignored. */
+    void release(void *block);
+
+  private:
+    ResponseArena();
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    void refill(unsigned int sizeClass);
+
+    std::vector<FreeBlock*> freeLists;
+    std::mutex lock;
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_ARENA_H__
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/async.h"
+
+using namespace gem5fs;
+
+#define GEM5FS_DEFAULT_ASYNC_THREADS 4
+
+AsyncJob::AsyncJob(Operation oper, Work work)
+    : oper(oper), work(work), success(false), responseData(NULL),
+      responseSize(0), errnum(0), done(false)
+{
+}
+
+void AsyncJob::finish(bool success, uint8_t *responseData, unsigned int responseSize)
+{
+    /* errno is per thread, so save it for the simulation thread. */
+    this->errnum = errno;
+    this->success = success;
+    this->responseData = responseData;
+    this->responseSize = responseSize;
+
+    done.store(true, std::memory_order_release);
+}
+
+/* Worker threads to start, GEM5FS_ASYNC_THREADS if it is set. */
+static unsigned int AsyncThreads()
+{
+    const char *env = getenv("GEM5FS_ASYNC_THREADS");
+
+    if (env != NULL)
+        return (unsigned int)strtoul(env, NULL, 10);
+
+    return GEM5FS_DEFAULT_ASYNC_THREADS;
+}
+
+WorkerPool *WorkerPool::get()
+{
+    static WorkerPool *pool = new WorkerPool(AsyncThreads());
+
+    return pool;
+}
+
+WorkerPool::WorkerPool(unsigned int threads)
+    : stopping(false)
+{
+    for (unsigned int i = 0; i < threads; ++i)
+        workers.push_back(std::thread(&WorkerPool::run, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    cond.notify_all();
+
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter)
+        iter->join();
+}
+
+void WorkerPool::submit(AsyncJob *job)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(job);
+    }
+
+    cond.notify_one();
+}
+
+void WorkerPool::run()
+{
+    while (true)
+    {
+        AsyncJob *job;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            while (queue.empty() && !stopping)
+                cond.wait(guard);
+
+            if (stopping)
+                return;
+
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        errno = 0;
+        job->work(job);
+    }
+}
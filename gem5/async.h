@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_ASYNC_H__
+#define __GEM5FS_GEM5_ASYNC_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gem5fs {
+
+/*
+ *  A host operation that may run on the worker pool. The work function
+ *  only makes host syscalls. Guest memory is only accessed from the
+ *  simulation thread, before the job is submitted and after it is done.
+ */
+class AsyncJob
+{
+  public:
+    typedef std::function<void (AsyncJob *job)> Work;
+
+    AsyncJob(Operation oper, Work work);
+
+    /* Called by the work function with the result of the operation. */
+    void finish(bool success, uint8_t *responseData, unsigned int responseSize);
+
+    bool isDone() const { return done.load(std::memory_order_acquire); }
+
+    Operation oper;
+    Work work;
+
+    bool success;
+    uint8_t *responseData;
+    unsigned int responseSize;
+    int errnum;
+
+  private:
+    std::atomic<bool> done;
+};
+
+/*
+ *  Pool of host threads running AsyncJobs. The number of threads is taken
+ *  from the GEM5FS_ASYNC_THREADS environment variable, 0 disables the pool
+ *  and every operation runs on the simulation thread.
+ */
+class WorkerPool
+{
+  public:
+    static WorkerPool *get();
+
+    ~WorkerPool();
+
+    bool enabled() const { return !workers.empty(); }
+
+    void submit(AsyncJob *job);
+
+  private:
+    WorkerPool(unsigned int threads);
+
+    void run();
+
+    std::vector<std::thread> workers;
+    std::deque<AsyncJob*> queue;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stopping;
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_ASYNC_H__
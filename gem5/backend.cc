@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/backend.h"
+#include "gem5fs/gem5/archive.h"
+#include "gem5fs/gem5/posix.h"
+#include "gem5fs/gem5/remote.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+/* Build the backend GEM5FS_BACKEND and GEM5FS_SERVER ask for. */
+static Backend *CreateBackend()
+{
+    const char *env = getenv("GEM5FS_BACKEND");
+
+    if (env != NULL && strncmp(env, "archive:", 8) == 0)
+    {
+        /* The image is mapped in this process, so there's nothing to ask a server for. */
+        if (RemoteHost::get()->enabled())
+            warn("gem5fs: GEM5FS_SERVER is not used with an archive.\n");
+
+        return new ArchiveBackend(env + 8);
+    }
+
+    Backend *backend = NULL;
+
+    if (env == NULL || strcmp(env, "posix") == 0)
+        backend = new PosixBackend();
+    else
+        fatal("gem5fs: unknown GEM5FS_BACKEND %s.\n", env);
+
+    /* Open files go to gem5fs-server when there is one. */
+    if (RemoteHost::get()->enabled())
+        backend = new RemoteBackend(backend);
+
+    return backend;
+}
+
+Backend *Backend::get()
+{
+    /* Worker threads call this too, the first call constructs it once. */
+    static Backend *backend = CreateBackend();
+
+    return backend;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_BACKEND_H__
+#define __GEM5FS_GEM5_BACKEND_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace gem5fs {
+
+/*
+ *  An open directory of a Backend, read one entry at a time.
+ */
+class BackendDir
+{
+  public:
+    virtual ~BackendDir() {}
+
+    /* Next entry, or NULL at the end with errno left at 0. */
+    virtual struct dirent *read() = 0;
+
+    /* Position of the next entry, for seek. Position 0 is the start. */
+    virtual long tell() = 0;
+    virtual void seek(long position) = 0;
+
+    /* Handle of the directory, to name its entries in Backend calls. */
+    virtual int node() = 0;
+};
+
+/*
+ *  Host side of the file operations. ProcessRequest decodes requests from
+ *  the FUSE fs and calls the backend for everything it does on the host.
+ *
+ *  Entries are named as in the *at() calls, by a directory handle and a
+ *  name: dir is a handle returned by openNode, or AT_FDCWD with a path
+ *  from the host's root, and an empty name is dir itself. Calls return
+ *  what the POSIX calls they are named after return, with errno set on
+ *  failure. Calls on open files and directories may be made from the
+ *  worker threads, so backends have to be thread safe.
+ */
+class Backend
+{
+  public:
+    /*
+     *  The backend for the mount, chosen with the GEM5FS_BACKEND
+     *  environment variable. posix, the default, uses the host file
+     *  system directly, and archive:image serves a gem5fs-pack image.
+     */
+    static Backend *get();
+
+    virtual ~Backend() {}
+
+    /*
+     *  Handle for the entry name in dir, not following a symlink, that
+     *  stays valid until closeNode even if the entry is renamed.
+     */
+    virtual int openNode(int dir, const char *name) = 0;
+    virtual void closeNode(int node) = 0;
+
+    /* Attributes of an entry. Symlinks are not followed. */
+    virtual int stat(int dir, const char *name, struct stat *statbuf) = 0;
+    virtual ssize_t readLink(int dir, const char *name, char *buf, size_t size) = 0;
+    virtual int access(int dir, const char *name, int mask) = 0;
+    virtual int statfs(int dir, const char *name, struct statvfs *statbuf) = 0;
+
+    virtual int truncate(int dir, const char *name, off_t length) = 0;
+    virtual int chmod(int dir, const char *name, mode_t mode) = 0;
+    virtual int chown(int dir, const char *name, uid_t uid, gid_t gid) = 0;
+    virtual int mkdir(int dir, const char *name, mode_t mode) = 0;
+    virtual int rmdir(int dir, const char *name) = 0;
+    virtual int unlink(int dir, const char *name) = 0;
+    virtual int symlink(const char *target, int dir, const char *name) = 0;
+    virtual int rename(int dir, const char *name, int newDir, const char *newName) = 0;
+
+    /* Extended attributes of the entry, or of its symlink if it is one. */
+    virtual int setXAttr(int dir, const char *name, const char *xname, const void *value, size_t size, int flags) = 0;
+    virtual ssize_t getXAttr(int dir, const char *name, const char *xname, void *value, size_t size) = 0;
+    virtual ssize_t listXAttr(int dir, const char *name, char *list, size_t size) = 0;
+    virtual int removeXAttr(int dir, const char *name, const char *xname) = 0;
+
+    /* Open a directory. Deleting the BackendDir closes it. */
+    virtual BackendDir *openDir(int dir, const char *name) = 0;
+
+    /* Open files, named by the descriptor open returns. */
+    virtual int open(int dir, const char *name, int flags, mode_t mode) = 0;
+    virtual int close(int fd) = 0;
+    virtual ssize_t read(int fd, const struct iovec *iov, int iovcnt, off_t offset) = 0;
+    virtual ssize_t write(int fd, const struct iovec *iov, int iovcnt, off_t offset) = 0;
+    virtual int ftruncate(int fd, off_t length) = 0;
+    virtual int fsync(int fd, bool datasync) = 0;
+    virtual int fstat(int fd, struct stat *statbuf) = 0;
+
+    /* Hint that length bytes at offset will be read soon. */
+    virtual void willNeed(int fd, off_t offset, off_t length) {}
+
+    /*
+     *  Host descriptor of an open file that the mmap engine can map, or -1
+     *  if the file is not a host file open in this process.
+     */
+    virtual int hostFd(int fd) { return -1; }
+};
+
+/*
+ *  A backend that passes every call on to another one. Decorators, such
+ *  as a cache in front of a backend, override the calls they change.
+ */
+class BackendDecorator : public Backend
+{
+  public:
+    BackendDecorator(Backend *inner) : inner(inner) {}
+    ~BackendDecorator() { delete inner; }
+
+    int openNode(int dir, const char *name) { return inner->openNode(dir, name); }
+    void closeNode(int node) { inner->closeNode(node); }
+
+    int stat(int dir, const char *name, struct stat *statbuf) { return inner->stat(dir, name, statbuf); }
+    ssize_t readLink(int dir, const char *name, char *buf, size_t size) { return inner->readLink(dir, name, buf, size); }
+    int access(int dir, const char *name, int mask) { return inner->access(dir, name, mask); }
+    int statfs(int dir, const char *name, struct statvfs *statbuf) { return inner->statfs(dir, name, statbuf); }
+
+    int truncate(int dir, const char *name, off_t length) { return inner->truncate(dir, name, length); }
+    int chmod(int dir, const char *name, mode_t mode) { return inner->chmod(dir, name, mode); }
+    int chown(int dir, const char *name, uid_t uid, gid_t gid) { return inner->chown(dir, name, uid, gid); }
+    int mkdir(int dir, const char *name, mode_t mode) { return inner->mkdir(dir, name, mode); }
+    int rmdir(int dir, const char *name) { return inner->rmdir(dir, name); }
+    int unlink(int dir, const char *name) { return inner->unlink(dir, name); }
+    int symlink(const char *target, int dir, const char *name) { return inner->symlink(target, dir, name); }
+    int rename(int dir, const char *name, int newDir, const char *newName) { return inner->rename(dir, name, newDir, newName); }
+
+    int setXAttr(int dir, const char *name, const char *xname, const void *value, size_t size, int flags)
+        { return inner->setXAttr(dir, name, xname, value, size, flags); }
+    ssize_t getXAttr(int dir, const char *name, const char *xname, void *value, size_t size)
+        { return inner->getXAttr(dir, name, xname, value, size); }
+    ssize_t listXAttr(int dir, const char *name, char *list, size_t size) { return inner->listXAttr(dir, name, list, size); }
+    int removeXAttr(int dir, const char *name, const char *xname) { return inner->removeXAttr(dir, name, xname); }
+
+    BackendDir *openDir(int dir, const char *name) { return inner->openDir(dir, name); }
+
+    int open(int dir, const char *name, int flags, mode_t mode) { return inner->open(dir, name, flags, mode); }
+    int close(int fd) { return inner->close(fd); }
+    ssize_t read(int fd, const struct iovec *iov, int iovcnt, off_t offset) { return inner->read(fd, iov, iovcnt, offset); }
+    ssize_t write(int fd, const struct iovec *iov, int iovcnt, off_t offset) { return inner->write(fd, iov, iovcnt, offset); }
+    int ftruncate(int fd, off_t length) { return inner->ftruncate(fd, length); }
+    int fsync(int fd, bool datasync) { return inner->fsync(fd, datasync); }
+    int fstat(int fd, struct stat *statbuf) { return inner->fstat(fd, statbuf); }
+
+    void willNeed(int fd, off_t offset, off_t length) { inner->willNeed(fd, offset, length); }
+    int hostFd(int fd) { return inner->hostFd(fd); }
+
+  protected:
+    Backend *inner;
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_BACKEND_H__
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/blockcache.h"
+#include "gem5fs/gem5/sharedcache.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+/* Size of a cached block. Blocks start at multiples of it. */
+#define GEM5FS_BLOCK_SIZE (64 * 1024)
+
+BlockCache *BlockCache::get()
+{
+    static BlockCache *cache = new BlockCache();
+
+    return cache;
+}
+
+BlockCache::BlockCache()
+    : used(0), budget(0), generations(0)
+{
+    const char *env = getenv("GEM5FS_BLOCK_CACHE_MB");
+
+    if (env != NULL)
+        budget = strtoull(env, NULL, 10) * 1024 * 1024;
+}
+
+void BlockCache::open(int fd)
+{
+    struct stat statbuf;
+
+    if (!enabled() || fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode))
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    FileKey key(statbuf.st_dev, statbuf.st_ino);
+    auto iter = files.find(key);
+
+    fds[fd] = key;
+
+    if (iter != files.end() && iter->second.size == statbuf.st_size
+        && iter->second.mtime.tv_sec == statbuf.st_mtim.tv_sec
+        && iter->second.mtime.tv_nsec == statbuf.st_mtim.tv_nsec)
+        return;
+
+    /* New or changed on the host since its blocks were read. */
+    drop(key);
+
+    File &file = files[key];
+    file.mtime = statbuf.st_mtim;
+    file.size = statbuf.st_size;
+    file.generation = ++generations;
+}
+
+void BlockCache::close(int fd)
+{
+    if (!enabled())
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    fds.erase(fd);
+}
+
+void BlockCache::invalidate(int fd)
+{
+    if (!enabled())
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto iter = fds.find(fd);
+
+    if (iter != fds.end())
+    {
+        drop(iter->second);
+
+        /* The next open sees a new size or time and starts over. */
+        files.erase(iter->second);
+    }
+}
+
+void BlockCache::invalidate(const struct stat &statbuf)
+{
+    if (!enabled())
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    FileKey key(statbuf.st_dev, statbuf.st_ino);
+
+    drop(key);
+    files.erase(key);
+}
+
+/* Drop every block of a file. Called with the lock held. */
+void BlockCache::drop(const FileKey &file)
+{
+    auto iter = blocks.lower_bound(BlockKey(file.first, file.second, 0));
+
+    while (iter != blocks.end() && std::get<0>(iter->first) == file.first
+           && std::get<1>(iter->first) == file.second)
+    {
+        used -= iter->second.data.size();
+        lru.erase(iter->second.lru);
+        iter = blocks.erase(iter);
+    }
+
+    auto fileIter = files.find(file);
+
+    if (fileIter != files.end())
+        fileIter->second.generation = ++generations;
+}
+
+/* Find a block and mark it used. Called with the lock held. */
+BlockCache::Block *BlockCache::find(const BlockKey &key)
+{
+    auto iter = blocks.find(key);
+
+    if (iter == blocks.end())
+        return NULL;
+
+    lru.splice(lru.begin(), lru, iter->second.lru);
+
+    return &iter->second;
+}
+
+/*
+ *  Add a block, dropping the least recently used ones to stay within the
+ *  budget. Called with the lock held.
+ */
+void BlockCache::insert(const BlockKey &key, const uint8_t *data, size_t size)
+{
+    if (blocks.count(key) != 0)
+        return;
+
+    while (!lru.empty() && used + size > budget)
+    {
+        auto victim = blocks.find(lru.back());
+
+        used -= victim->second.data.size();
+        blocks.erase(victim);
+        lru.pop_back();
+    }
+
+    Block &block = blocks[key];
+    block.data.assign(data, data + size);
+    lru.push_front(key);
+    block.lru = lru.begin();
+    used += size;
+}
+
+/*
+ *  Read the missing blocks from block up to lastBlock with one read,
+ *  through the shared cache if there is one, and add them. Called with
+ *  the lock held, which is dropped during the read. Returns false if the
+ *  read failed.
+ */
+bool BlockCache::fill(int fd, const FileKey &file, uint64_t block, uint64_t lastBlock)
+{
+    uint64_t count = 1;
+
+    while (block + count <= lastBlock
+           && blocks.count(BlockKey(file.first, file.second, block + count)) == 0)
+        count++;
+
+    uint64_t generation = files.at(file).generation;
+    std::vector<uint8_t> data(count * GEM5FS_BLOCK_SIZE);
+
+    lock.unlock();
+    ssize_t rv = SharedCache::get()->read(fd, data.data(), data.size(), block * GEM5FS_BLOCK_SIZE);
+    int error = errno;
+    lock.lock();
+
+    if (rv < 0)
+    {
+        errno = error;
+        return false;
+    }
+
+    DPRINTF(gem5fs, "gem5fs: block cache read %d blocks from fd %d\n", count, fd);
+
+    /* The file was written or changed while it was being read. */
+    auto fileIter = files.find(file);
+
+    if (fileIter == files.end() || fileIter->second.generation != generation)
+        return true;
+
+    /* The last block read is short or empty at the end of the file. */
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t start = i * GEM5FS_BLOCK_SIZE;
+
+        if ((uint64_t)rv <= start && i > 0)
+            break;
+
+        size_t size = std::min<uint64_t>(GEM5FS_BLOCK_SIZE, (uint64_t)rv - std::min<uint64_t>(rv, start));
+
+        insert(BlockKey(file.first, file.second, block + i), data.data() + start, size);
+    }
+
+    return true;
+}
+
+ssize_t BlockCache::read(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    if (!enabled())
+        return SharedCache::get()->read(fd, iov, iovcnt, offset);
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    auto fdIter = fds.find(fd);
+
+    if (fdIter == fds.end() || files.count(fdIter->second) == 0 || offset < 0)
+    {
+        guard.unlock();
+        return SharedCache::get()->read(fd, iov, iovcnt, offset);
+    }
+
+    FileKey file = fdIter->second;
+    uint64_t total = 0;
+
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+
+    uint64_t lastBlock = (total > 0) ? (offset + total - 1) / GEM5FS_BLOCK_SIZE : 0;
+    uint64_t done = 0;
+    int segment = 0;
+    uint64_t inSegment = 0;
+    unsigned int misses = 0;
+
+    while (done < total)
+    {
+        uint64_t pos = offset + done;
+        BlockKey key(file.first, file.second, pos / GEM5FS_BLOCK_SIZE);
+        Block *block = find(key);
+
+        if (block == NULL)
+        {
+            /*
+             *  Fill and look again. A block can still be missing if the
+             *  file changed meanwhile or the budget is too small to hold
+             *  it, then the rest is read directly.
+             */
+            if (misses++ > 0 || files.count(file) == 0
+                || !fill(fd, file, std::get<2>(key), lastBlock))
+                break;
+
+            continue;
+        }
+
+        misses = 0;
+
+        uint64_t inBlock = pos % GEM5FS_BLOCK_SIZE;
+
+        if (block->data.size() <= inBlock)
+            return done;
+
+        uint64_t length = std::min<uint64_t>(total - done, block->data.size() - inBlock);
+        const uint8_t *src = block->data.data() + inBlock;
+
+        /* Scatter the block's data into the iovecs. */
+        for (uint64_t copied = 0; copied < length; )
+        {
+            uint64_t chunk = std::min<uint64_t>(length - copied, iov[segment].iov_len - inSegment);
+
+            memcpy((uint8_t*)iov[segment].iov_base + inSegment, src + copied, chunk);
+            copied += chunk;
+            inSegment += chunk;
+
+            if (inSegment == iov[segment].iov_len)
+            {
+                segment++;
+                inSegment = 0;
+            }
+        }
+
+        done += length;
+
+        /* A short block is the end of the file. */
+        if (block->data.size() < GEM5FS_BLOCK_SIZE)
+            return done;
+    }
+
+    guard.unlock();
+
+    if (done == total)
+        return done;
+
+    /* Read what the cache could not hold directly. */
+    std::vector<struct iovec> rest(iov + segment, iov + iovcnt);
+    rest[0].iov_base = (uint8_t*)rest[0].iov_base + inSegment;
+    rest[0].iov_len -= inSegment;
+
+    ssize_t rv = SharedCache::get()->read(fd, rest.data(), (int)rest.size(), offset + done);
+
+    if (rv < 0)
+        return (done > 0) ? (ssize_t)done : rv;
+
+    return done + rv;
+}
+
+ssize_t BlockCache::read(int fd, void *buf, size_t size, off_t offset)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    return read(fd, &iov, 1, offset);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_BLOCKCACHE_H__
+#define __GEM5FS_GEM5_BLOCKCACHE_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace gem5fs {
+
+/*
+ *  Cache of host file data in fixed size blocks, keyed by host device,
+ *  inode and block number, so every open of a file shares it. Reads of
+ *  cached blocks make no syscalls, which matters when the host files are
+ *  on NFS. The least recently used blocks are dropped to stay within the
+ *  memory budget set in MiB by the GEM5FS_BLOCK_CACHE_MB environment
+ *  variable (0, the default, disables the cache).
+ *
+ *  A file's blocks are checked against its size and modification time
+ *  each time the FUSE fs opens it, and dropped when it is written or
+ *  truncated through gem5fs. Changes made by other host processes while
+ *  the file is open are seen at the next open. Worker threads read
+ *  through the cache, so it is shared under a lock.
+ */
+class BlockCache
+{
+  public:
+    static BlockCache *get();
+
+    bool enabled() const { return budget > 0; }
+
+    /*
+     *  Start caching reads of fd, a host file the FUSE fs just opened.
+     *  Blocks read before are dropped if the file changed since.
+     */
+    void open(int fd);
+
+    /* Stop caching reads of fd before it is closed. */
+    void close(int fd);
+
+    /* Drop the blocks of the file open as fd, or of statbuf's file. */
+    void invalidate(int fd);
+    void invalidate(const struct stat &statbuf);
+
+    /*
+     *  preadv through the cache. Misses and files that were not opened
+     *  with open() are read through the SharedCache.
+     */
+    ssize_t read(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    ssize_t read(int fd, void *buf, size_t size, off_t offset);
+
+  private:
+    BlockCache();
+
+    typedef std::pair<dev_t, ino_t> FileKey;
+    typedef std::tuple<dev_t, ino_t, uint64_t> BlockKey;
+
+    struct File
+    {
+        struct timespec mtime;
+        off_t size;
+        uint64_t generation;    // Renewed when the blocks are dropped
+    };
+
+    struct Block
+    {
+        std::vector<uint8_t> data;  // Short for the last block of a file
+        std::list<BlockKey>::iterator lru;
+    };
+
+    Block *find(const BlockKey &key);
+    void insert(const BlockKey &key, const uint8_t *data, size_t size);
+    void drop(const FileKey &file);
+    bool fill(int fd, const FileKey &file, uint64_t block, uint64_t lastBlock);
+
+    std::map<int, FileKey> fds;
+    std::map<FileKey, File> files;
+    std::map<BlockKey, Block> blocks;
+    std::list<BlockKey> lru;    // Most recently used first
+    uint64_t used;
+    uint64_t budget;
+    uint64_t generations;
+    std::mutex lock;
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_BLOCKCACHE_H__
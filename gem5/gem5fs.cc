@@ -39,6 +39,22 @@
  */
 
 #include "gem5fs/gem5/gem5fs.h"
+#include "gem5fs/gem5/arena.h"
+#include "gem5fs/gem5/async.h"
+#include "gem5fs/gem5/backend.h"
+#include "gem5fs/gem5/blockcache.h"
+#include "gem5fs/gem5/guestmem.h"
+#include "gem5fs/gem5/legacy.h"
+#include "gem5fs/gem5/mappings.h"
+#include "gem5fs/gem5/nodes.h"
+#include "gem5fs/gem5/sharedcache.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "cpu/thread_context.hh"
 #include "mem/fs_translating_port_proxy.hh"
@@ -48,13 +64,558 @@ using namespace gem5fs;
 
 char mountpoint[PATH_MAX];
 
+/* Protocol version and features agreed on with Negotiate. */
+static bool negotiated = false;
+static uint32_t protocolVersion = 0;
+static uint64_t features = 0;
+
+/* Guest address of the rings registered with SetupRing. */
+static Addr ringAddr = 0;
+static unsigned int ringEntries = 0;
+
+/* Jobs on the worker pool, by the token handed to the FUSE fs. */
+static std::map<uint64_t, AsyncJob*> pendingJobs;
+static uint64_t nextJobToken = 1;
+
+/*
+ *  Directories opened with OpenDir, by the handle handed to the FUSE fs.
+ *  Jobs listing a directory hold a reference, so it stays open until they
+ *  are done even if it is released.
+ */
+static std::map<uint64_t, std::shared_ptr<BackendDir> > openDirs;
+static uint64_t nextDirHandle = 1;
+
+/* Steps of a compound request always run synchronously. */
+static bool inCompound = false;
+
+/*
+ *  Features gem5 can offer. Async requests are only offered when the
+ *  worker pool has threads to run them.
+ */
+static uint64_t SupportedFeatures()
+{
+    uint64_t supported = GEM5FS_FEATURE_INLINE_RESPONSE
+                       | GEM5FS_FEATURE_RING
+                       | GEM5FS_FEATURE_COMPOUND
+                       | GEM5FS_FEATURE_VECTORED
+                       | GEM5FS_FEATURE_NODE_HANDLES
+                       | GEM5FS_FEATURE_PACKED_DIRENTS
+                       | GEM5FS_FEATURE_READDIR_PLUS
+                       | GEM5FS_FEATURE_DIR_STREAMS;
+
+    if (WorkerPool::get()->enabled())
+        supported |= GEM5FS_FEATURE_ASYNC;
+
+    return supported;
+}
+
+/*
+ *  Check that an operation may be used with what was negotiated. Before
+ *  negotiation, only the operations of the older protocol are accepted.
+ */
+static bool OperationAllowed(uint32_t oper)
+{
+    switch (oper)
+    {
+        case Negotiate:
+            return true;
+        case SetupRing:
+        case SubmitRing:
+            return negotiated && (features & GEM5FS_FEATURE_RING);
+        case Compound:
+            return negotiated && (features & GEM5FS_FEATURE_COMPOUND);
+        case PollResult:
+            return negotiated && (features & GEM5FS_FEATURE_ASYNC);
+        case ReadV:
+        case WriteV:
+            return negotiated && (features & GEM5FS_FEATURE_VECTORED);
+        case Lookup:
+        case Forget:
+            return negotiated && (features & GEM5FS_FEATURE_NODE_HANDLES);
+        case ReadDirPlus:
+        case ForgetMulti:
+            return negotiated && (features & GEM5FS_FEATURE_NODE_HANDLES)
+                   && (features & GEM5FS_FEATURE_READDIR_PLUS);
+        case OpenDir:
+        case ReleaseDir:
+            return negotiated && (features & GEM5FS_FEATURE_DIR_STREAMS);
+        default:
+            return negotiated || oper <= GetMountpoint;
+    }
+}
+
+/*
+ *  Forget the rings, nodes and open directories of the FUSE fs, which is
+ *  being remounted. Jobs the old FUSE fs never polled for may still use
+ *  node fds, so they are waited for and thrown away first.
+ */
+static void ResetSession()
+{
+    for (auto iter = pendingJobs.begin(); iter != pendingJobs.end(); ++iter)
+    {
+        AsyncJob *job = iter->second;
+
+        while (!job->isDone())
+            std::this_thread::yield();
+
+        ResponseArena::get()->release(job->responseData);
+        delete job;
+    }
+
+    pendingJobs.clear();
+
+    ringAddr = 0;
+    ringEntries = 0;
+    NodeTable::get()->reset();
+    openDirs.clear();
+}
+
+/*
+ *  Allocate response data. All response data comes from the response
+ *  arena and goes back to it in BufferResponse or CleanUp.
+ */
+template <typename T>
+static T* NewResponse()
+{
+    return (T*)ResponseArena::get()->allocate(sizeof(T));
+}
+
+static uint8_t* NewResponseData(size_t size)
+{
+    return (uint8_t*)ResponseArena::get()->allocate(size);
+}
+
+/*
+ *  Read a request header from the guest and convert it from the wire.
+ *  A FUSE fs that has not negotiated may be too old to send the full
+ *  header, so the fields it doesn't know about are left at 0.
+ */
+void gem5fs::ReadHeader(ThreadContext *tc, Addr addr, FileOperation *fileOperation)
+{
+    memset(fileOperation, 0, sizeof(FileOperation));
+    CopyOut(tc, fileOperation, addr, GEM5FS_LEGACY_HEADER_SIZE);
+
+    if (negotiated || gem5fs_le32(fileOperation->oper) == Negotiate)
+    {
+        CopyOut(tc, (uint8_t*)fileOperation + GEM5FS_LEGACY_HEADER_SIZE, addr + GEM5FS_LEGACY_HEADER_SIZE,
+                sizeof(FileOperation) - GEM5FS_LEGACY_HEADER_SIZE);
+    }
+
+    gem5fs_header_le(fileOperation);
+}
+
+/*
+ *  Convert a response header to the wire and write it to the guest. A
+ *  FUSE fs that has not negotiated may be too old to have room for the
+ *  full header, so it only gets the part it knows about.
+ */
+void gem5fs::WriteHeader(ThreadContext *tc, Addr addr, const FileOperation *fileOperation)
+{
+    FileOperation wireOp = *fileOperation;
+    unsigned int size = (negotiated) ? sizeof(FileOperation) : GEM5FS_LEGACY_HEADER_SIZE;
+
+    gem5fs_header_le(&wireOp);
+    CopyIn(tc, addr, &wireOp, size);
+}
+
+/*
+ *  Copy length bytes between the mmap engine's mapping at data and guest
+ *  memory at addr. FileMappings::copy only guards a memcpy, so the guest
+ *  side is resolved to gem5's backing store first, or staged in a host
+ *  buffer that CopyIn/CopyOut use outside the guard.
+ */
+static bool CopyMapped(ThreadContext *tc, int hostfd, uint8_t *data, Addr addr, uint64_t length, bool toGuest)
+{
+    static std::vector<uint8_t> staging;
+    std::vector<struct iovec> iov;
+    FileMappings *mappings = FileMappings::get();
+
+    if (MapGuestBuffer(tc, addr, length, iov))
+    {
+        for (auto iter = iov.begin(); iter != iov.end(); ++iter)
+        {
+            bool copied = (toGuest) ? mappings->copy(hostfd, iter->iov_base, data, iter->iov_len)
+                                    : mappings->copy(hostfd, data, iter->iov_base, iter->iov_len);
+
+            if (!copied)
+                return false;
+
+            data += iter->iov_len;
+        }
+
+        return true;
+    }
+
+    staging.resize(length);
+
+    if (toGuest)
+    {
+        if (!mappings->copy(hostfd, staging.data(), data, length))
+            return false;
+
+        CopyIn(tc, addr, staging.data(), length);
+    }
+    else
+    {
+        CopyOut(tc, staging.data(), addr, length);
+
+        if (!mappings->copy(hostfd, data, staging.data(), length))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ *  Read from a host file through the mmap engine straight into guest
+ *  memory at dest. Returns the number of bytes read, or -1 if the file
+ *  can't be mapped and has to be read with pread.
+ */
+static int64_t MappedRead(ThreadContext *tc, int hostfd, uint64_t offset, uint64_t size, Addr dest, bool willNeed)
+{
+    uint64_t done = 0;
+
+    while (done < size)
+    {
+        uint8_t *data;
+        uint64_t length;
+
+        if (!FileMappings::get()->map(hostfd, offset + done, size - done, false, data, length))
+            return (done > 0) ? (int64_t)done : -1;
+
+        if (length == 0)
+            break;
+
+        /* The file may shrink under the mapping, pread then reads the rest. */
+        if (!CopyMapped(tc, hostfd, data, dest + done, length, true))
+            return (done > 0) ? (int64_t)done : -1;
+
+        done += length;
+    }
+
+    /* Start the host reading the rest of the stream. */
+    if (willNeed)
+        FileMappings::get()->willNeed(hostfd, offset + done, done);
+
+    return done;
+}
+
+/*
+ *  Write to a host file through the mmap engine straight from guest
+ *  memory at src. Returns the number of bytes written, or -1 if the write
+ *  has to go through pwrite.
+ */
+static int64_t MappedWrite(ThreadContext *tc, int hostfd, uint64_t offset, uint64_t size, Addr src)
+{
+    uint64_t done = 0;
+
+    while (done < size)
+    {
+        uint8_t *data;
+        uint64_t length;
+
+        if (!FileMappings::get()->map(hostfd, offset + done, size - done, true, data, length) || length == 0)
+            return (done > 0) ? (int64_t)done : -1;
+
+        if (!CopyMapped(tc, hostfd, data, src + done, length, false))
+            return (done > 0) ? (int64_t)done : -1;
+
+        done += length;
+    }
+
+    return done;
+}
+
+/*
+ *  Unmap the mmap engine's windows of name in dir before it is truncated,
+ *  unlinked or replaced.
+ */
+static void DropMappings(int dir, const char *name)
+{
+    struct stat statbuf;
+
+    if (FileMappings::get()->empty())
+        return;
+
+    if (Backend::get()->stat(dir, name, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+        FileMappings::get()->drop(statbuf.st_dev, statbuf.st_ino);
+}
+
+/*
+ *  Read an open file, asking the backend to read ahead when the read is
+ *  part of a sequential stream.
+ */
+static ssize_t ReadFile(int hostfd, const struct iovec *iov, int iovcnt, off_t offset, bool willNeed)
+{
+    ssize_t rv = Backend::get()->read(hostfd, iov, iovcnt, offset);
+
+    /* Start the host reading the rest of the stream. */
+    if (willNeed && rv > 0)
+        Backend::get()->willNeed(hostfd, offset + rv, rv);
+
+    return rv;
+}
+
+/*
+ *  Copy out and decode the segments of a vectored request. Returns false
+ *  if the request has too many segments or more than GEM5FS_MAX_DATA_SIZE
+ *  bytes in total.
+ */
+static bool ReadSegments(ThreadContext *tc, const VectorOperation *vecOp, std::vector<WireSegment> &segments, uint64_t &total)
+{
+    uint32_t count = gem5fs_le32(vecOp->count);
+
+    segments.clear();
+    total = 0;
+
+    if (count > GEM5FS_MAX_SEGMENTS)
+    {
+        warn("gem5fs: vectored request has too many segments (%d).\n", count);
+        return false;
+    }
+
+    segments.resize(count);
+    CopyOut(tc, segments.data(), (Addr)gem5fs_le64(vecOp->segments), count * sizeof(WireSegment));
+
+    for (auto iter = segments.begin(); iter != segments.end(); ++iter)
+    {
+        iter->base = gem5fs_le64(iter->base);
+        iter->length = gem5fs_le64(iter->length);
+
+        /* Checked one at a time so the sum can't overflow. */
+        if (iter->length > GEM5FS_MAX_DATA_SIZE
+            || total + iter->length > GEM5FS_MAX_DATA_SIZE)
+        {
+            warn("gem5fs: vectored request is too large.\n");
+            segments.clear();
+            total = 0;
+            return false;
+        }
+
+        total += iter->length;
+    }
+
+    return true;
+}
+
+/*
+ *  Map every segment of a vectored request into gem5's backing store.
+ *  Returns false if any segment has to be copied instead.
+ */
+static bool MapSegments(ThreadContext *tc, const std::vector<WireSegment> &segments, std::vector<struct iovec> &iov)
+{
+    std::vector<struct iovec> segmentIov;
+
+    iov.clear();
+
+    for (auto iter = segments.begin(); iter != segments.end(); ++iter)
+    {
+        if (iter->length == 0)
+            continue;
+
+        if (!MapGuestBuffer(tc, (Addr)iter->base, iter->length, segmentIov)
+            || iov.size() + segmentIov.size() > IOV_MAX)
+        {
+            iov.clear();
+            return false;
+        }
+
+        iov.insert(iov.end(), segmentIov.begin(), segmentIov.end());
+    }
+
+    return !iov.empty();
+}
+
+/* Formats of a directory listing. */
+enum ListingFormat
+{
+    ListingSlots,                  // 256 byte names
+    ListingPacked,                 // WireDirents
+    ListingPlus                    // WireDirentPlus records with lookups
+};
+
+/*
+ *  Append the entries of an open directory to listing, from its current
+ *  position until the end or until the next entry would take the listing
+ *  past capacity bytes. Plus listings look up each entry in the node
+ *  table, so they may only be built on the simulation thread.
+ */
+static void ListDirectory(BackendDir *dir, ListingFormat format, uint64_t capacity, std::vector<uint8_t> &listing)
+{
+    struct dirent *de;
+    long position = dir->tell();
+
+    /*
+     * readdir returns a non-null pointer on success. On failure, NULL
+     *  is returned and errno is set. When there are no more entires,
+     *  NULL is returned and errno is still 0.
+     */
+    while ((de = dir->read()) != NULL)
+    {
+        size_t nameLength = strlen(de->d_name);
+        size_t pos = listing.size();
+        size_t recordLength;
+
+        if (format == ListingSlots)
+            recordLength = 256;
+        else if (format == ListingPacked)
+            recordLength = GEM5FS_DIRENT_SIZE(nameLength);
+        else
+            recordLength = GEM5FS_DIRENTPLUS_SIZE(nameLength);
+
+        /* Leave the entry for the next listing. */
+        if (pos + recordLength > capacity)
+        {
+            dir->seek(position);
+            break;
+        }
+
+        position = dir->tell();
+
+        /* Resizing zero fills the NUL, padding and unused nodes. */
+        listing.resize(pos + recordLength);
+
+        if (format == ListingSlots)
+        {
+            /* Older FUSE fs take each name in a 256 byte slot. */
+            strncpy((char*)&listing[pos], de->d_name, 255);
+            continue;
+        }
+
+        WireDirent *wire;
+        char *name;
+
+        if (format == ListingPacked)
+        {
+            wire = (WireDirent*)&listing[pos];
+            name = (char*)(wire + 1);
+        }
+        else
+        {
+            WireDirentPlus *plus = (WireDirentPlus*)&listing[pos];
+            wire = &plus->dirent;
+            name = (char*)(plus + 1);
+        }
+
+        wire->ino = gem5fs_le64(de->d_ino);
+        wire->cookie = gem5fs_le64(position);
+        wire->type = gem5fs_le32(de->d_type);
+        wire->nameLength = gem5fs_le16(nameLength);
+        wire->recordLength = gem5fs_le16(recordLength);
+
+        memcpy(name, de->d_name, nameLength);
+
+        /* The FUSE fs never looks up . or .. */
+        if (format != ListingPlus || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        struct stat statbuf;
+        uint64_t node = 0;
+
+        if (Backend::get()->stat(dir->node(), de->d_name, &statbuf) == 0)
+            node = NodeTable::get()->lookup(dir->node(), de->d_name, statbuf);
+
+        if (node != 0)
+        {
+            WireDirentPlus *plus = (WireDirentPlus*)&listing[pos];
+
+            plus->entry.node = gem5fs_le64(node);
+            gem5fs_encode_stat(&plus->entry.attr, &statbuf);
+        }
+    }
+}
+
+/*
+ *  Tell the FUSE fs that its request is still running on the worker pool
+ *  and that it should poll for the response with the given token.
+ */
+static void SendPending(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, uint64_t token)
+{
+    FileOperation pendingOp = *fileOperation;
+
+    pendingOp.opType = PendingOperation;
+    pendingOp.opStruct = 0;
+    pendingOp.structSize = 0;
+    pendingOp.result = token;
+    pendingOp.errnum = 0;
+    pendingOp.responseBuf = 0;
+    pendingOp.responseCapacity = 0;
+
+    WriteHeader(tc, resultAddr, &pendingOp);
+}
+
+/*
+ *  Send the response for a finished host operation.
+ */
+static void SendJobResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, AsyncJob *job)
+{
+    errno = job->errnum;
+
+    /* Jobs that wrote to guest memory directly only report a size. */
+    BufferResponse(tc, resultAddr, fileOperation, job->success, job->responseData, job->responseSize);
+}
+
+/*
+ *  Whether RunHostOperation would queue this operation on the worker pool.
+ */
+static bool QueuesHostOperation(FileOperation *fileOperation)
+{
+    return fileOperation->opType == AsyncRequestOperation && !inCompound
+        && (features & GEM5FS_FEATURE_ASYNC) && WorkerPool::get()->enabled();
+}
+
+/*
+ *  Run the host side of an operation. If the FUSE fs sent an async request
+ *  and the worker pool is enabled, the work is queued and the FUSE fs gets
+ *  a pending response to poll with. Otherwise the work runs right here.
+ *
+ *  The work function must not touch guest memory, any input has to be
+ *  copied out before calling this.
+ */
+
+static void RunHostOperation(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, AsyncJob::Work work)
+{
+    if (QueuesHostOperation(fileOperation))
+    {
+        uint64_t token = nextJobToken++;
+        AsyncJob *job = new AsyncJob((Operation)fileOperation->oper, work);
+
+        DPRINTF(gem5fs, "gem5fs: queueing operation %d as job %d\n", fileOperation->oper, token);
+
+        pendingJobs[token] = job;
+        WorkerPool::get()->submit(job);
+
+        SendPending(tc, resultAddr, fileOperation, token);
+
+        return;
+    }
+
+    AsyncJob job((Operation)fileOperation->oper, work);
+    job.work(&job);
+
+    SendJobResponse(tc, resultAddr, fileOperation, &job);
+}
+
+/*
+ *  Run an operation whose work reads or writes guest memory through
+ *  iovecs from MapGuestBuffer. It always runs right here, on the
+ *  simulation thread, so the guest pages can't change under it.
+ */
+static void RunGuestOperation(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, AsyncJob::Work work)
+{
+    AsyncJob job((Operation)fileOperation->oper, work);
+    job.work(&job);
+
+    SendJobResponse(tc, resultAddr, fileOperation, &job);
+}
+
 uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestAddr, Addr resultAddr)
 {
     uint64_t result = 0;
 
     /* Get the file operation struct. */
     FileOperation fileOp;
-    CopyOut(tc, &fileOp, requestAddr, sizeof(FileOperation));
+    ReadHeader(tc, requestAddr, &fileOp);
 
     /* Get the pathname in the file operation. */
     char *pathname;
@@ -77,6 +638,70 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
     DPRINTF(gem5fs, "gem5fs: result address is %p\n", resultAddr);
     DPRINTF(gem5fs, "gem5fs: gem5fs_call on %s\n", pathname);
 
+    if (!OperationAllowed(fileOp.oper))
+    {
+        warn("gem5fs: operation %d was not negotiated.\n", fileOp.oper);
+
+        errno = EPROTO;
+        SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+
+        delete [] pathname;
+
+        return result;
+    }
+
+    /*
+     *  Only a FUSE fs built before Negotiate existed sends TestGem5. If
+     *  it was mounted after one that negotiated, go back to the older
+     *  protocol for it.
+     */
+    if (fileOp.oper == TestGem5 && negotiated)
+    {
+        warn("gem5fs: FUSE fs does not support protocol negotiation, using the older protocol.\n");
+
+        negotiated = false;
+        protocolVersion = 0;
+        features = 0;
+        ResetSession();
+    }
+
+    /* Operations whose structs changed with the wire format. */
+    if (!negotiated && IsLegacyOperation(fileOp.oper))
+    {
+        ProcessLegacyRequest(tc, inputAddr, resultAddr, &fileOp, pathname);
+
+        delete [] pathname;
+
+        return result;
+    }
+
+    /*
+     *  With a node handle, the path is the name of an entry in that node's
+     *  directory, or empty for the node itself. Otherwise it is absolute.
+     */
+    int dirfd = AT_FDCWD;
+
+    if (fileOp.node != 0)
+    {
+        if (!(features & GEM5FS_FEATURE_NODE_HANDLES)
+            || (dirfd = NodeTable::get()->fd(fileOp.node)) < 0)
+        {
+            DPRINTF(gem5fs, "gem5fs: stale node %d\n", fileOp.node);
+
+            errno = ESTALE;
+            SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+
+            delete [] pathname;
+
+            return result;
+        }
+
+        if (fileOp.pathLength == 0)
+            pathname[0] = '\0';
+
+        DPRINTF(gem5fs, "gem5fs: node %d is fd %d\n", fileOp.node, dirfd);
+    }
+
     /* Switch the umask for operations that may modify permissions. */
     mode_t saved_mask = umask(0);
 
@@ -91,340 +716,714 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         case GetResult:
         {
             /*
-             *  The result pointer is in gem5's memory space so we
-             *  can get this by setting the pointer to the request's
-             *  result field.
+             *  The result field holds the address of the response
+             *  buffered in gem5's memory space.
              */
-            FileOperation *resultOp = fileOp.result;
+            BufferedResponse *buffered = (BufferedResponse*)(fileOp.result);
 
-            DPRINTF(gem5fs, "gem5fs_call: resultOp->opStruct is %p\n", (void*)(resultOp->opStruct));
-            DPRINTF(gem5fs, "gem5fs_call: resultOp is %p\n", (void*)(resultOp));
-            DPRINTF(gem5fs, "gem5fs_call: writing %d bytes to %p\n", resultOp->structSize, resultAddr);
+            DPRINTF(gem5fs, "gem5fs_call: buffered->data is %p\n", (void*)(buffered->data));
+            DPRINTF(gem5fs, "gem5fs_call: buffered is %p\n", (void*)(buffered));
+            DPRINTF(gem5fs, "gem5fs_call: writing %d bytes to %p\n", buffered->size, resultAddr);
 
             /*
              *  The fuse filesystem allocates enough memory in opStruct
              *  to hold the response data, so we copy to this field.
              *  The resultAddr is the virtual address of this field.
              */
-            CopyIn(tc, resultAddr, resultOp->opStruct, resultOp->structSize);
+            CopyIn(tc, resultAddr, buffered->data, buffered->size);
 
             /*
-             *  Some operations return structs may contain pointers. Those
-             *  would need to be CopyIn'd separately. Do that here.
+             *  Response data is already in wire format, so it can be
+             *  sent as is. We can now safely delete it.
              */
+            CleanUp(buffered);
 
-            /*
-             *  We can now safely delete the pointers. opStruct
-             *  is also allocated for most operations, so this is
-             *  also deleted first.
-             */
-            CleanUp(resultOp);
+            break;
+        }
+        case Negotiate:
+        {
+            /* FUSE FS sends a NegotiateOperation struct as input. */
+            NegotiateOperation negOp;
+            CopyOut(tc, &negOp, inputAddr, sizeof(NegotiateOperation));
+
+            uint32_t magic = gem5fs_le32(negOp.magic);
+            uint32_t version = gem5fs_le32(negOp.version);
+            uint64_t wanted = gem5fs_le64(negOp.features);
+
+            if (magic != GEM5FS_PROTOCOL_MAGIC || version == 0)
+            {
+                warn("gem5fs: bad negotiate request (magic %#x, version %d).\n", magic, version);
+
+                errno = EPROTO;
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+
+                break;
+            }
+
+            /* Start over, the FUSE fs may have been remounted. */
+            negotiated = true;
+            protocolVersion = std::min(version, (uint32_t)GEM5FS_PROTOCOL_VERSION);
+            features = wanted & SupportedFeatures();
+            ResetSession();
+
+            DPRINTF(gem5fs, "gem5fs: negotiated version %d, features %#llx\n", protocolVersion, (unsigned long long)features);
+
+            NegotiateOperation *reply = NewResponse<NegotiateOperation>();
+            reply->magic = gem5fs_le32(GEM5FS_PROTOCOL_MAGIC);
+            reply->version = gem5fs_le32(protocolVersion);
+            reply->features = gem5fs_le64(features);
+
+            BufferResponse(tc, resultAddr, &fileOp, true, (uint8_t*)reply, sizeof(NegotiateOperation));
 
             break;
         }
-        case TestGem5:
+        case SetMountpoint:
         {
-            /* Input is a TestOperation struct. */
-            TestOperation testOp;
-            CopyOut(tc, &testOp, inputAddr, fileOp.structSize);
+            /* FUSE sends the mountpoint as a char array. */
+            CopyOut(tc, mountpoint, inputAddr, fileOp.structSize+1);
 
-            /* Assume true, mark false on any failure. */
-            bool test_passed = true; 
+            SendResponse(tc, resultAddr, &fileOp, true, NULL, 0);
 
-            /* 
-             *  structSize should be the same as the sizeof 
-             *  TestOperation and the input test operation's
-             *  TestOperation_size.
-             */
-            if (fileOp.structSize != sizeof(TestOperation)
-                || testOp.TestOperation_size != sizeof(TestOperation))
+            break;
+        }
+        case GetMountpoint:
+        {
+            /* Buffered responses are deleted once sent, so send a copy. */
+            char *mountpointCopy = (char*)NewResponseData(strlen(mountpoint)+1);
+            strcpy(mountpointCopy, mountpoint);
+
+            BufferResponse(tc, resultAddr, &fileOp, true, (uint8_t*)mountpointCopy, strlen(mountpoint)+1);
+
+            break;
+        }
+        case SetupRing:
+        {
+            /* FUSE FS sends a RingSetupOperation struct as input. */
+            RingSetupOperation setupOp;
+            CopyOut(tc, &setupOp, inputAddr, sizeof(RingSetupOperation));
+
+            Addr ring = (Addr)gem5fs_le64(setupOp.ring);
+            uint32_t entries = gem5fs_le32(setupOp.entries);
+
+            /* The ring indices wrap, so the size must be a power of two. */
+            bool valid = (entries != 0 && (entries & (entries - 1)) == 0);
+
+            if (valid)
+            {
+                ringAddr = ring;
+                ringEntries = entries;
+
+                DPRINTF(gem5fs, "gem5fs: registered %d entry ring at %p\n", ringEntries, (void*)ringAddr);
+            }
+            else
             {
-                warn("gem5fs: TestOperation struct does not match guest's size.\n");
-                test_passed = false;
+                warn("gem5fs: ring size %d is not a power of two.\n", entries);
+                errno = EINVAL;
             }
 
-            /*
-             *  For anything else just compare the struct value with sizeof.
-             */
-            if (testOp.size_t_size != sizeof(size_t))
+            SendResponse(tc, resultAddr, &fileOp, valid, NULL, 0);
+
+            break;
+        }
+        case SubmitRing:
+        {
+            if (ringAddr == 0)
             {
-                warn("gem5fs: size_t does not match guest's size.\n");
-                test_passed = false;
+                errno = ENXIO;
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                break;
             }
 
-            if (testOp.mode_t_size != sizeof(mode_t))
+            result = ProcessRing(tc);
+
+            SendResponse(tc, resultAddr, &fileOp, true, NULL, 0);
+
+            break;
+        }
+        case PollResult:
+        {
+            /* The token from the pending response is in the result field. */
+            uint64_t token = fileOp.result;
+            auto iter = pendingJobs.find(token);
+
+            if (iter == pendingJobs.end())
             {
-                warn("gem5fs: mode_t does not match guest's size.\n");
-                test_passed = false;
+                warn("gem5fs: poll for unknown job %d.\n", token);
+                errno = EINVAL;
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                break;
             }
 
-            if (testOp.uid_t_size != sizeof(uid_t))
+            AsyncJob *job = iter->second;
+
+            if (!job->isDone())
             {
-                warn("gem5fs: uid_t does not match guest's size.\n");
-                test_passed = false;
+                SendPending(tc, resultAddr, &fileOp, token);
+                break;
             }
 
-            if (testOp.gid_t_size != sizeof(gid_t))
+            DPRINTF(gem5fs, "gem5fs: job %d is done\n", token);
+
+            /* Respond as the original operation, into the poll's buffer. */
+            pendingJobs.erase(iter);
+            fileOp.oper = job->oper;
+            SendJobResponse(tc, resultAddr, &fileOp, job);
+
+            delete job;
+
+            break;
+        }
+        case Compound:
+        {
+            /* Each step has its own response, this reports the first error. */
+            bool success = ProcessCompound(tc, inputAddr);
+
+            SendResponse(tc, resultAddr, &fileOp, success, NULL, 0);
+
+            break;
+        }
+        case GetAttr:
+        {
+            DPRINTF(gem5fs, "gem5fs: reading attributes on %s\n", pathname);
+
+            std::string path(pathname);
+
+            RunHostOperation(tc, resultAddr, &fileOp, [dirfd, path](AsyncJob *job) {
+                /*
+                 *  fstatat returns 0 on success, -1 on failure and errno is
+                 *  set. Only the fields FUSE uses are sent back.
+                 */
+                struct stat statbuf;
+                int rv = Backend::get()->stat(dirfd, path.c_str(), &statbuf);
+
+                WireStat *wire = NewResponse<WireStat>();
+                gem5fs_encode_stat(wire, &statbuf);
+
+                job->finish((rv == 0), (uint8_t*)wire, sizeof(WireStat));
+            });
+
+            break;
+        }
+        case ReadLink:
+        {
+            /* FUSE FS sends the size of the buffer as input. */
+            uint64_t bufSize;
+            CopyOut(tc, &bufSize, inputAddr, sizeof(uint64_t));
+            bufSize = gem5fs_le64(bufSize);
+
+            /* Make a temporary buffer */
+            char *link = (char*)NewResponseData(bufSize);
+
+            DPRINTF(gem5fs, "gem5fs: reading link on %s\n", pathname);
+
+            /* Call readlink with this size */ 
+            int rv = Backend::get()->readLink(dirfd, pathname, link, bufSize-1);
+            if (rv >= 0)
+                link[rv] = '\0'; // readlink doesn't append \0.
+
+            /* Save the response data for GetResult. */
+            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), (uint8_t*)link, bufSize);
+            
+            break;
+        }
+        case Lookup:
+        {
+            DPRINTF(gem5fs, "gem5fs: looking up %s\n", pathname);
+
+            struct stat statbuf;
+            uint64_t node = 0;
+
+            /* Only count a lookup the FUSE fs will hear about. */
+            NodeEntry *entry = NewResponse<NodeEntry>();
+
+            if (Backend::get()->stat(dirfd, pathname, &statbuf) == 0)
+                node = NodeTable::get()->lookup(dirfd, pathname, statbuf);
+
+            if (node != 0)
             {
-                warn("gem5fs: gid_t does not match guest's size.\n");
-                test_passed = false;
+                entry->node = gem5fs_le64(node);
+                gem5fs_encode_stat(&entry->attr, &statbuf);
             }
 
-            if (testOp.struct_stat_size != sizeof(struct stat))
+            BufferResponse(tc, resultAddr, &fileOp, (node != 0), (uint8_t*)entry, sizeof(NodeEntry));
+
+            break;
+        }
+        case Forget:
+        {
+            /* FUSE FS sends the number of lookups to drop as input. */
+            uint64_t nlookup;
+            CopyOut(tc, &nlookup, inputAddr, sizeof(uint64_t));
+
+            NodeTable::get()->forget(fileOp.node, gem5fs_le64(nlookup));
+
+            SendResponse(tc, resultAddr, &fileOp, true, NULL, 0);
+
+            break;
+        }
+        case ForgetMulti:
+        {
+            /* FUSE FS sends an array of WireForget structs as input. */
+            unsigned int count = fileOp.structSize / sizeof(WireForget);
+            std::vector<WireForget> forgets(count);
+
+            if (count > 0)
+                CopyOut(tc, forgets.data(), inputAddr, count * sizeof(WireForget));
+
+            DPRINTF(gem5fs, "gem5fs: forgetting %d nodes\n", count);
+
+            for (auto iter = forgets.begin(); iter != forgets.end(); ++iter)
+                NodeTable::get()->forget(gem5fs_le64(iter->node), gem5fs_le64(iter->nlookup));
+
+            SendResponse(tc, resultAddr, &fileOp, true, NULL, 0);
+
+            break;
+        }
+        case Unlink:
+        {
+            DPRINTF(gem5fs, "gem5fs: unlinking %s\n", pathname);
+
+            /* No input data. */
+            DropMappings(dirfd, pathname);
+
+            int rv = Backend::get()->unlink(dirfd, pathname);
+
+            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+
+            break;
+        }
+        case MakeSymLink:
+        {
+            /* FUSE FS sends name of link as input. */
+            char *link = new char[fileOp.structSize+1];
+            CopyOut(tc, link, inputAddr, fileOp.structSize+1);
+        
+            /*
+             *  With a node handle the path names the new link and the
+             *  input is its target, otherwise it is the other way around.
+             */
+            int rv;
+
+            if (fileOp.node != 0)
             {
-                warn("gem5fs: stat struct does not match guest's size.\n");
-                test_passed = false;
+                DPRINTF(gem5fs, "gem5fs: symlinking %s to %s\n", link, pathname);
+
+                rv = Backend::get()->symlink(link, dirfd, pathname);
             }
+            else
+            {
+                DPRINTF(gem5fs, "gem5fs: symlinking %s to %s\n", pathname, link);
 
-            if (testOp.struct_statvfs_size != sizeof(struct statvfs))
+                rv = Backend::get()->symlink(pathname, AT_FDCWD, link);
+            }
+
+            /* Returns 0 on success. */
+            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+
+            delete [] link;
+
+            break;
+        }
+        case Rename:
+        {
+            std::string newpath;
+            int newdirfd = AT_FDCWD;
+
+            if (fileOp.node != 0)
             {
-                warn("gem5fs: stat struct does not match guest's size.\n");
-                test_passed = false;
+                /* RenameOperation with the new parent node and name. */
+                RenameOperation renameOp;
+                CopyOut(tc, &renameOp, inputAddr, sizeof(RenameOperation));
+
+                uint32_t length = gem5fs_le32(renameOp.newNameLength);
+                char *newname = new char[length+1];
+                CopyOut(tc, newname, (Addr)gem5fs_le64(renameOp.newName), length+1);
+                newname[length] = '\0';
+
+                newdirfd = NodeTable::get()->fd(gem5fs_le64(renameOp.newNode));
+                newpath = newname;
+
+                delete [] newname;
+
+                if (newdirfd < 0)
+                {
+                    errno = ESTALE;
+                    SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                    break;
+                }
             }
+            else
+            {
+                /* New path is the input. */
+                char *newname = new char[fileOp.structSize+1];
+                CopyOut(tc, newname, inputAddr, fileOp.structSize+1);
+
+                newpath = newname;
+
+                delete [] newname;
+            }
+
+            DPRINTF(gem5fs, "gem5fs: renaming %s to %s\n", pathname, newpath.c_str());
 
-            if (testOp.char_size != sizeof(char))
+            DropMappings(newdirfd, newpath.c_str());
+
+            int rv = Backend::get()->rename(dirfd, pathname, newdirfd, newpath.c_str());
+
+            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+
+            break;
+        }
+        case Truncate:
+        {
+            /* FUSE FS sends the newsize as input. */
+            int64_t length;
+            CopyOut(tc, &length, inputAddr, sizeof(int64_t));
+            length = gem5fs_les64(length);
+
+            DPRINTF(gem5fs, "gem5fs: truncating %s\n", pathname);
+
+            DropMappings(dirfd, pathname);
+
+            int rv = Backend::get()->truncate(dirfd, pathname, length);
+
+            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+
+            break;
+        }
+        case Open:
+        {
+            /* FUSE FS sends the flags as input. */
+            uint32_t wireFlags;
+            CopyOut(tc, &wireFlags, inputAddr, sizeof(uint32_t));
+
+            int flags = gem5fs_decode_open_flags(wireFlags);
+            std::string name = pathname;
+
+            DPRINTF(gem5fs, "gem5fs: opening %s\n", pathname);
+
+            RunHostOperation(tc, resultAddr, &fileOp, [dirfd, name, flags](AsyncJob *job) {
+                /* Create a pointer to the file descriptor. */
+                int32_t *fd = NewResponse<int32_t>();
+                int rv = Backend::get()->open(dirfd, name.c_str(), flags, 0);
+
+                *fd = gem5fs_les32(rv);
+
+                job->finish((rv >= 0), (uint8_t*)fd, sizeof(int32_t));
+            });
+
+            break;
+        }
+        case Read:
+        {
+            /* FUSE FS sends a DataOperation struct as input. */
+            DataOperation dataOp;
+            CopyOut(tc, &dataOp, inputAddr, sizeof(DataOperation));
+
+            int hostfd = gem5fs_les32(dataOp.hostfd);
+            uint64_t size = std::min<uint64_t>(gem5fs_le64(dataOp.size), GEM5FS_MAX_DATA_SIZE);
+            int64_t offset = gem5fs_les64(dataOp.offset);
+            /* An older FUSE fs leaves the flags uninitialized. */
+            bool willNeed = negotiated && (gem5fs_le32(dataOp.flags) & GEM5FS_DATA_WILLNEED) != 0;
+
+            DPRINTF(gem5fs, "gem5fs: reading %d bytes from fd %d\n", size, hostfd);
+
+            /*
+             *  The mmap engine copies from the mapping into the guest's
+             *  response buffer. It runs right here, even for async
+             *  requests, since it touches guest memory.
+             */
+            int mapfd = Backend::get()->hostFd(hostfd);
+
+            if (FileMappings::get()->enabled() && mapfd >= 0
+                && (features & GEM5FS_FEATURE_INLINE_RESPONSE)
+                && fileOp.responseBuf != 0 && size <= fileOp.responseCapacity)
+            {
+                int64_t copied = MappedRead(tc, mapfd, offset, size, (Addr)fileOp.responseBuf, willNeed);
+
+                if (copied >= 0)
+                {
+                    SendResponse(tc, resultAddr, &fileOp, true, NULL, copied);
+                    break;
+                }
+            }
+
+            /*
+             *  Read straight into the guest's response buffer when it can
+             *  be mapped, the response then only carries the size read.
+             *  That touches guest memory, so a request that would be queued
+             *  reads into a temporary on the worker instead.
+             */
+            std::vector<struct iovec> iov;
+
+            if ((features & GEM5FS_FEATURE_INLINE_RESPONSE)
+                && size <= fileOp.responseCapacity
+                && !QueuesHostOperation(&fileOp)
+                && MapGuestBuffer(tc, (Addr)fileOp.responseBuf, size, iov))
             {
-                warn("gem5fs: char does not match guest's size.\n");
-                test_passed = false;
+                RunGuestOperation(tc, resultAddr, &fileOp, [hostfd, offset, iov, willNeed](AsyncJob *job) {
+                    ssize_t rv = ReadFile(hostfd, iov.data(), iov.size(), offset, willNeed);
+
+                    job->finish((rv >= 0), NULL, (rv >= 0) ? rv : 0);
+                });
+
+                break;
             }
 
-            if (testOp.off_t_size != sizeof(off_t))
-            {
-                warn("gem5fs: char does not match guest's size.\n");
-                test_passed = false;
-            }
+            RunHostOperation(tc, resultAddr, &fileOp, [hostfd, size, offset, willNeed](AsyncJob *job) {
+                uint8_t *tmpBuf = NewResponseData(size);
+                struct iovec range;
+                range.iov_base = tmpBuf;
+                range.iov_len = size;
+
+                ssize_t rv = ReadFile(hostfd, &range, 1, offset, willNeed);
+
+                /* Save the response data for GetResult. */
+                job->finish((rv >= 0), tmpBuf, rv);
+            });
+
+            break;
+        }
+        case Write:
+        {
+            /* FUSE FS sends a DataOperation struct as input. */
+            DataOperation dataOp;
+            CopyOut(tc, &dataOp, inputAddr, sizeof(DataOperation));
+
+            int hostfd = gem5fs_les32(dataOp.hostfd);
+            uint64_t size = std::min<uint64_t>(gem5fs_le64(dataOp.size), GEM5FS_MAX_DATA_SIZE);
+            int64_t offset = gem5fs_les64(dataOp.offset);
 
-            if (testOp.int_size != sizeof(int))
-            {
-                warn("gem5fs: int does not match guest's size.\n");
-                test_passed = false;
-            }
+            DPRINTF(gem5fs, "gem5fs: Writing %d bytes to fd %d\n", size, hostfd);
 
-            if (testOp.DataOperation_size != sizeof(struct DataOperation))
-            {
-                warn("gem5fs: DataOperation struct does not match guest's size.\n");
-                test_passed = false;
-            }
+            /* The mmap engine copies from the guest into the mapping. */
+            int mapfd = Backend::get()->hostFd(hostfd);
 
-            if (testOp.ChownOperation_size != sizeof(struct ChownOperation))
+            if (FileMappings::get()->enabled() && mapfd >= 0)
             {
-                warn("gem5fs: ChownOperation struct does not match guest's size.\n");
-                test_passed = false;
-            }
+                int64_t copied = MappedWrite(tc, mapfd, offset, size, (Addr)gem5fs_le64(dataOp.data));
 
-            if (testOp.SyncOperation_size != sizeof(struct SyncOperation))
-            {
-                warn("gem5fs: SyncOperation struct does not match guest's size.\n");
-                test_passed = false;
-            }
+                if (copied >= 0)
+                {
+                    BlockCache::get()->invalidate(mapfd);
+                    SharedCache::get()->invalidate(mapfd);
 
-            if (testOp.XAttrOperation_size != sizeof(struct XAttrOperation))
-            {
-                warn("gem5fs: XAttrOperation struct does not match guest's size.\n");
-                test_passed = false;
-            }
+                    int64_t *written = NewResponse<int64_t>();
+                    *written = gem5fs_les64(copied);
 
-            if (testOp.ftruncOperation_size != sizeof(struct ftruncOperation))
-            {
-                warn("gem5fs: ftruncOperation struct does not match guest's size.\n");
-                test_passed = false;
+                    SendResponse(tc, resultAddr, &fileOp, true, (uint8_t*)written, sizeof(int64_t));
+                    break;
+                }
             }
 
             /*
-             *  If anything failed, we will send back an error code to
-             *  the FUSE FS, which will decide to mount or not.
+             *  Write straight from the guest's buffer when it can be mapped,
+             *  unless the request would be queued on a worker.
              */
-            SendResponse(tc, resultAddr, &fileOp, test_passed, NULL, 0);
+            std::vector<struct iovec> iov;
 
-            break;
-        }
-        case SetMountpoint:
-        {
-            /* FUSE sends the mountpoint as a char array. */
-            CopyOut(tc, mountpoint, inputAddr, fileOp.structSize+1);
+            if (!QueuesHostOperation(&fileOp)
+                && MapGuestBuffer(tc, (Addr)gem5fs_le64(dataOp.data), size, iov))
+            {
+                RunGuestOperation(tc, resultAddr, &fileOp, [hostfd, offset, iov](AsyncJob *job) {
+                    int64_t *written = NewResponse<int64_t>();
+                    ssize_t rv = Backend::get()->write(hostfd, iov.data(), iov.size(), offset);
 
-            SendResponse(tc, resultAddr, &fileOp, true, NULL, 0);
+                    *written = gem5fs_les64(rv);
 
-            break;
-        }
-        case GetMountpoint:
-        {
-            BufferResponse(tc, resultAddr, &fileOp, true, (uint8_t*)mountpoint, strlen(mountpoint)+1);
+                    job->finish((rv >= 0), (uint8_t*)written, sizeof(int64_t));
+                });
 
-            break;
-        }
-        case GetAttr:
-        {
-            DPRINTF(gem5fs, "gem5fs: reading attributes on %s\n", pathname);
+                break;
+            }
 
-            /*
-             *  lstat returns 0 on success, -1 on failure and errno is
-             *  set. The stat struct does not appear to contain any pointers
-             *  within the struct.
-             */
-            struct stat *statbuf = new struct stat;
-            int rv = ::lstat(pathname, statbuf);
+            /* The data has to be copied out before the work is queued. */
+            char *tmpBuf = new char[size];
+            CopyOut(tc, tmpBuf, (Addr)gem5fs_le64(dataOp.data), size);
 
-            BufferResponse(tc, resultAddr, &fileOp, (rv == 0), (uint8_t*)statbuf, sizeof(struct stat));
+            RunHostOperation(tc, resultAddr, &fileOp, [hostfd, size, offset, tmpBuf](AsyncJob *job) {
+                int64_t *written = NewResponse<int64_t>();
+                struct iovec range;
+                range.iov_base = tmpBuf;
+                range.iov_len = size;
 
-            break;
-        }
-        case ReadLink:
-        {
-            /* FUSE FS sends the size of the buffer as input. */
-            size_t bufSize;
-            CopyOut(tc, &bufSize, inputAddr, fileOp.structSize);
+                ssize_t rv = Backend::get()->write(hostfd, &range, 1, offset);
 
-            /* Make a temporary buffer */
-            char *link = new char[bufSize];
+                delete [] tmpBuf;
 
-            DPRINTF(gem5fs, "gem5fs: reading link on %s\n", pathname);
+                *written = gem5fs_les64(rv);
 
-            /* Call readlink with this size */ 
-            int rv = ::readlink(pathname, link, bufSize-1);
-            if (rv >= 0)
-                link[rv] = '\0'; // readlink doesn't append \0.
+                /* Send the response. */
+                job->finish((rv >= 0), (uint8_t*)written, sizeof(int64_t));
+            });
 
-            /* Save the response data for GetResult. */
-            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), (uint8_t*)link, bufSize);
-            
             break;
         }
-        case Unlink:
+        case ReadV:
         {
-            DPRINTF(gem5fs, "gem5fs: unlinking %s\n", pathname);
+            /* FUSE FS sends a VectorOperation struct as input. */
+            VectorOperation vecOp;
+            CopyOut(tc, &vecOp, inputAddr, sizeof(VectorOperation));
 
-            /* No input data. */
-            int rv = ::unlink(pathname);
+            int hostfd = gem5fs_les32(vecOp.hostfd);
+            int64_t offset = gem5fs_les64(vecOp.offset);
+            std::vector<WireSegment> segments;
+            uint64_t total;
 
-            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+            if (!ReadSegments(tc, &vecOp, segments, total))
+            {
+                errno = EINVAL;
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                break;
+            }
 
-            break;
-        }
-        case MakeSymLink:
-        {
-            /* FUSE FS sends name of link as input. */
-            char *link = new char[fileOp.structSize+1];
-            CopyOut(tc, link, inputAddr, fileOp.structSize+1);
-        
-            DPRINTF(gem5fs, "gem5fs: symlinking %s to %s\n", pathname, link);
+            DPRINTF(gem5fs, "gem5fs: reading %d bytes into %d segments from fd %d\n", total, segments.size(), hostfd);
 
-            int rv = ::symlink(pathname, link);
+            /*
+             *  Read straight into the segments when they can be mapped.
+             *  Both ways touch guest memory, so they always run here.
+             */
+            std::vector<struct iovec> iov;
 
-            /* Returns 0 on success. */
-            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+            if (MapSegments(tc, segments, iov))
+            {
+                RunGuestOperation(tc, resultAddr, &fileOp, [hostfd, offset, iov](AsyncJob *job) {
+                    int64_t *bytes = NewResponse<int64_t>();
+                    ssize_t rv = ReadFile(hostfd, iov.data(), iov.size(), offset, false);
 
-            delete link;
+                    *bytes = gem5fs_les64(rv);
 
-            break;
-        }
-        case Rename:
-        {
-            /* New path is the input. */
-            char *newpath = new char[fileOp.structSize+1];
-            CopyOut(tc, newpath, inputAddr, fileOp.structSize+1);
+                    job->finish((rv >= 0), (uint8_t*)bytes, sizeof(int64_t));
+                });
 
-            DPRINTF(gem5fs, "gem5fs: renaming %s to %s\n", pathname, newpath);
+                break;
+            }
 
-            int rv = ::rename(pathname, newpath);
+            /* Otherwise read into a temporary and scatter it. */
+            uint8_t *tmpBuf = new uint8_t[total];
+            struct iovec range;
+            range.iov_base = tmpBuf;
+            range.iov_len = total;
 
-            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+            ssize_t rv = ReadFile(hostfd, &range, 1, offset, false);
+            uint64_t copied = 0;
 
-            delete newpath;
+            for (auto iter = segments.begin(); rv > 0 && iter != segments.end(); ++iter)
+            {
+                uint64_t length = std::min(iter->length, (uint64_t)rv - copied);
 
-            break;
-        }
-        case Truncate:
-        {
-            /* FUSE FS sends the newsize as input. */
-            off_t length;
-            CopyOut(tc, &length, inputAddr, fileOp.structSize);
+                CopyIn(tc, (Addr)iter->base, tmpBuf + copied, length);
+                copied += length;
+            }
 
-            DPRINTF(gem5fs, "gem5fs: truncating %s\n", pathname);
+            delete [] tmpBuf;
 
-            int rv = ::truncate(pathname, length);
+            int64_t *bytes = NewResponse<int64_t>();
+            *bytes = gem5fs_les64(rv);
 
-            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), (uint8_t*)bytes, sizeof(int64_t));
 
             break;
         }
-        case Open:
+        case WriteV:
         {
-            /* FUSE FS sends the flags as input. */
-            int flags;
-            CopyOut(tc, &flags, inputAddr, fileOp.structSize);
+            /* FUSE FS sends a VectorOperation struct as input. */
+            VectorOperation vecOp;
+            CopyOut(tc, &vecOp, inputAddr, sizeof(VectorOperation));
 
-            /* Create a pointer to the file descriptor. */
-            int *fd = new int;
+            int hostfd = gem5fs_les32(vecOp.hostfd);
+            int64_t offset = gem5fs_les64(vecOp.offset);
+            std::vector<WireSegment> segments;
+            uint64_t total;
 
-            DPRINTF(gem5fs, "gem5fs: opening %s\n", pathname);
+            if (!ReadSegments(tc, &vecOp, segments, total))
+            {
+                errno = EINVAL;
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                break;
+            }
 
-            *fd = open(pathname, flags);
+            DPRINTF(gem5fs, "gem5fs: writing %d bytes from %d segments to fd %d\n", total, segments.size(), hostfd);
 
-            DPRINTF(gem5fs, "gem5fs: Open fd is %d\n", *fd);
-            
-            /* Save the response data for GetResult. */
-            BufferResponse(tc, resultAddr, &fileOp, (*fd >= 0), (uint8_t*)fd, sizeof(int));
+            /*
+             *  Write straight from the segments when they can be mapped,
+             *  unless the request would be queued on a worker.
+             */
+            std::vector<struct iovec> iov;
 
-            break;
-        }
-        case Read:
-        {
-            /* FUSE FS sends a DataOperation struct as input. */
-            DataOperation dataOp;
-            CopyOut(tc, &dataOp, inputAddr, fileOp.structSize);
+            if (QueuesHostOperation(&fileOp) || !MapSegments(tc, segments, iov))
+            {
+                /* Otherwise gather them into a temporary first. */
+                uint8_t *tmpBuf = new uint8_t[total];
+                uint64_t copied = 0;
 
-            uint8_t *tmpBuf = new uint8_t[dataOp.size];
-            ssize_t rv = pread(dataOp.hostfd, tmpBuf, dataOp.size, dataOp.offset);
+                for (auto iter = segments.begin(); iter != segments.end(); ++iter)
+                {
+                    CopyOut(tc, tmpBuf + copied, (Addr)iter->base, iter->length);
+                    copied += iter->length;
+                }
 
-            DPRINTF(gem5fs, "gem5fs: read %d bytes from fd %d\n", rv, dataOp.hostfd);
+                struct iovec range;
+                range.iov_base = tmpBuf;
+                range.iov_len = total;
 
-            /* Save the response data for GetResult. */
-            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), tmpBuf, rv);
+                RunHostOperation(tc, resultAddr, &fileOp, [hostfd, offset, range](AsyncJob *job) {
+                    int64_t *bytes = NewResponse<int64_t>();
+                    ssize_t rv = Backend::get()->write(hostfd, &range, 1, offset);
 
-            break;
-        }
-        case Write:
-        {
-            /* FUSE FS sends a DataOperation struct as input. */
-            DataOperation dataOp;
-            CopyOut(tc, &dataOp, inputAddr, fileOp.structSize);
+                    delete [] (uint8_t*)range.iov_base;
+
+                    *bytes = gem5fs_les64(rv);
 
-            char *tmpBuf = new char[dataOp.size];
-            CopyOut(tc, tmpBuf, (Addr)dataOp.data, dataOp.size);
+                    job->finish((rv >= 0), (uint8_t*)bytes, sizeof(int64_t));
+                });
 
-            ssize_t *rv = new ssize_t;
-            *rv = pwrite(dataOp.hostfd, tmpBuf, dataOp.size, dataOp.offset);
+                break;
+            }
 
-            DPRINTF(gem5fs, "gem5fs: Writing %d bytes (%s) to fd %d returned %d\n", dataOp.size, tmpBuf, dataOp.hostfd, rv);
+            RunGuestOperation(tc, resultAddr, &fileOp, [hostfd, offset, iov](AsyncJob *job) {
+                int64_t *bytes = NewResponse<int64_t>();
+                ssize_t rv = Backend::get()->write(hostfd, iov.data(), iov.size(), offset);
 
-            /* Send the response. */
-            BufferResponse(tc, resultAddr, &fileOp, (*rv >= 0), (uint8_t*)rv, sizeof(ssize_t));
+                *bytes = gem5fs_les64(rv);
 
-            delete tmpBuf;
+                job->finish((rv >= 0), (uint8_t*)bytes, sizeof(int64_t));
+            });
 
             break;
         }
         case GetStats:
         {
-            /* success if rv == 0. */
-            struct statvfs *statbuf = new struct statvfs;
-            int rv = ::statvfs(pathname, statbuf);
+            std::string path(pathname);
+
+            RunHostOperation(tc, resultAddr, &fileOp, [dirfd, path](AsyncJob *job) {
+                /* success if rv == 0. */
+                struct statvfs statbuf;
+                int rv = Backend::get()->statfs(dirfd, path.c_str(), &statbuf);
 
-            /* Save response for FUSE GetResult. */
-            BufferResponse(tc, resultAddr, &fileOp, (rv == 0), (uint8_t*)statbuf, sizeof(struct statvfs));
+                WireStatvfs *wire = NewResponse<WireStatvfs>();
+                gem5fs_encode_statvfs(wire, &statbuf);
+
+                /* Save response for FUSE GetResult. */
+                job->finish((rv == 0), (uint8_t*)wire, sizeof(WireStatvfs));
+            });
 
             break;
         }
         case Release:
         {
             /* FUSE FS sends the file descriptor as input. */
-            int fd;
-            CopyOut(tc, &fd, inputAddr, fileOp.structSize);
+            int32_t fd;
+            CopyOut(tc, &fd, inputAddr, sizeof(int32_t));
+            fd = gem5fs_les32(fd);
 
             DPRINTF(gem5fs, "gem5fs: closing %s\n", pathname);
 
-            int rv = close(fd);
+            int mapfd = Backend::get()->hostFd(fd);
+
+            if (mapfd >= 0)
+                FileMappings::get()->release(mapfd);
+
+            int rv = Backend::get()->close(fd);
 
             DPRINTF(gem5fs, "gem5fs: close on fd %d returned %d\n", fd, rv);
             
@@ -437,18 +1436,19 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         {
             /* FUSE FS sends SyncOperation struct as input. */
             struct SyncOperation syncOp;
-            CopyOut(tc, &syncOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &syncOp, inputAddr, sizeof(SyncOperation));
+
+            int fd = gem5fs_les32(syncOp.fd);
+            uint32_t datasync = gem5fs_le32(syncOp.datasync);
 
             DPRINTF(gem5fs, "gem5fs: syncing %s\n", pathname);
 
-            int rv;
-            if (syncOp.datasync == 1)
-                rv = ::fdatasync(syncOp.fd);
-            else
-                rv = ::fsync(syncOp.fd);
+            RunHostOperation(tc, resultAddr, &fileOp, [fd, datasync](AsyncJob *job) {
+                int rv = Backend::get()->fsync(fd, (datasync == 1));
 
-            /* Success if rv == 0. */
-            SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
+                /* Success if rv == 0. */
+                job->finish((rv == 0), NULL, 0);
+            });
             
             break;
         }
@@ -456,30 +1456,32 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         {
             /* FUSE FS sends XAttrOperation as input. */
             struct XAttrOperation xattrOp;
-            CopyOut(tc, &xattrOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &xattrOp, inputAddr, sizeof(XAttrOperation));
+
+            uint64_t name_size = gem5fs_le64(xattrOp.name_size);
+            uint64_t value_size = gem5fs_le64(xattrOp.value_size);
 
             /* Copy out the name and value as well. */
-            char *xname = new char[xattrOp.name_size+1];
-            char *value = new char[xattrOp.value_size+1];
+            char *xname = new char[name_size+1];
+            char *value = new char[value_size+1];
 
-            CopyOut(tc, xname, (Addr)xattrOp.name, xattrOp.name_size+1);
-            CopyOut(tc, value, (Addr)xattrOp.value, xattrOp.value_size+1);
+            CopyOut(tc, xname, (Addr)gem5fs_le64(xattrOp.name), name_size+1);
+            CopyOut(tc, value, (Addr)gem5fs_le64(xattrOp.value), value_size+1);
 
             DPRINTF(gem5fs, "gem5fs: setting xattr on %s\n", pathname);
 
             /*
              *  This will set the attribute on the symlink itself
-             *  if the file is a symlink. There doesn't seem to be
-             *  an interface for the user to specify which, so we
-             *  will always use lsetxattr over setxattr.
+             *  if the file is a symlink.
              */
-            ssize_t rv = ::lsetxattr(pathname, xname, value, xattrOp.value_size, xattrOp.flags);
+            int flags = gem5fs_les32(xattrOp.flags);
+            ssize_t rv = Backend::get()->setXAttr(dirfd, pathname, xname, value, value_size, flags);
 
             /* Success if rv == 0. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
 
-            delete xname;
-            delete value;
+            delete [] xname;
+            delete [] value;
 
             break;
         }
@@ -487,26 +1489,33 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         {
             /* FUSE FS sends XAttrOperation as input. */
             struct XAttrOperation xattrOp;
-            CopyOut(tc, &xattrOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &xattrOp, inputAddr, sizeof(XAttrOperation));
+
+            uint64_t name_size = gem5fs_le64(xattrOp.name_size);
+            uint64_t value_size = gem5fs_le64(xattrOp.value_size);
 
             /* Copy out the name of the attribute. */
-            char *xname = new char[xattrOp.name_size+1];
-            CopyOut(tc, xname, (Addr)xattrOp.name, xattrOp.name_size+1);
+            char *xname = new char[name_size+1];
+            CopyOut(tc, xname, (Addr)gem5fs_le64(xattrOp.name), name_size+1);
 
             DPRINTF(gem5fs, "gem5fs: getting xattr on %s\n", pathname);
 
             /* Create a temporary buffer for the value. */
-            char *value = new char[xattrOp.value_size+1];
-            ssize_t rv = ::lgetxattr(pathname, xname, value, xattrOp.value_size);
+            char *value = new char[value_size+1];
+            ssize_t rv = Backend::get()->getXAttr(dirfd, pathname, xname, value, value_size);
 
-            /* Success if rv >= 0. */
-            if (rv >= 0)
-                CopyIn(tc, (Addr)xattrOp.value, value, xattrOp.value_size+1);
+            /* Success if rv >= 0. A zero value_size only asks for the size. */
+            if (rv > 0 && value_size > 0)
+                CopyIn(tc, (Addr)gem5fs_le64(xattrOp.value), value, rv);
+
+            /* The response is the size of the value. */
+            int64_t *valueSize = NewResponse<int64_t>();
+            *valueSize = gem5fs_les64(rv);
 
-            SendResponse(tc, resultAddr, &fileOp, (rv >= 0), NULL, 0);
+            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), (uint8_t*)valueSize, sizeof(int64_t));
 
-            delete xname;
-            delete value;
+            delete [] xname;
+            delete [] value;
 
             break;
         }
@@ -514,21 +1523,27 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         {
             /* FUSE FS sends XAttrOperation as input. */
             struct XAttrOperation xattrOp;
-            CopyOut(tc, &xattrOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &xattrOp, inputAddr, sizeof(XAttrOperation));
+
+            uint64_t value_size = gem5fs_le64(xattrOp.value_size);
 
             DPRINTF(gem5fs, "gem5fs: listing xattr on %s\n", pathname);
 
             /* Create a temporary buffer for the list. */
-            char *list = new char[xattrOp.value_size+1];
-            ssize_t rv = llistxattr(pathname, list, xattrOp.value_size);
+            char *list = new char[value_size+1];
+            ssize_t rv = Backend::get()->listXAttr(dirfd, pathname, list, value_size);
 
-            /* Success if rv >= 0. */
-            if (rv >= 0)
-                CopyIn(tc, (Addr)xattrOp.value, list, xattrOp.value_size);
+            /* Success if rv >= 0. A zero value_size only asks for the size. */
+            if (rv > 0 && value_size > 0)
+                CopyIn(tc, (Addr)gem5fs_le64(xattrOp.value), list, rv);
 
-            SendResponse(tc, resultAddr, &fileOp, (rv >= 0), NULL, 0);
+            /* The response is the size of the list. */
+            int64_t *listSize = NewResponse<int64_t>();
+            *listSize = gem5fs_les64(rv);
 
-            delete list;
+            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), (uint8_t*)listSize, sizeof(int64_t));
+
+            delete [] list;
 
             break;
         }
@@ -536,90 +1551,200 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         {
             /* FUSE FS sends XAttrOperation as input. */
             struct XAttrOperation xattrOp;
-            CopyOut(tc, &xattrOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &xattrOp, inputAddr, sizeof(XAttrOperation));
+
+            uint64_t name_size = gem5fs_le64(xattrOp.name_size);
 
             /* Copy out the name of the attribute to delete. */
-            char *xname = new char[xattrOp.name_size+1];
-            CopyOut(tc, xname, (Addr)xattrOp.name, xattrOp.name_size+1);
+            char *xname = new char[name_size+1];
+            CopyOut(tc, xname, (Addr)gem5fs_le64(xattrOp.name), name_size+1);
 
             DPRINTF(gem5fs, "gem5fs: removing xattr on %s\n", pathname);
 
-            int rv = ::lremovexattr(pathname, xname);
+            int rv = Backend::get()->removeXAttr(dirfd, pathname, xname);
 
             /* Success if rv == 0. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
 
-            delete xname;
+            delete [] xname;
 
             break;
         }
-        case ReadDir:
+        case OpenDir:
         {
-            /*
-             *  Push back the entires to a vector. Once we knows how many
-             *  entires we have, we know how much space to allocate for the
-             *  response data.
-             */
-            std::vector<struct dirent> entries;
+            BackendDir *dir = Backend::get()->openDir(dirfd, pathname);
 
-            /*
-             *  We open the directory here instead of during the OpenDir
-             *  operation so that we don't need to track the DIR* pointer.
-             */
-            DIR *dirp = opendir(pathname);
-            struct dirent *de;
+            DPRINTF(gem5fs, "gem5fs: opening directory %s\n", pathname);
 
-            DPRINTF(gem5fs, "gem5fs: reading directory %s\n", pathname);
+            if (dir == NULL)
+            {
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                break;
+            }
 
-            /*
-             * readdir returns a non-null pointer on success. On failure, NULL
-             *  is returned and errno is set. When there are no more entires,
-             *  NULL is returned and errno is still 0.
-             *
-             *  Note: using *de so that a copy is made. I'm not sure what will
-             *  happen since the function isn't re-entrant.
-             */
-            while ((de = readdir(dirp)) != NULL)
+            /* The directory stays open, with its position, until ReleaseDir. */
+            uint64_t *handle = NewResponse<uint64_t>();
+            *handle = nextDirHandle++;
+            openDirs[*handle] = std::shared_ptr<BackendDir>(dir);
+
+            DPRINTF(gem5fs, "gem5fs: directory handle is %d\n", *handle);
+
+            *handle = gem5fs_le64(*handle);
+
+            BufferResponse(tc, resultAddr, &fileOp, true, (uint8_t*)handle, sizeof(uint64_t));
+
+            break;
+        }
+        case ReleaseDir:
+        {
+            /* FUSE FS sends the directory handle as input. */
+            uint64_t handle;
+            CopyOut(tc, &handle, inputAddr, sizeof(uint64_t));
+
+            auto iter = openDirs.find(gem5fs_le64(handle));
+
+            if (iter == openDirs.end())
             {
-                entries.push_back(*de);
+                errno = EBADF;
+                SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                break;
             }
 
-            /*
-             *  Close the directory here instead of ReleaseDir since
-             *  we opened it here.
-             */
-            closedir(dirp);
+            DPRINTF(gem5fs, "gem5fs: closing directory handle %d\n", iter->first);
+
+            openDirs.erase(iter);
+
+            SendResponse(tc, resultAddr, &fileOp, true, NULL, 0);
+
+            break;
+        }
+        case ReadDir:
+        case ReadDirPlus:
+        {
+            ListingFormat format = ListingSlots;
+
+            if (fileOp.oper == ReadDirPlus)
+                format = ListingPlus;
+            else if (features & GEM5FS_FEATURE_PACKED_DIRENTS)
+                format = ListingPacked;
+
+            /* A DirReadOperation as input lists part of an open directory. */
+            if (fileOp.structSize == sizeof(DirReadOperation)
+                && (features & GEM5FS_FEATURE_DIR_STREAMS))
+            {
+                DirReadOperation readOp;
+                CopyOut(tc, &readOp, inputAddr, sizeof(DirReadOperation));
+
+                auto iter = openDirs.find(gem5fs_le64(readOp.handle));
+
+                if (iter == openDirs.end())
+                {
+                    errno = EBADF;
+                    SendResponse(tc, resultAddr, &fileOp, false, NULL, 0);
+                    break;
+                }
+
+                std::shared_ptr<BackendDir> dir = iter->second;
+                uint64_t cookie = gem5fs_le64(readOp.cookie);
+                uint64_t capacity = gem5fs_le32(readOp.capacity);
+
+                DPRINTF(gem5fs, "gem5fs: listing %d bytes of directory handle %d\n", capacity, iter->first);
+
+                /*
+                 *  The kernel serializes readdir on an open directory, and
+                 *  the job holds its own reference, so the directory stays
+                 *  open for the worker pool even if a remount releases it
+                 *  first. Cookie 0 is the start, anything else is where a
+                 *  previous listing left off.
+                 */
+                auto work = [dir, format, cookie, capacity](AsyncJob *job) {
+                    std::vector<uint8_t> listing;
+
+                    dir->seek((long)cookie);
+                    ListDirectory(dir.get(), format, capacity, listing);
+
+                    uint8_t *response = NULL;
+
+                    if (!listing.empty())
+                    {
+                        response = NewResponseData(listing.size());
+                        memcpy(response, listing.data(), listing.size());
+                    }
+
+                    /* An empty listing is the end of the directory. */
+                    job->finish(true, response, listing.size());
+                };
+
+                if (format == ListingPlus)
+                {
+                    AsyncJob job((Operation)fileOp.oper, work);
+                    job.work(&job);
+
+                    SendJobResponse(tc, resultAddr, &fileOp, &job);
+                }
+                else
+                {
+                    RunHostOperation(tc, resultAddr, &fileOp, work);
+                }
+
+                break;
+            }
 
             /*
-             *  Allocate enough buffer space for the data to be returned.
+             *  Otherwise list the whole directory, opening it here rather
+             *  than during OpenDir so there is no directory to track.
              */
-            size_t entry_buffer_size = 256 * entries.size();
-            char *all_entries = new char[entry_buffer_size];
-            char *cur_entry = all_entries;
+            std::string name(pathname);
+
+            DPRINTF(gem5fs, "gem5fs: reading directory %s\n", pathname);
+
+            auto work = [dirfd, name, format](AsyncJob *job) {
+                BackendDir *dir = Backend::get()->openDir(dirfd, name.c_str());
 
-            for(auto iter = entries.begin(); iter != entries.end(); ++iter)
+                if (dir == NULL)
+                {
+                    job->finish(false, NULL, 0);
+                    return;
+                }
+
+                std::vector<uint8_t> listing;
+                ListDirectory(dir, format, UINT64_MAX, listing);
+
+                delete dir;
+
+                uint8_t *response = NewResponseData(listing.size());
+                memcpy(response, listing.data(), listing.size());
+
+                /* A directory always has . and .., so an empty listing failed. */
+                job->finish((listing.size() != 0), response, listing.size());
+            };
+
+            /* Plus listings use the node table, so they always run here. */
+            if (format == ListingPlus)
             {
-                char *entry_name = iter->d_name;
+                AsyncJob job((Operation)fileOp.oper, work);
+                job.work(&job);
 
-                memcpy(cur_entry, entry_name, 256);
-                cur_entry += 256;
+                SendJobResponse(tc, resultAddr, &fileOp, &job);
+            }
+            else
+            {
+                RunHostOperation(tc, resultAddr, &fileOp, work);
             }
-
-            /* Save the response data for GetResult. */
-            BufferResponse(tc, resultAddr, &fileOp, (entries.size() != 0), (uint8_t*)all_entries, entry_buffer_size);
 
             break;
         }
         case MakeDirectory:
         {
             /* mkdir requires input data. */
-            mode_t dirMode;
-            CopyOut(tc, &dirMode, inputAddr, fileOp.structSize);
+            uint32_t dirMode;
+            CopyOut(tc, &dirMode, inputAddr, sizeof(uint32_t));
+            dirMode = gem5fs_le32(dirMode);
 
             DPRINTF(gem5fs, "gem5fs: Making directory %s with mode %d (%X)\n", pathname, dirMode, dirMode);
 
             /* Call mkdir */ 
-            int rv = ::mkdir(pathname, dirMode);
+            int rv = Backend::get()->mkdir(dirfd, pathname, dirMode);
 
             /* Save the response data for GetResult. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
@@ -631,7 +1756,7 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
             DPRINTF(gem5fs, "gem5fs: removing directory %s\n", pathname);
 
             /* Returns 0 on success. */
-            int rv = ::rmdir(pathname);
+            int rv = Backend::get()->rmdir(dirfd, pathname);
 
             /* Save the response data for GetResult. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
@@ -641,13 +1766,14 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         case ChangePermission:
         {
             /* mkdir requires input data. */
-            mode_t chmodMode;
-            CopyOut(tc, &chmodMode, inputAddr, fileOp.structSize);
+            uint32_t chmodMode;
+            CopyOut(tc, &chmodMode, inputAddr, sizeof(uint32_t));
+            chmodMode = gem5fs_le32(chmodMode);
 
             DPRINTF(gem5fs, "gem5fs: Changing %s permissions to mode %d (%X)\n", pathname, chmodMode, chmodMode);
 
             /* Call mkdir */ 
-            int rv = ::chmod(pathname, chmodMode);
+            int rv = Backend::get()->chmod(dirfd, pathname, chmodMode);
 
             /* Save the response data for GetResult. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
@@ -658,12 +1784,12 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         {
             /* ChownOperation is passed as input. */
             struct ChownOperation chownOp;
-            CopyOut(tc, &chownOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &chownOp, inputAddr, sizeof(ChownOperation));
 
             DPRINTF(gem5fs, "gem5fs: changing owner of %s\n", pathname);
 
             /* Success if rv == 0 */
-            int rv = ::chown(pathname, chownOp.uid, chownOp.gid);
+            int rv = Backend::get()->chown(dirfd, pathname, gem5fs_le32(chownOp.uid), gem5fs_le32(chownOp.gid));
 
             /* Send response rv. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
@@ -673,13 +1799,14 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         case Access:
         {
             /* FUSE FS sends mask as input. */
-            int mask;
-            CopyOut(tc, &mask, inputAddr, fileOp.structSize);
+            int32_t mask;
+            CopyOut(tc, &mask, inputAddr, sizeof(int32_t));
+            mask = gem5fs_les32(mask);
 
             DPRINTF(gem5fs, "gem5fs: accessing %s\n", pathname);
 
             /* Call access */
-            int rv = ::access(pathname, mask);
+            int rv = Backend::get()->access(dirfd, pathname, mask);
 
             /* Send the return value back. */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
@@ -689,32 +1816,41 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         case Create:
         {
             /* FUSE FS sends mask as input. */
-            mode_t mode;
-            CopyOut(tc, &mode, inputAddr, fileOp.structSize);
+            uint32_t mode;
+            CopyOut(tc, &mode, inputAddr, sizeof(uint32_t));
+            mode = gem5fs_le32(mode);
 
             /* Create a pointer to the file descriptor. */
-            int *fd = new int;
+            int32_t *fd = NewResponse<int32_t>();
 
             DPRINTF(gem5fs, "gem5fs: creating %s\n", pathname);
 
             /* Call creat */
-            *fd = ::creat(pathname, mode);
+            int rv = Backend::get()->open(dirfd, pathname, O_CREAT | O_WRONLY | O_TRUNC, mode);
 
-            DPRINTF(gem5fs, "gem5fs: Create fd is %d\n", *fd);
+            DPRINTF(gem5fs, "gem5fs: Create fd is %d\n", rv);
+
+            *fd = gem5fs_les32(rv);
             
             /* Save the response data for GetResult. */
-            BufferResponse(tc, resultAddr, &fileOp, (*fd >= 0), (uint8_t*)fd, sizeof(int));
+            BufferResponse(tc, resultAddr, &fileOp, (rv >= 0), (uint8_t*)fd, sizeof(int32_t));
             break;
         }
         case Ftruncate:
         {
             /* FUSE FS sends ftruncOperation struct as input. */
             struct ftruncOperation ftOp;
-            CopyOut(tc, &ftOp, inputAddr, fileOp.structSize);
+            CopyOut(tc, &ftOp, inputAddr, sizeof(ftruncOperation));
 
             DPRINTF(gem5fs, "gem5fs: ftruncating %s\n", pathname);
 
-            int rv = ::ftruncate(ftOp.fd, ftOp.length);
+            int fd = gem5fs_les32(ftOp.fd);
+            int mapfd = Backend::get()->hostFd(fd);
+
+            if (mapfd >= 0)
+                FileMappings::get()->drop(mapfd);
+
+            int rv = Backend::get()->ftruncate(fd, gem5fs_les64(ftOp.length));
 
             /* Success if rv >= 0 */
             SendResponse(tc, resultAddr, &fileOp, (rv == 0), NULL, 0);
@@ -724,15 +1860,21 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
         case FGetAttr:
         {
             /* FUSE FS sends file descriptor as input. */
-            int fd;
-            CopyOut(tc, &fd, inputAddr, fileOp.structSize);
+            int32_t fd;
+            CopyOut(tc, &fd, inputAddr, sizeof(int32_t));
+            fd = gem5fs_les32(fd);
 
             DPRINTF(gem5fs, "gem5fs: getting attributes on %s fd\n", pathname);
 
-            struct stat *statbuf = new struct stat;
-            int rv = ::fstat(fd, statbuf);
+            RunHostOperation(tc, resultAddr, &fileOp, [fd](AsyncJob *job) {
+                struct stat statbuf;
+                int rv = Backend::get()->fstat(fd, &statbuf);
+
+                WireStat *wire = NewResponse<WireStat>();
+                gem5fs_encode_stat(wire, &statbuf);
 
-            BufferResponse(tc, resultAddr, &fileOp, (rv == 0), (uint8_t*)statbuf, sizeof(struct stat));
+                job->finish((rv == 0), (uint8_t*)wire, sizeof(WireStat));
+            });
 
             break;
         }
@@ -747,72 +1889,285 @@ uint64_t gem5fs::ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestA
     /* Reset the umask to the previous value. */
     (void)umask(saved_mask);
 
+    delete [] pathname;
+
     return result;
 }
 
 /*
- *  Clean up any malloc'd data.
+ *  Process every request queued in the submission ring and post a
+ *  completion for each one. Each request is handled exactly as if it was
+ *  sent with its own pseudo instruction, but the FUSE fs only pays for
+ *  one. Returns the number of requests processed.
  */
-void gem5fs::CleanUp(FileOperation *bufferOp)
+unsigned int gem5fs::ProcessRing(ThreadContext *tc)
 {
-    if (bufferOp->opStruct != NULL )
+    RingHeader header;
+    CopyOut(tc, &header, ringAddr, sizeof(RingHeader));
+
+    uint32_t sqHead = gem5fs_le32(header.sqHead);
+    uint32_t sqTail = gem5fs_le32(header.sqTail);
+    uint32_t cqHead = gem5fs_le32(header.cqHead);
+    uint32_t cqTail = gem5fs_le32(header.cqTail);
+
+    Addr sqAddr = ringAddr + sizeof(RingHeader);
+    Addr cqAddr = sqAddr + ringEntries * sizeof(RingSubmission);
+    unsigned int mask = ringEntries - 1;
+    unsigned int processed = 0;
+
+    DPRINTF(gem5fs, "gem5fs: processing ring submissions %d to %d\n", sqHead, sqTail);
+
+    /*
+     *  Stop if the completion ring is full. The FUSE fs never has more
+     *  requests in flight than entries, so this should not happen.
+     */
+    while (sqHead != sqTail && cqTail - cqHead < ringEntries)
     {
-        /*
-         *  I *think* free will work properly even if the
-         *  type of opStruct isn't the same as what it was
-         *  cast to when memory was allocated (malloc does
-         *  return void after all).
-         */
-        delete bufferOp->opStruct;
+        Addr subAddr = sqAddr + (sqHead & mask) * sizeof(RingSubmission);
+        Addr compAddr = cqAddr + (cqTail & mask) * sizeof(RingCompletion);
+
+        RingSubmission submission;
+        CopyOut(tc, &submission, subAddr, sizeof(RingSubmission));
+
+        uint32_t oper = gem5fs_le32(submission.request.oper);
+
+        if (oper == SetupRing || oper == SubmitRing)
+        {
+            /* The rings can't be managed from inside the rings. */
+            FileOperation errorOp = submission.request;
+            gem5fs_header_le(&errorOp);
+
+            errorOp.oper = ErrorCode;
+            errorOp.opType = ResponseOperation;
+            errorOp.result = 0;
+            errorOp.errnum = EINVAL;
+
+            WriteHeader(tc, compAddr + offsetof(RingCompletion, response), &errorOp);
+        }
+        else
+        {
+            ProcessRequest(tc, (Addr)gem5fs_le64(submission.input),
+                           subAddr + offsetof(RingSubmission, request),
+                           compAddr + offsetof(RingCompletion, response));
+        }
+
+        /* userData is opaque to gem5, so it is copied as is. */
+        CopyIn(tc, compAddr + offsetof(RingCompletion, userData), &submission.userData, sizeof(uint64_t));
+
+        sqHead++;
+        cqTail++;
+        processed++;
     }
-    delete bufferOp;
+
+    /* Only the indices owned by gem5 are written back. */
+    header.sqHead = gem5fs_le32(sqHead);
+    header.cqTail = gem5fs_le32(cqTail);
+
+    CopyIn(tc, ringAddr + offsetof(RingHeader, sqHead), &header.sqHead, sizeof(uint32_t));
+    CopyIn(tc, ringAddr + offsetof(RingHeader, cqTail), &header.cqTail, sizeof(uint32_t));
+
+    return processed;
 }
 
 /*
- *  Allocates response data and "buffers" it by setting the result pointer
- *  to itself, allowing the FUSE fs to call GetResult with said pointer and
- *  access this data again without the pointer being lost.
+ *  Run the steps of a compound request in order. Returns false if any step
+ *  failed, with errno set to that step's error.
  */
-FileOperation* gem5fs::BufferResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize)
+bool gem5fs::ProcessCompound(ThreadContext *tc, Addr inputAddr)
 {
-    FileOperation *bufferOp = new FileOperation;
-
-    /* Build the buffered response struct. */
-    bufferOp->oper = (success) ? fileOperation->oper : ErrorCode;
-    bufferOp->opType = ResponseOperation;
-    bufferOp->path = fileOperation->path;
-    bufferOp->pathLength = fileOperation->pathLength;
-    bufferOp->opStruct = responseData;
-    bufferOp->structSize = responseSize;
-    bufferOp->result = bufferOp;
-    bufferOp->errnum = errno;
-
-    DPRINTF(gem5fs, "gem5fs: bufferOp->opStruct is %p\n", (void*)(bufferOp->opStruct));
-    DPRINTF(gem5fs, "gem5fs: bufferOp is %p\n", (void*)(bufferOp));
-    DPRINTF(gem5fs, "gem5fs: writing %d bytes to %p\n", bufferOp->structSize, resultAddr);
-
-    CopyIn(tc, (Addr)(resultAddr), bufferOp, sizeof(FileOperation));
-
-    /* Trash response data on error. The FUSE FS won't request after errors. */
-    if (!success)
+    CompoundOperation compoundOp;
+    CopyOut(tc, &compoundOp, inputAddr, sizeof(CompoundOperation));
+
+    uint32_t count = gem5fs_le32(compoundOp.count);
+    Addr stepsAddr = (Addr)gem5fs_le64(compoundOp.steps);
+
+    if (count > GEM5FS_COMPOUND_MAX_STEPS)
+    {
+        warn("gem5fs: compound request has too many steps (%d).\n", count);
+        errno = E2BIG;
+        return false;
+    }
+
+    /* Host fds returned by each step, -1 if the step returned none. */
+    int stepFds[GEM5FS_COMPOUND_MAX_STEPS];
+    int firstError = 0;
+
+    inCompound = true;
+
+    for (unsigned int i = 0; i < count; ++i)
     {
-        CleanUp(bufferOp);
-        bufferOp = NULL;
+        Addr stepAddr = stepsAddr + i * sizeof(CompoundStep);
+        Addr responseAddr = stepAddr + offsetof(CompoundStep, response);
+
+        CompoundStep step;
+        CopyOut(tc, &step, stepAddr, sizeof(CompoundStep));
+
+        uint32_t oper = gem5fs_le32(step.request.oper);
+        Addr input = (Addr)gem5fs_le64(step.input);
+        int fdStep = gem5fs_les32(step.fdStep);
+        uint32_t fdOffset = gem5fs_le32(step.fdOffset);
+        uint32_t flags = gem5fs_le32(step.flags);
+
+        stepFds[i] = -1;
+
+        int stepError = 0;
+        bool nested = (oper == Compound || oper == SetupRing || oper == SubmitRing);
+
+        if (firstError != 0 && !(flags & CompoundAlways))
+            stepError = ECANCELED;
+        else if (nested)
+            stepError = EINVAL;
+        else if (fdStep >= (int)i)
+            stepError = EINVAL;
+        else if (fdStep >= 0 && stepFds[fdStep] < 0)
+            stepError = EBADF;
+
+        if (stepError != 0)
+        {
+            FileOperation errorOp = step.request;
+            gem5fs_header_le(&errorOp);
+
+            errorOp.oper = ErrorCode;
+            errorOp.opType = ResponseOperation;
+            errorOp.result = 0;
+            errorOp.errnum = stepError;
+
+            WriteHeader(tc, responseAddr, &errorOp);
+        }
+        else
+        {
+            if (fdStep >= 0)
+            {
+                DPRINTF(gem5fs, "gem5fs: compound step %d uses fd %d from step %d\n", i, stepFds[fdStep], fdStep);
+
+                int32_t fd = gem5fs_les32(stepFds[fdStep]);
+                CopyIn(tc, input + fdOffset, &fd, sizeof(int32_t));
+            }
+
+            ProcessRequest(tc, input, stepAddr + offsetof(CompoundStep, request), responseAddr);
+
+            FileOperation response;
+            ReadHeader(tc, responseAddr, &response);
+
+            if (response.oper == ErrorCode)
+            {
+                stepError = response.errnum;
+            }
+            else if (oper == Open || oper == Create)
+            {
+                /*
+                 *  The fd is either in the step's response buffer or still
+                 *  buffered here for GetResult.
+                 */
+                int32_t fd;
+
+                if (response.result != 0)
+                    memcpy(&fd, ((BufferedResponse*)response.result)->data, sizeof(int32_t));
+                else
+                    CopyOut(tc, &fd, (Addr)response.opStruct, sizeof(int32_t));
+
+                stepFds[i] = gem5fs_les32(fd);
+            }
+        }
+
+        if (stepError != 0 && firstError == 0)
+            firstError = stepError;
     }
 
-    return bufferOp;
+    inCompound = false;
+    errno = firstError;
+
+    return (firstError == 0);
 }
 
+/*
+ *  Clean up a buffered response and its data.
+ */
+void gem5fs::CleanUp(BufferedResponse *buffered)
+{
+    if (buffered == NULL)
+        return;
+
+    ResponseArena::get()->release(buffered->data);
+    ResponseArena::get()->release(buffered);
+}
 
 /*
- *  Send the response and delete the local buffered operation for the 
- *  case of operation that do not require a response.
+ *  Sends the response header and "buffers" the response data, setting the
+ *  result field to the buffered response so the FUSE fs can call GetResult
+ *  with it and access this data again without the pointer being lost.
+ *
+ *  If the request supplied a response buffer that is large enough, the
+ *  data is written there directly and nothing is buffered. The FUSE fs
+ *  then has the response after a single pseudo instruction and only needs
+ *  GetResult when structSize is larger than its buffer.
+ *
+ *  Operations that already wrote their data to the response buffer pass
+ *  NULL responseData and the number of bytes written as responseSize.
  */
-void gem5fs::SendResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize)
+BufferedResponse* gem5fs::BufferResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize)
 {
-    FileOperation *bufferOp = BufferResponse(tc, resultAddr, fileOperation, success, responseData, responseSize);
+    BufferedResponse *buffered = NULL;
+    FileOperation responseOp;
+
+    memset(&responseOp, 0, sizeof(FileOperation));
+
+    /* Build the response header. */
+    responseOp.oper = (success) ? fileOperation->oper : ErrorCode;
+    responseOp.opType = ResponseOperation;
+    responseOp.path = fileOperation->path;
+    responseOp.pathLength = fileOperation->pathLength;
+    responseOp.structSize = responseSize;
+    responseOp.errnum = errno;
+
+    bool inPlace = (success && responseData != NULL
+                    && (features & GEM5FS_FEATURE_INLINE_RESPONSE)
+                    && fileOperation->responseBuf != 0
+                    && responseSize <= fileOperation->responseCapacity);
+
+    if (inPlace)
+    {
+        DPRINTF(gem5fs, "gem5fs: writing %d bytes in place to %p\n", responseSize, (void*)(fileOperation->responseBuf));
+
+        CopyIn(tc, (Addr)(fileOperation->responseBuf), responseData, responseSize);
 
-    delete bufferOp;
+        /* Nothing is left for GetResult to collect. */
+        responseOp.opStruct = fileOperation->responseBuf;
+    }
+    else if (success && responseData == NULL && responseSize > 0)
+    {
+        /* Written directly into the guest's response buffer. */
+        responseOp.opStruct = fileOperation->responseBuf;
+    }
+    else if (success && responseData != NULL)
+    {
+        buffered = (BufferedResponse*)ResponseArena::get()->allocate(sizeof(BufferedResponse));
+        buffered->data = responseData;
+        buffered->size = responseSize;
+
+        responseOp.result = (uint64_t)buffered;
+    }
+
+    DPRINTF(gem5fs, "gem5fs: buffered response is %p\n", (void*)(buffered));
+    DPRINTF(gem5fs, "gem5fs: writing response header to %p\n", resultAddr);
+
+    WriteHeader(tc, resultAddr, &responseOp);
+
+    /* 
+     *  Trash response data on error or if it was already sent. The FUSE FS
+     *  won't request after errors.
+     */
+    if (buffered == NULL)
+        ResponseArena::get()->release(responseData);
+
+    return buffered;
 }
 
 
+/*
+ *  Send a response for operations that do not return any data.
+ */
+void gem5fs::SendResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize)
+{
+    BufferResponse(tc, resultAddr, fileOperation, success, responseData, responseSize);
+}
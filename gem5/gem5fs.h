@@ -48,10 +48,12 @@
  */
 #include <ctype.h>
 #include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -78,10 +80,49 @@ namespace gem5fs {
 #endif
 
 
+/*
+ *  Wire format
+ *
+ *  Everything exchanged between the FUSE fs and gem5 uses the structs in
+ *  this file. They only contain fixed width fields laid out without any
+ *  implicit padding, pointers are sent as 64 bit guest virtual addresses,
+ *  and every field is little-endian. Converting a value to or from the
+ *  wire is the same operation, so the gem5fs_le helpers are used both ways.
+ *
+ *  The FUSE fs sends Negotiate before anything else. Both sides agree on
+ *  a protocol version and on the set of optional features, and neither
+ *  side uses a feature that was not agreed on. A FUSE fs that never sends
+ *  it predates this format and is answered as described in legacy.h.
+ */
+#define GEM5FS_PROTOCOL_MAGIC   0x73663567  // "g5fs"
+#define GEM5FS_PROTOCOL_VERSION 1
+
+#define GEM5FS_FEATURE_INLINE_RESPONSE  (1ULL << 0)  // Responses written to responseBuf
+#define GEM5FS_FEATURE_RING             (1ULL << 1)  // SetupRing and SubmitRing
+#define GEM5FS_FEATURE_COMPOUND         (1ULL << 2)  // Compound
+#define GEM5FS_FEATURE_ASYNC            (1ULL << 3)  // AsyncRequestOperation and PollResult
+#define GEM5FS_FEATURE_VECTORED         (1ULL << 4)  // ReadV and WriteV
+#define GEM5FS_FEATURE_NODE_HANDLES     (1ULL << 5)  // Lookup, Forget and FileOperation.node
+#define GEM5FS_FEATURE_PACKED_DIRENTS   (1ULL << 6)  // ReadDir responds with WireDirents
+#define GEM5FS_FEATURE_READDIR_PLUS     (1ULL << 7)  // ReadDirPlus and ForgetMulti
+#define GEM5FS_FEATURE_DIR_STREAMS      (1ULL << 8)  // OpenDir, ReleaseDir and DirReadOperation
+
+#define gem5fs_le16(x) htole16(x)
+#define gem5fs_le32(x) htole32(x)
+#define gem5fs_le64(x) htole64(x)
+
+#define gem5fs_les32(x) ((int32_t)htole32((uint32_t)(x)))
+#define gem5fs_les64(x) ((int64_t)htole64((uint64_t)(x)))
+
+/* Fails to compile if a wire struct does not have the expected size. */
+#define GEM5FS_WIRE_SIZE(type, size) \
+    typedef char gem5fs_wire_size_##type[(sizeof(struct type) == (size)) ? 1 : -1]
+
+
 typedef enum 
 {
     ErrorCode,
-    TestGem5,
+    TestGem5,                      // Only sent by FUSE fs predating Negotiate
     GetAttr,
     ReadLink,
     MakeDirectory,
@@ -113,118 +154,621 @@ typedef enum
     FGetAttr,
     GetResult,
     SetMountpoint,
-    GetMountpoint
+    GetMountpoint,
+    SetupRing,
+    SubmitRing,
+    Compound,
+    PollResult,
+    Negotiate,
+    ReadV,
+    WriteV,
+    Lookup,
+    Forget,
+    ReadDirPlus,
+    ForgetMulti
 } Operation;
 
 typedef enum 
 {
     UnknownOperation,
     RequestOperation,
-    ResponseOperation
+    ResponseOperation,
+    AsyncRequestOperation,         // Request that may run on gem5's workers
+    PendingOperation               // Response to poll again with PollResult
 } OperationType;
 
+/*
+ *  Header of every request and response. The fields shared with the
+ *  header used before Negotiate existed are at the same offsets, so gem5
+ *  can still serve such a FUSE fs.
+ */
 struct FileOperation 
 {
-    Operation oper;                // The file operation
-    OperationType opType;          // Direction of operation data
+    uint32_t oper;                 // The file operation
+    uint32_t opType;               // Direction of operation data
+
+    uint64_t path;                 // Path to the file/directory
+    uint32_t pathLength;           // Length of the path name
+    uint32_t responseCapacity;     // Length in bytes of responseBuf
+
+    uint64_t opStruct;             // Pointer to structures needed for a file operation
+    uint32_t structSize;           // Length in bytes of opStruct data
+    uint32_t reserved;
 
-    char *path;                    // Path to the file/directory
-    unsigned int pathLength;       // Length of the path name
+    uint64_t result;               // Buffered response or async token
+    int32_t errnum;                // Copy of errno from host
+    uint32_t reserved2;
 
-    uint8_t *opStruct;             // Pointer to structures needed for a file operation
-    unsigned int structSize;       // Length in bytes of opStruct data
+    uint64_t responseBuf;          // Guest buffer for in place response data
 
-    struct FileOperation *result;  // Pointer to the response 
-    int errnum;                    // Copy of errno from host
+    uint64_t node;                 // Node handle path is relative to, or 0
 };
 
+GEM5FS_WIRE_SIZE(FileOperation, 72);
+
+/* Size of the header read from and written to a FUSE fs that never sent Negotiate. */
+#define GEM5FS_LEGACY_HEADER_SIZE 56
+
+/* Convert a header to or from the wire. */
+static inline void gem5fs_header_le(struct FileOperation *op)
+{
+    op->oper = gem5fs_le32(op->oper);
+    op->opType = gem5fs_le32(op->opType);
+    op->path = gem5fs_le64(op->path);
+    op->pathLength = gem5fs_le32(op->pathLength);
+    op->responseCapacity = gem5fs_le32(op->responseCapacity);
+    op->opStruct = gem5fs_le64(op->opStruct);
+    op->structSize = gem5fs_le32(op->structSize);
+    op->result = gem5fs_le64(op->result);
+    op->errnum = gem5fs_les32(op->errnum);
+    op->responseBuf = gem5fs_le64(op->responseBuf);
+    op->node = gem5fs_le64(op->node);
+}
+
+/*
+ *  Needed for Negotiate. The FUSE fs sends the highest version it speaks
+ *  and the features it would like, gem5 answers with the version to use
+ *  and the features it enabled.
+ */
+struct NegotiateOperation
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t features;
+};
+
+GEM5FS_WIRE_SIZE(NegotiateOperation, 16);
+
+/*
+ *  Submission/completion rings shared between the FUSE fs and gem5. The
+ *  FUSE fs registers one region with SetupRing at mount time. The region
+ *  holds a RingHeader followed by the submission ring and then the
+ *  completion ring, each with the same power of two number of entries.
+ *
+ *  The FUSE fs queues requests at sqTail and calls SubmitRing once for the
+ *  whole batch. gem5 processes every request between sqHead and sqTail as
+ *  if each was sent with its own gem5fs_call and posts the responses at
+ *  cqTail. The head and tail indices are free running and wrap naturally.
+ */
+#define GEM5FS_RING_ENTRIES 64
+
+struct RingHeader
+{
+    uint32_t entries;              // Number of entries in each ring
+    uint32_t sqHead;               // Next submission gem5 will process
+    uint32_t sqTail;               // Next free submission slot
+    uint32_t cqHead;               // Next completion the FUSE fs will reap
+    uint32_t cqTail;               // Next completion slot gem5 will fill
+    uint32_t reserved;
+};
+
+GEM5FS_WIRE_SIZE(RingHeader, 24);
+
+struct RingSubmission
+{
+    struct FileOperation request;  // Same as the request to gem5fs_call
+    uint64_t input;                // Same as the input data to gem5fs_call
+    uint64_t userData;             // Copied to the matching completion
+};
+
+GEM5FS_WIRE_SIZE(RingSubmission, 88);
+
+struct RingCompletion
+{
+    struct FileOperation response; // Same as the response from gem5fs_call
+    uint64_t userData;             // From the matching submission
+};
+
+GEM5FS_WIRE_SIZE(RingCompletion, 80);
+
+#define GEM5FS_RING_SIZE(entries) (sizeof(struct RingHeader)                \
+                                   + (entries) * sizeof(struct RingSubmission) \
+                                   + (entries) * sizeof(struct RingCompletion))
+
+/*
+ *  Needed to register the rings
+ */
+struct RingSetupOperation
+{
+    uint64_t ring;
+    uint32_t entries;
+    uint32_t reserved;
+};
+
+GEM5FS_WIRE_SIZE(RingSetupOperation, 16);
+
+/*
+ *  Compound requests run several operations with one pseudo instruction.
+ *  Steps run in order and the remaining steps are cancelled after the
+ *  first failure, except for steps marked CompoundAlways. A step can use
+ *  the host file descriptor returned by an earlier Open or Create step;
+ *  gem5 writes the descriptor into the step's input data at fdOffset
+ *  before running the step.
+ */
+#define GEM5FS_COMPOUND_MAX_STEPS 8
+
+enum
+{
+    CompoundAlways = 0x1           // Run even after an earlier step failed
+};
+
+struct CompoundStep
+{
+    struct FileOperation request;  // Same as the request to gem5fs_call
+    uint64_t input;                // Same as the input data to gem5fs_call
+    int32_t fdStep;                // Step whose host fd is used, or -1
+    uint32_t fdOffset;             // Where the host fd goes in input
+    uint32_t flags;                // CompoundAlways or 0
+    uint32_t reserved;
+    struct FileOperation response; // Same as the response from gem5fs_call
+};
+
+GEM5FS_WIRE_SIZE(CompoundStep, 168);
+
+struct CompoundOperation
+{
+    uint64_t steps;                // Array of count steps
+    uint32_t count;                // Number of steps
+    uint32_t reserved;
+};
+
+GEM5FS_WIRE_SIZE(CompoundOperation, 16);
+
 /*
  *  Used for read and write operations
  */
 struct DataOperation
 {
-    int hostfd;
-    size_t size;
-    off_t offset;
-    const char *data;
+    int32_t hostfd;
+    uint32_t flags;             // GEM5FS_DATA_ flags, 0 before these existed
+    uint64_t size;
+    int64_t offset;
+    uint64_t data;
 };
 
+GEM5FS_WIRE_SIZE(DataOperation, 32);
+
+/*
+ *  Most bytes a single Read or Write moves. The size read is returned in
+ *  the 32 bit structSize, so gem5 moves no more than this and the FUSE fs
+ *  splits larger transfers.
+ */
+#define GEM5FS_MAX_DATA_SIZE (1U << 30)
+
+/*
+ *  Set on a Read that is part of a sequential stream. After reading, gem5
+ *  tells the host kernel that the same number of bytes following the read
+ *  will be needed soon. gem5 builds that don't know the flag ignore it.
+ */
+#define GEM5FS_DATA_WILLNEED (1U << 0)
+
+/*
+ *  Used for vectored read and write operations. Data is read into or
+ *  written from the count segments in order, as one contiguous range of
+ *  the file starting at offset. The response is the number of bytes read
+ *  or written as an int64_t.
+ */
+#define GEM5FS_MAX_SEGMENTS 32
+
+struct WireSegment
+{
+    uint64_t base;
+    uint64_t length;
+};
+
+GEM5FS_WIRE_SIZE(WireSegment, 16);
+
+struct VectorOperation
+{
+    int32_t hostfd;
+    uint32_t count;
+    int64_t offset;
+    uint64_t segments;
+};
+
+GEM5FS_WIRE_SIZE(VectorOperation, 24);
+
 /*
  *  Needed for chown operation
  */
 struct ChownOperation
 {
-    uid_t uid;
-    gid_t gid;
+    uint32_t uid;
+    uint32_t gid;
 };
 
+GEM5FS_WIRE_SIZE(ChownOperation, 8);
+
 /*
  *  Needed for sync operation
  */
 struct SyncOperation
 {
-    uint8_t datasync;
-    int fd;
+    int32_t fd;
+    uint32_t datasync;
 };
 
+GEM5FS_WIRE_SIZE(SyncOperation, 8);
+
 /*
  *  Needed for extended attributes
  */
 struct XAttrOperation
 {
-    char *name;
-    char *value;
-    size_t name_size;
-    size_t value_size;
-    int flags;
+    uint64_t name;
+    uint64_t value;
+    uint64_t name_size;
+    uint64_t value_size;
+    int32_t flags;
+    uint32_t reserved;
 };
 
+GEM5FS_WIRE_SIZE(XAttrOperation, 40);
+
 /*
  *  Needed for ftruncate
  */
 struct ftruncOperation
 {
-    off_t length;
-    int fd;
+    int64_t length;
+    int32_t fd;
+    uint32_t reserved;
 };
 
-/* 
- *  This should include all possible data types being copied into
- *  or out of gem5. This is a quick sanity check to see if these
- *  data types are the same size on both the host and the guest
- *  systems. 
+GEM5FS_WIRE_SIZE(ftruncOperation, 16);
+
+/*
+ *  Attributes returned by GetAttr and FGetAttr. Only the fields FUSE
+ *  uses are sent.
+ */
+struct WireStat
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t rdev;
+    int64_t size;
+    int64_t blocks;
+    int64_t atimeSec;
+    int64_t mtimeSec;
+    int64_t ctimeSec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t blksize;
+    uint32_t atimeNsec;
+    uint32_t mtimeNsec;
+    uint32_t ctimeNsec;
+};
+
+GEM5FS_WIRE_SIZE(WireStat, 96);
+
+static inline void gem5fs_encode_stat(struct WireStat *wire, const struct stat *st)
+{
+    wire->dev = gem5fs_le64(st->st_dev);
+    wire->ino = gem5fs_le64(st->st_ino);
+    wire->rdev = gem5fs_le64(st->st_rdev);
+    wire->size = gem5fs_les64(st->st_size);
+    wire->blocks = gem5fs_les64(st->st_blocks);
+    wire->atimeSec = gem5fs_les64(st->st_atim.tv_sec);
+    wire->mtimeSec = gem5fs_les64(st->st_mtim.tv_sec);
+    wire->ctimeSec = gem5fs_les64(st->st_ctim.tv_sec);
+    wire->mode = gem5fs_le32(st->st_mode);
+    wire->nlink = gem5fs_le32(st->st_nlink);
+    wire->uid = gem5fs_le32(st->st_uid);
+    wire->gid = gem5fs_le32(st->st_gid);
+    wire->blksize = gem5fs_le32(st->st_blksize);
+    wire->atimeNsec = gem5fs_le32(st->st_atim.tv_nsec);
+    wire->mtimeNsec = gem5fs_le32(st->st_mtim.tv_nsec);
+    wire->ctimeNsec = gem5fs_le32(st->st_ctim.tv_nsec);
+}
+
+static inline void gem5fs_decode_stat(struct stat *st, const struct WireStat *wire)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = gem5fs_le64(wire->dev);
+    st->st_ino = gem5fs_le64(wire->ino);
+    st->st_rdev = gem5fs_le64(wire->rdev);
+    st->st_size = gem5fs_les64(wire->size);
+    st->st_blocks = gem5fs_les64(wire->blocks);
+    st->st_atim.tv_sec = gem5fs_les64(wire->atimeSec);
+    st->st_mtim.tv_sec = gem5fs_les64(wire->mtimeSec);
+    st->st_ctim.tv_sec = gem5fs_les64(wire->ctimeSec);
+    st->st_mode = gem5fs_le32(wire->mode);
+    st->st_nlink = gem5fs_le32(wire->nlink);
+    st->st_uid = gem5fs_le32(wire->uid);
+    st->st_gid = gem5fs_le32(wire->gid);
+    st->st_blksize = gem5fs_le32(wire->blksize);
+    st->st_atim.tv_nsec = gem5fs_le32(wire->atimeNsec);
+    st->st_mtim.tv_nsec = gem5fs_le32(wire->mtimeNsec);
+    st->st_ctim.tv_nsec = gem5fs_le32(wire->ctimeNsec);
+}
+
+/*
+ *  File system statistics returned by GetStats. Only the fields FUSE
+ *  uses are sent.
+ */
+struct WireStatvfs
+{
+    uint64_t bsize;
+    uint64_t frsize;
+    uint64_t blocks;
+    uint64_t bfree;
+    uint64_t bavail;
+    uint64_t files;
+    uint64_t ffree;
+    uint64_t namemax;
+};
+
+GEM5FS_WIRE_SIZE(WireStatvfs, 64);
+
+static inline void gem5fs_encode_statvfs(struct WireStatvfs *wire, const struct statvfs *st)
+{
+    wire->bsize = gem5fs_le64(st->f_bsize);
+    wire->frsize = gem5fs_le64(st->f_frsize);
+    wire->blocks = gem5fs_le64(st->f_blocks);
+    wire->bfree = gem5fs_le64(st->f_bfree);
+    wire->bavail = gem5fs_le64(st->f_bavail);
+    wire->files = gem5fs_le64(st->f_files);
+    wire->ffree = gem5fs_le64(st->f_ffree);
+    wire->namemax = gem5fs_le64(st->f_namemax);
+}
+
+static inline void gem5fs_decode_statvfs(struct statvfs *st, const struct WireStatvfs *wire)
+{
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = gem5fs_le64(wire->bsize);
+    st->f_frsize = gem5fs_le64(wire->frsize);
+    st->f_blocks = gem5fs_le64(wire->blocks);
+    st->f_bfree = gem5fs_le64(wire->bfree);
+    st->f_bavail = gem5fs_le64(wire->bavail);
+    st->f_files = gem5fs_le64(wire->files);
+    st->f_ffree = gem5fs_le64(wire->ffree);
+    st->f_favail = st->f_ffree;
+    st->f_namemax = gem5fs_le64(wire->namemax);
+}
+
+/*
+ *  Node handles
+ *
+ *  With GEM5FS_FEATURE_NODE_HANDLES, gem5 keeps a table of the files and
+ *  directories the FUSE fs has looked up and hands out a 64 bit handle for
+ *  each. A request with a non-zero node applies to that node, or to the
+ *  entry named by path inside it, so the full path is never resent. The
+ *  root of the mount is always GEM5FS_ROOT_NODE.
  *
- *  I would expect most to be the same for linux 32/64 bit, but it
- *  is nice to provide an interface to test this.
+ *  Every successful Lookup counts one reference on the node. Forget drops
+ *  the given number of references and the handle is freed when none are
+ *  left. Forget takes the number to drop as a uint64_t.
+ */
+#define GEM5FS_ROOT_NODE 1
+
+/*
+ *  Response to Lookup.
+ */
+struct NodeEntry
+{
+    uint64_t node;
+    struct WireStat attr;
+};
+
+GEM5FS_WIRE_SIZE(NodeEntry, 104);
+
+/*
+ *  Needed for rename with node handles. The new name is relative to
+ *  newNode, without node handles Rename takes the new path as input.
  */
-struct TestOperation
+struct RenameOperation
 {
-    size_t size_t_size;               /**< Used for most return values. */
-    size_t mode_t_size;               /**< Used in chmod, mkdir, etc. */
-    size_t uid_t_size;                /**< Used in chown */
-    size_t gid_t_size;                /**< Used in chown */
-    size_t struct_stat_size;          /**< Used for fstat/lstat. */
-    size_t struct_statvfs_size;       /**< Used for statfs. */
-    size_t char_size;                 /**< Used for most path names. */
-    size_t off_t_size;                /**< Used for truncate. */
-    size_t int_size;                  /**< Used for file descriptors. */
-    size_t DataOperation_size;        /**< Used for read/write . */
-    size_t ChownOperation_size;       /**< Used for chown . */
-    size_t SyncOperation_size;        /**< Used for fsync. */
-    size_t XAttrOperation_size;       /**< Used for extended attributes. */
-    size_t ftruncOperation_size;      /**< Used for ftruncate, */
+    uint64_t newNode;
+    uint64_t newName;
+    uint32_t newNameLength;
+    uint32_t reserved;
+};
 
-    size_t TestOperation_size;        /**< Meta */
+GEM5FS_WIRE_SIZE(RenameOperation, 24);
+
+/*
+ *  With GEM5FS_FEATURE_PACKED_DIRENTS, ReadDir responds with one of these
+ *  per directory entry, back to back. The NUL terminated name follows each
+ *  entry and the next one starts recordLength bytes later. Without it,
+ *  each name takes a fixed 256 byte slot.
+ */
+struct WireDirent
+{
+    uint64_t ino;               // Host inode number
+    uint64_t cookie;            // Resumes the listing after this entry
+    uint32_t type;              // DT_ type of the entry
+    uint16_t nameLength;        // Without the NUL
+    uint16_t recordLength;      // Entry, name and padding
 };
 
+GEM5FS_WIRE_SIZE(WireDirent, 24);
+
+/* Record length of an entry with a name of nameLength bytes. */
+#define GEM5FS_DIRENT_SIZE(nameLength) \
+    ((sizeof(struct WireDirent) + (nameLength) + 1 + 7) & ~(size_t)7)
+
+/*
+ *  With GEM5FS_FEATURE_READDIR_PLUS, ReadDirPlus lists a directory like
+ *  ReadDir and also looks up each entry, as if by Lookup. Each record is
+ *  the entry's node and attributes followed by its WireDirent and name;
+ *  recordLength covers all of it. Entries that could not be looked up,
+ *  and . and .., have node 0 and count no lookup.
+ */
+struct WireDirentPlus
+{
+    struct NodeEntry entry;
+    struct WireDirent dirent;
+};
+
+GEM5FS_WIRE_SIZE(WireDirentPlus, 128);
+
+#define GEM5FS_DIRENTPLUS_SIZE(nameLength) \
+    ((sizeof(struct WireDirentPlus) + (nameLength) + 1 + 7) & ~(size_t)7)
+
+/*
+ *  Input to ForgetMulti, which takes an array of these and drops the
+ *  lookups of many nodes at once.
+ */
+struct WireForget
+{
+    uint64_t node;
+    uint64_t nlookup;
+};
+
+GEM5FS_WIRE_SIZE(WireForget, 16);
+
+/*
+ *  With GEM5FS_FEATURE_DIR_STREAMS, OpenDir opens a directory on the host
+ *  and responds with a uint64_t handle for it, which ReleaseDir takes as
+ *  input to close it again. ReadDir and ReadDirPlus with this as input
+ *  list at most capacity bytes of entries of the open directory, starting
+ *  after the entry with the given cookie, or at the start for cookie 0.
+ *  An empty response is the end of the directory. Without input, they
+ *  list the whole directory named by the request.
+ */
+struct DirReadOperation
+{
+    uint64_t handle;
+    uint64_t cookie;
+    uint32_t capacity;
+    uint32_t reserved;
+};
+
+GEM5FS_WIRE_SIZE(DirReadOperation, 24);
+
+/*
+ *  Open flags on the wire. The values of the O_ flags differ between
+ *  architectures, so they are translated on each side.
+ */
+#define GEM5FS_O_WRONLY     0x0001
+#define GEM5FS_O_RDWR       0x0002
+#define GEM5FS_O_CREAT      0x0004
+#define GEM5FS_O_EXCL       0x0008
+#define GEM5FS_O_TRUNC      0x0010
+#define GEM5FS_O_APPEND     0x0020
+#define GEM5FS_O_NONBLOCK   0x0040
+#define GEM5FS_O_SYNC       0x0080
+#define GEM5FS_O_DSYNC      0x0100
+#define GEM5FS_O_DIRECTORY  0x0200
+#define GEM5FS_O_NOFOLLOW   0x0400
+#define GEM5FS_O_NOATIME    0x0800
+
+static inline uint32_t gem5fs_encode_open_flags(int flags)
+{
+    uint32_t wire = 0;
+
+    if ((flags & O_ACCMODE) == O_WRONLY)
+        wire |= GEM5FS_O_WRONLY;
+    if ((flags & O_ACCMODE) == O_RDWR)
+        wire |= GEM5FS_O_RDWR;
+    if (flags & O_CREAT)
+        wire |= GEM5FS_O_CREAT;
+    if (flags & O_EXCL)
+        wire |= GEM5FS_O_EXCL;
+    if (flags & O_TRUNC)
+        wire |= GEM5FS_O_TRUNC;
+    if (flags & O_APPEND)
+        wire |= GEM5FS_O_APPEND;
+    if (flags & O_NONBLOCK)
+        wire |= GEM5FS_O_NONBLOCK;
+    if ((flags & O_SYNC) == O_SYNC)
+        wire |= GEM5FS_O_SYNC;
+    else if (flags & O_DSYNC)
+        wire |= GEM5FS_O_DSYNC;
+    if (flags & O_DIRECTORY)
+        wire |= GEM5FS_O_DIRECTORY;
+    if (flags & O_NOFOLLOW)
+        wire |= GEM5FS_O_NOFOLLOW;
+#ifdef O_NOATIME
+    if (flags & O_NOATIME)
+        wire |= GEM5FS_O_NOATIME;
+#endif
+
+    return gem5fs_le32(wire);
+}
+
+static inline int gem5fs_decode_open_flags(uint32_t wire)
+{
+    int flags = O_RDONLY;
+
+    wire = gem5fs_le32(wire);
+
+    if (wire & GEM5FS_O_WRONLY)
+        flags = O_WRONLY;
+    if (wire & GEM5FS_O_RDWR)
+        flags = O_RDWR;
+    if (wire & GEM5FS_O_CREAT)
+        flags |= O_CREAT;
+    if (wire & GEM5FS_O_EXCL)
+        flags |= O_EXCL;
+    if (wire & GEM5FS_O_TRUNC)
+        flags |= O_TRUNC;
+    if (wire & GEM5FS_O_APPEND)
+        flags |= O_APPEND;
+    if (wire & GEM5FS_O_NONBLOCK)
+        flags |= O_NONBLOCK;
+    if (wire & GEM5FS_O_SYNC)
+        flags |= O_SYNC;
+    if (wire & GEM5FS_O_DSYNC)
+        flags |= O_DSYNC;
+    if (wire & GEM5FS_O_DIRECTORY)
+        flags |= O_DIRECTORY;
+    if (wire & GEM5FS_O_NOFOLLOW)
+        flags |= O_NOFOLLOW;
+#ifdef O_NOATIME
+    if (wire & GEM5FS_O_NOATIME)
+        flags |= O_NOATIME;
+#endif
+
+    return flags;
+}
+
 /* These prototypes are only needed by gem5, not by FUSE. */
 #ifdef __cplusplus
+
+/*
+ *  Response data kept in gem5 until the FUSE fs collects it with
+ *  GetResult. The result field of the response header points here.
+ */
+struct BufferedResponse
+{
+    uint8_t *data;
+    unsigned int size;
+};
+
 uint64_t ProcessRequest(ThreadContext *tc, Addr inputAddr, Addr requestAddr, Addr resultAddr);
+unsigned int ProcessRing(ThreadContext *tc);
+bool ProcessCompound(ThreadContext *tc, Addr inputAddr);
 
-FileOperation* BufferResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize);
+void ReadHeader(ThreadContext *tc, Addr addr, FileOperation *fileOperation);
+void WriteHeader(ThreadContext *tc, Addr addr, const FileOperation *fileOperation);
+
+BufferedResponse* BufferResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize);
 void SendResponse(ThreadContext *tc, Addr resultAddr, FileOperation *fileOperation, bool success, uint8_t *responseData, unsigned int responseSize);
 
-void CleanUp(FileOperation *bufferOp);
+void CleanUp(BufferedResponse *buffered);
 #endif
 
 #ifdef __cplusplus
@@ -232,4 +776,3 @@ void CleanUp(FileOperation *bufferOp);
 #endif
 
 #endif // __GEM5FS_GEM5_GEM5FS_HH__
-
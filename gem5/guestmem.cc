@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/guestmem.h"
+
+#include <limits.h>
+
+#include <algorithm>
+
+#include "arch/isa_traits.hh"
+#include "arch/vtophys.hh"
+#include "cpu/thread_context.hh"
+#include "mem/physical.hh"
+#include "sim/system.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+bool gem5fs::MapGuestBuffer(ThreadContext *tc, Addr vaddr, uint64_t size, std::vector<struct iovec> &iov)
+{
+    System *system = tc->getSystemPtr();
+
+    iov.clear();
+
+    if (size == 0 || !system->bypassCaches())
+        return false;
+
+    std::vector<std::pair<AddrRange, uint8_t*> > stores = system->getPhysMem().getBackingStore();
+
+    while (size > 0)
+    {
+        /* Translate one page at a time, pages need not be contiguous. */
+        Addr pageOffset = vaddr & (TheISA::PageBytes - 1);
+        uint64_t chunk = std::min(size, (uint64_t)(TheISA::PageBytes - pageOffset));
+        Addr paddr = TheISA::vtophys(tc, vaddr);
+        uint8_t *host = NULL;
+
+        for (auto iter = stores.begin(); iter != stores.end(); ++iter)
+        {
+            if (iter->first.contains(paddr) && iter->first.contains(paddr + chunk - 1))
+            {
+                host = iter->second + (paddr - iter->first.start());
+                break;
+            }
+        }
+
+        /* Not backed by host memory, e.g. a device. */
+        if (host == NULL)
+        {
+            DPRINTF(gem5fs, "gem5fs: %p (pa %p) has no backing store\n", (void*)vaddr, (void*)paddr);
+            iov.clear();
+            return false;
+        }
+
+        /* Merge with the previous range if it is contiguous on the host. */
+        if (!iov.empty() && (uint8_t*)iov.back().iov_base + iov.back().iov_len == host)
+        {
+            iov.back().iov_len += chunk;
+        }
+        else
+        {
+            if (iov.size() == IOV_MAX)
+            {
+                iov.clear();
+                return false;
+            }
+
+            struct iovec range;
+            range.iov_base = host;
+            range.iov_len = chunk;
+            iov.push_back(range);
+        }
+
+        vaddr += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/legacy.h"
+#include "gem5fs/gem5/arena.h"
+#include "gem5fs/gem5/backend.h"
+
+#include <algorithm>
+
+#include "cpu/thread_context.hh"
+#include "mem/fs_translating_port_proxy.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+bool gem5fs::IsLegacyOperation(uint32_t oper)
+{
+    switch (oper)
+    {
+        case TestGem5:
+        case GetAttr:
+        case FGetAttr:
+        case Open:
+        case GetStats:
+        case Fsync:
+        case GetXAttr:
+        case ListXAttr:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Compare the size of a type in the guest with its size here. */
+static bool CheckSize(const char *type, size_t guestSize, size_t hostSize)
+{
+    if (guestSize == hostSize)
+        return true;
+
+    warn("gem5fs: %s does not match guest's size.\n", type);
+
+    return false;
+}
+
+void gem5fs::ProcessLegacyRequest(ThreadContext *tc, Addr inputAddr, Addr resultAddr, FileOperation *fileOperation, const char *pathname)
+{
+    ResponseArena *arena = ResponseArena::get();
+
+    errno = 0;
+
+    switch (fileOperation->oper)
+    {
+        case TestGem5:
+        {
+            /* Input is a TestOperation struct. */
+            TestOperation testOp;
+            memset(&testOp, 0, sizeof(TestOperation));
+            CopyOut(tc, &testOp, inputAddr, std::min<size_t>(fileOperation->structSize, sizeof(TestOperation)));
+
+            /* Check everything so gem5 warns about each mismatch. */
+            bool passed = CheckSize("TestOperation struct", fileOperation->structSize, sizeof(TestOperation));
+            passed &= CheckSize("TestOperation struct", testOp.TestOperation_size, sizeof(TestOperation));
+            passed &= CheckSize("size_t", testOp.size_t_size, sizeof(size_t));
+            passed &= CheckSize("mode_t", testOp.mode_t_size, sizeof(mode_t));
+            passed &= CheckSize("uid_t", testOp.uid_t_size, sizeof(uid_t));
+            passed &= CheckSize("gid_t", testOp.gid_t_size, sizeof(gid_t));
+            passed &= CheckSize("stat struct", testOp.struct_stat_size, sizeof(struct stat));
+            passed &= CheckSize("statvfs struct", testOp.struct_statvfs_size, sizeof(struct statvfs));
+            passed &= CheckSize("char", testOp.char_size, sizeof(char));
+            passed &= CheckSize("off_t", testOp.off_t_size, sizeof(off_t));
+            passed &= CheckSize("int", testOp.int_size, sizeof(int));
+            passed &= CheckSize("DataOperation struct", testOp.DataOperation_size, sizeof(LegacyDataOperation));
+            passed &= CheckSize("ChownOperation struct", testOp.ChownOperation_size, sizeof(LegacyChownOperation));
+            passed &= CheckSize("SyncOperation struct", testOp.SyncOperation_size, sizeof(LegacySyncOperation));
+            passed &= CheckSize("XAttrOperation struct", testOp.XAttrOperation_size, sizeof(LegacyXAttrOperation));
+            passed &= CheckSize("ftruncOperation struct", testOp.ftruncOperation_size, sizeof(LegacyftruncOperation));
+
+            /*
+             *  If anything failed, we will send back an error code to
+             *  the FUSE FS, which will decide to mount or not.
+             */
+            SendResponse(tc, resultAddr, fileOperation, passed, NULL, 0);
+
+            break;
+        }
+        case GetAttr:
+        {
+            DPRINTF(gem5fs, "gem5fs: reading legacy attributes on %s\n", pathname);
+
+            /* The old FUSE fs takes the host's stat struct as it is. */
+            struct stat *statbuf = (struct stat*)arena->allocate(sizeof(struct stat));
+            int rv = Backend::get()->stat(AT_FDCWD, pathname, statbuf);
+
+            BufferResponse(tc, resultAddr, fileOperation, (rv == 0), (uint8_t*)statbuf, sizeof(struct stat));
+
+            break;
+        }
+        case FGetAttr:
+        {
+            /* FUSE FS sends file descriptor as input. */
+            int fd;
+            CopyOut(tc, &fd, inputAddr, sizeof(int));
+
+            struct stat *statbuf = (struct stat*)arena->allocate(sizeof(struct stat));
+            int rv = Backend::get()->fstat(fd, statbuf);
+
+            BufferResponse(tc, resultAddr, fileOperation, (rv == 0), (uint8_t*)statbuf, sizeof(struct stat));
+
+            break;
+        }
+        case Open:
+        {
+            /* FUSE FS sends the guest's O_ flags, the same as the host's. */
+            int flags;
+            CopyOut(tc, &flags, inputAddr, sizeof(int));
+
+            DPRINTF(gem5fs, "gem5fs: opening %s for a legacy FUSE fs\n", pathname);
+
+            int *fd = (int*)arena->allocate(sizeof(int));
+            *fd = Backend::get()->open(AT_FDCWD, pathname, flags, 0);
+
+            BufferResponse(tc, resultAddr, fileOperation, (*fd >= 0), (uint8_t*)fd, sizeof(int));
+
+            break;
+        }
+        case GetStats:
+        {
+            struct statvfs *statbuf = (struct statvfs*)arena->allocate(sizeof(struct statvfs));
+            int rv = Backend::get()->statfs(AT_FDCWD, pathname, statbuf);
+
+            BufferResponse(tc, resultAddr, fileOperation, (rv == 0), (uint8_t*)statbuf, sizeof(struct statvfs));
+
+            break;
+        }
+        case Fsync:
+        {
+            /* FUSE FS sends a LegacySyncOperation struct as input. */
+            LegacySyncOperation syncOp;
+            CopyOut(tc, &syncOp, inputAddr, sizeof(LegacySyncOperation));
+
+            int rv = Backend::get()->fsync(syncOp.fd, (syncOp.datasync == 1));
+
+            SendResponse(tc, resultAddr, fileOperation, (rv == 0), NULL, 0);
+
+            break;
+        }
+        case GetXAttr:
+        case ListXAttr:
+        {
+            /*
+             *  The old FUSE fs never collects response data for these, the
+             *  value or list is copied straight to its buffer.
+             */
+            LegacyXAttrOperation xattrOp;
+            CopyOut(tc, &xattrOp, inputAddr, sizeof(LegacyXAttrOperation));
+
+            char *value = new char[xattrOp.value_size+1];
+            ssize_t rv;
+
+            if (fileOperation->oper == GetXAttr)
+            {
+                char *xname = new char[xattrOp.name_size+1];
+                CopyOut(tc, xname, (Addr)xattrOp.name, xattrOp.name_size+1);
+
+                rv = Backend::get()->getXAttr(AT_FDCWD, pathname, xname, value, xattrOp.value_size);
+
+                delete [] xname;
+            }
+            else
+            {
+                rv = Backend::get()->listXAttr(AT_FDCWD, pathname, value, xattrOp.value_size);
+            }
+
+            if (rv > 0 && xattrOp.value_size > 0)
+                CopyIn(tc, (Addr)xattrOp.value, value, rv);
+
+            SendResponse(tc, resultAddr, fileOperation, (rv >= 0), NULL, 0);
+
+            delete [] value;
+
+            break;
+        }
+        default:
+        {
+            errno = EPROTO;
+            SendResponse(tc, resultAddr, fileOperation, false, NULL, 0);
+
+            break;
+        }
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_LEGACY_H__
+#define __GEM5FS_GEM5_LEGACY_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+namespace gem5fs {
+
+/*
+ *  Protocol of a FUSE fs built before Negotiate existed. It sends the
+ *  56 byte header and native structs, so it only works when the guest and
+ *  host agree on the sizes of C types, which it checks with TestGem5 when
+ *  mounting. Until a FUSE fs negotiates, gem5 answers requests this way.
+ *
+ *  Most operations send the same bytes in both protocols. Only those
+ *  whose input or response differ are handled here, with these structs
+ *  laid out as the old FUSE fs lays out its own.
+ */
+struct LegacyDataOperation
+{
+    int hostfd;
+    size_t size;
+    off_t offset;
+    const char *data;
+};
+
+struct LegacyChownOperation
+{
+    uid_t uid;
+    gid_t gid;
+};
+
+struct LegacySyncOperation
+{
+    uint8_t datasync;
+    int fd;
+};
+
+struct LegacyXAttrOperation
+{
+    char *name;
+    char *value;
+    size_t name_size;
+    size_t value_size;
+    int flags;
+};
+
+struct LegacyftruncOperation
+{
+    off_t length;
+    int fd;
+};
+
+/*
+ *  Sent with TestGem5. Each field is the size of a type as the FUSE fs
+ *  sees it.
+ */
+struct TestOperation
+{
+    size_t size_t_size;
+    size_t mode_t_size;
+    size_t uid_t_size;
+    size_t gid_t_size;
+    size_t struct_stat_size;
+    size_t struct_statvfs_size;
+    size_t char_size;
+    size_t off_t_size;
+    size_t int_size;
+    size_t DataOperation_size;
+    size_t ChownOperation_size;
+    size_t SyncOperation_size;
+    size_t XAttrOperation_size;
+    size_t ftruncOperation_size;
+
+    size_t TestOperation_size;
+};
+
+/* Check if an operation has to be answered in the old protocol. */
+bool IsLegacyOperation(uint32_t oper);
+
+void ProcessLegacyRequest(ThreadContext *tc, Addr inputAddr, Addr resultAddr, FileOperation *fileOperation, const char *pathname);
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_LEGACY_H__
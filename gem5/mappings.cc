@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/mappings.h"
+
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+/* Size of each mapped window of a file. Windows start at multiples of it. */
+#define GEM5FS_MAP_WINDOW (64ULL * 1024 * 1024)
+
+/* Most windows mapped at once, 4 GiB of address space. */
+#define GEM5FS_MAP_MAX_WINDOWS 64
+
+FileMappings *FileMappings::get()
+{
+    static FileMappings *mappings = new FileMappings();
+
+    return mappings;
+}
+
+/*
+ *  Where a SIGBUS from touching a mapping past the end of its file jumps
+ *  to, while FileMappings::copy runs on this thread.
+ */
+static thread_local sigjmp_buf *busJump = NULL;
+static struct sigaction previousBus;
+
+static void BusHandler(int sig, siginfo_t *info, void *context)
+{
+    if (busJump != NULL)
+        siglongjmp(*busJump, 1);
+
+    /* Not from a copy, the faulting access runs again and gets the old handler. */
+    sigaction(SIGBUS, &previousBus, NULL);
+}
+
+FileMappings::FileMappings()
+    : generation(0), useCount(0), useMmap(false)
+{
+    const char *env = getenv("GEM5FS_IO_ENGINE");
+
+    if (env != NULL && strcmp(env, "mmap") == 0)
+        useMmap = true;
+    else if (env != NULL && strcmp(env, "pread") != 0)
+        warn("gem5fs: unknown GEM5FS_IO_ENGINE %s, using pread.\n", env);
+
+    if (useMmap)
+    {
+        struct sigaction action;
+
+        memset(&action, 0, sizeof(struct sigaction));
+        action.sa_sigaction = BusHandler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+
+        if (sigaction(SIGBUS, &action, &previousBus) != 0)
+        {
+            warn("gem5fs: could not catch SIGBUS, using pread.\n");
+            useMmap = false;
+        }
+    }
+}
+
+/*
+ *  Find or map a window. A window mapped read-only is mapped again
+ *  read-write the first time it is written.
+ */
+FileMappings::Window *FileMappings::window(const WindowKey &key, int fd, bool write)
+{
+    auto iter = windows.find(key);
+
+    if (iter != windows.end() && (iter->second.writable || !write))
+    {
+        iter->second.lastUse = ++useCount;
+        return &iter->second;
+    }
+
+    if (iter != windows.end())
+    {
+        munmap(iter->second.addr, GEM5FS_MAP_WINDOW);
+        windows.erase(iter);
+    }
+
+    /* A shared writable mapping needs a file opened read-write. */
+    if (write && (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR)
+        return NULL;
+
+    if (windows.size() >= GEM5FS_MAP_MAX_WINDOWS)
+        evict();
+
+    int prot = (write) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    off_t start = std::get<2>(key) * GEM5FS_MAP_WINDOW;
+    void *addr = mmap(NULL, GEM5FS_MAP_WINDOW, prot, MAP_SHARED, fd, start);
+
+    if (addr == MAP_FAILED)
+    {
+        DPRINTF(gem5fs, "gem5fs: could not map fd %d at %d: %s\n", fd, start, strerror(errno));
+        return NULL;
+    }
+
+    /* Guest reads of large inputs are mostly sequential. */
+    (void)madvise(addr, GEM5FS_MAP_WINDOW, MADV_SEQUENTIAL);
+
+    Window &mapped = windows[key];
+    mapped.addr = (uint8_t*)addr;
+    mapped.writable = write;
+    mapped.lastUse = ++useCount;
+
+    DPRINTF(gem5fs, "gem5fs: mapped window %d of fd %d\n", std::get<2>(key), fd);
+
+    return &mapped;
+}
+
+/* Unmap the least recently used window. */
+void FileMappings::evict()
+{
+    auto oldest = windows.begin();
+
+    for (auto iter = windows.begin(); iter != windows.end(); ++iter)
+    {
+        if (iter->second.lastUse < oldest->second.lastUse)
+            oldest = iter;
+    }
+
+    if (oldest != windows.end())
+    {
+        munmap(oldest->second.addr, GEM5FS_MAP_WINDOW);
+        windows.erase(oldest);
+    }
+}
+
+bool FileMappings::map(int fd, uint64_t offset, uint64_t size, bool write, uint8_t *&data, uint64_t &length)
+{
+    struct stat statbuf;
+
+    /*
+     *  The size is checked on every access, touching a mapping past the
+     *  end of the file is fatal.
+     */
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode))
+        return false;
+
+    uint64_t fileSize = statbuf.st_size;
+
+    if (write && offset + size > fileSize)
+        return false;
+
+    data = NULL;
+    length = 0;
+
+    if (offset >= fileSize)
+        return true;
+
+    /* An fd closed without a release may be open on another file now. */
+    auto file = files.find(fd);
+
+    if (file != files.end()
+        && (file->second.dev != statbuf.st_dev || file->second.ino != statbuf.st_ino))
+    {
+        release(fd);
+        file = files.end();
+    }
+
+    if (file == files.end())
+    {
+        MappedFile &added = files[fd];
+        added.generation = ++generation;
+        added.dev = statbuf.st_dev;
+        added.ino = statbuf.st_ino;
+
+        file = files.find(fd);
+    }
+
+    WindowKey key(fd, file->second.generation, offset / GEM5FS_MAP_WINDOW);
+    Window *mapped = window(key, fd, write);
+
+    if (mapped == NULL)
+        return false;
+
+    uint64_t inWindow = offset % GEM5FS_MAP_WINDOW;
+
+    length = std::min<uint64_t>(size, GEM5FS_MAP_WINDOW - inWindow);
+    length = std::min<uint64_t>(length, fileSize - offset);
+    data = mapped->addr + inWindow;
+
+    return true;
+}
+
+void FileMappings::willNeed(int fd, uint64_t offset, uint64_t length)
+{
+    uint8_t *data;
+    uint64_t mappedLength;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    if (length == 0 || !map(fd, offset, length, false, data, mappedLength) || mappedLength == 0)
+        return;
+
+    /* madvise wants a page aligned start. */
+    uintptr_t start = (uintptr_t)data & ~(uintptr_t)(pageSize - 1);
+
+    (void)madvise((void*)start, mappedLength + ((uintptr_t)data - start), MADV_WILLNEED);
+}
+
+bool FileMappings::copy(int fd, void *dest, const void *src, uint64_t length)
+{
+    sigjmp_buf jump;
+
+    if (sigsetjmp(jump, 1) != 0)
+    {
+        busJump = NULL;
+
+        warn("gem5fs: host file of fd %d shrank while mapped, using pread.\n", fd);
+        drop(fd);
+
+        return false;
+    }
+
+    busJump = &jump;
+    memcpy(dest, src, length);
+    busJump = NULL;
+
+    return true;
+}
+
+void FileMappings::release(int fd)
+{
+    auto file = files.find(fd);
+
+    if (file == files.end())
+        return;
+
+    auto iter = windows.lower_bound(WindowKey(fd, file->second.generation, 0));
+
+    while (iter != windows.end() && std::get<0>(iter->first) == fd)
+    {
+        munmap(iter->second.addr, GEM5FS_MAP_WINDOW);
+        iter = windows.erase(iter);
+    }
+
+    files.erase(file);
+
+    DPRINTF(gem5fs, "gem5fs: unmapped fd %d\n", fd);
+}
+
+void FileMappings::drop(dev_t dev, ino_t ino)
+{
+    std::vector<int> fds;
+
+    for (auto iter = files.begin(); iter != files.end(); ++iter)
+    {
+        if (iter->second.dev == dev && iter->second.ino == ino)
+            fds.push_back(iter->first);
+    }
+
+    for (size_t i = 0; i < fds.size(); ++i)
+        release(fds[i]);
+}
+
+void FileMappings::drop(int fd)
+{
+    struct stat statbuf;
+
+    if (files.empty())
+        return;
+
+    if (fstat(fd, &statbuf) == 0)
+        drop(statbuf.st_dev, statbuf.st_ino);
+    else
+        release(fd);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_MAPPINGS_H__
+#define __GEM5FS_GEM5_MAPPINGS_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <sys/types.h>
+
+#include <map>
+#include <tuple>
+
+namespace gem5fs {
+
+/*
+ *  The mmap I/O engine. Reads and writes copy between guest memory and a
+ *  shared mapping of the host file instead of going through pread/pwrite
+ *  and a temporary buffer. Files are mapped in fixed size windows on
+ *  first access. Windows belong to the host fd they were mapped through
+ *  and are unmapped when it is released, when the file is truncated,
+ *  unlinked or renamed over through gem5fs, or when too many are mapped,
+ *  the least recently used first. Each fd gets a new generation when it
+ *  is first mapped, so a reused fd never finds the windows of the file
+ *  it was before. Only used from the simulation thread.
+ *
+ *  The engine is enabled by setting the GEM5FS_IO_ENGINE environment
+ *  variable to "mmap" when starting gem5.
+ */
+class FileMappings
+{
+  public:
+    static FileMappings *get();
+
+    bool enabled() const { return useMmap; }
+
+    /*
+     *  Find the bytes at offset of the host file open as fd. On success,
+     *  data points at them and length is how many can be used from there,
+     *  up to size, the end of the window and the end of the file. length
+     *  is 0 at the end of the file. Writes need a file opened read-write
+     *  and are only mapped if all size bytes are inside the file, since a
+     *  mapping can't extend it. Returns false if the file can't be
+     *  mapped and has to be read or written with a syscall.
+     */
+    bool map(int fd, uint64_t offset, uint64_t size, bool write, uint8_t *&data, uint64_t &length);
+
+    /* Ask the host kernel to read in length bytes of fd from offset. */
+    void willNeed(int fd, uint64_t offset, uint64_t length);
+
+    /*
+     *  Copy length bytes from src to dest, one of which was returned by
+     *  map and the other is host memory. Only a memcpy runs while a SIGBUS
+     *  is caught, so neither may be guest memory behind a port proxy.
+     *  Returns false if it was cut short because the file shrank under the
+     *  mapping, in which case the file's windows are dropped and it has to
+     *  be read or written with a syscall.
+     */
+    bool copy(int fd, void *dest, const void *src, uint64_t length);
+
+    /* Unmap the windows of fd, which is being closed. */
+    void release(int fd);
+
+    /* Unmap every window of a host file, which is changing size or going away. */
+    void drop(dev_t dev, ino_t ino);
+    void drop(int fd);
+
+    bool empty() const { return windows.empty(); }
+
+  private:
+    FileMappings();
+
+    struct Window
+    {
+        uint8_t *addr;
+        bool writable;
+        uint64_t lastUse;
+    };
+
+    /* A host fd with windows, and the file it was open on when mapped. */
+    struct MappedFile
+    {
+        uint64_t generation;
+        dev_t dev;
+        ino_t ino;
+    };
+
+    typedef std::tuple<int, uint64_t, uint64_t> WindowKey;
+
+    Window *window(const WindowKey &key, int fd, bool write);
+    void evict();
+
+    std::map<WindowKey, Window> windows;
+    std::map<int, MappedFile> files;
+    uint64_t generation;
+    uint64_t useCount;
+    bool useMmap;
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_MAPPINGS_H__
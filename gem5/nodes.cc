@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/nodes.h"
+#include "gem5fs/gem5/backend.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+NodeTable *NodeTable::get()
+{
+    static NodeTable *table = new NodeTable();
+
+    return table;
+}
+
+NodeTable::NodeTable()
+{
+    /* Every node the guest kernel remembers holds a descriptor. */
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    reset();
+}
+
+void NodeTable::reset()
+{
+    for (auto iter = nodes.begin(); iter != nodes.end(); ++iter)
+        Backend::get()->closeNode(iter->second.fd);
+
+    nodes.clear();
+    handles.clear();
+
+    /* The root is the host's root and is never forgotten. */
+    Node root;
+    struct stat statbuf;
+
+    root.fd = Backend::get()->openNode(AT_FDCWD, "/");
+    root.nlookup = 1;
+
+    if (root.fd < 0 || Backend::get()->stat(root.fd, "", &statbuf) != 0)
+        fatal("gem5fs: could not open the host root directory.\n");
+
+    root.dev = statbuf.st_dev;
+    root.ino = statbuf.st_ino;
+
+    nodes[GEM5FS_ROOT_NODE] = root;
+    handles[std::make_pair(root.dev, root.ino)] = GEM5FS_ROOT_NODE;
+    nextHandle = GEM5FS_ROOT_NODE + 1;
+}
+
+int NodeTable::fd(uint64_t node) const
+{
+    auto iter = nodes.find(node);
+
+    if (iter == nodes.end())
+        return -1;
+
+    return iter->second.fd;
+}
+
+uint64_t NodeTable::lookup(int dirfd, const char *name, const struct stat &statbuf)
+{
+    auto key = std::make_pair(statbuf.st_dev, statbuf.st_ino);
+    auto iter = handles.find(key);
+
+    if (iter != handles.end())
+    {
+        nodes[iter->second].nlookup++;
+        return iter->second;
+    }
+
+    Node node;
+    node.fd = Backend::get()->openNode(dirfd, name);
+    node.dev = statbuf.st_dev;
+    node.ino = statbuf.st_ino;
+    node.nlookup = 1;
+
+    if (node.fd < 0)
+        return 0;
+
+    uint64_t handle = nextHandle++;
+
+    nodes[handle] = node;
+    handles[key] = handle;
+
+    DPRINTF(gem5fs, "gem5fs: node %d is %s as fd %d\n", handle, name, node.fd);
+
+    return handle;
+}
+
+void NodeTable::forget(uint64_t node, uint64_t nlookup)
+{
+    auto iter = nodes.find(node);
+
+    if (node == GEM5FS_ROOT_NODE || iter == nodes.end())
+        return;
+
+    if (iter->second.nlookup > nlookup)
+    {
+        iter->second.nlookup -= nlookup;
+        return;
+    }
+
+    DPRINTF(gem5fs, "gem5fs: forgetting node %d\n", node);
+
+    Backend::get()->closeNode(iter->second.fd);
+    handles.erase(std::make_pair(iter->second.dev, iter->second.ino));
+    nodes.erase(iter);
+}
+
+std::string gem5fs::ProcPath(int dirfd, const char *name)
+{
+    if (dirfd == AT_FDCWD)
+        return name;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+
+    if (name[0] == '\0')
+        return path;
+
+    return std::string(path) + "/" + name;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_NODES_H__
+#define __GEM5FS_GEM5_NODES_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <utility>
+
+namespace gem5fs {
+
+/*
+ *  Files and directories the FUSE fs has looked up, by node handle. Each
+ *  node holds a Backend node, an O_PATH descriptor with the posix backend,
+ *  so operations on it go through the *at() calls without resolving the
+ *  path again. Nodes are keyed by device and inode, so renames on either
+ *  side don't need any bookkeeping. Only used from the simulation thread.
+ */
+class NodeTable
+{
+  public:
+    static NodeTable *get();
+
+    /* Forget every node except the root, e.g. when the FUSE fs remounts. */
+    void reset();
+
+    /* Backend node of a node. Returns -1 if the handle is unknown. */
+    int fd(uint64_t node) const;
+
+    /*
+     *  Handle of the entry name in dirfd, which lstat'ed as statbuf,
+     *  counting one more lookup. Returns 0 with errno set if the entry
+     *  can't be opened.
+     */
+    uint64_t lookup(int dirfd, const char *name, const struct stat &statbuf);
+
+    /* Drop nlookup lookups of a node, freeing it when none are left. */
+    void forget(uint64_t node, uint64_t nlookup);
+
+  private:
+    NodeTable();
+
+    struct Node
+    {
+        int fd;
+        dev_t dev;
+        ino_t ino;
+        uint64_t nlookup;
+    };
+
+    std::map<uint64_t, Node> nodes;
+    std::map<std::pair<dev_t, ino_t>, uint64_t> handles;
+    uint64_t nextHandle;
+};
+
+/*
+ *  Path for calls with no *at() form. Names the entry name in dirfd, or
+ *  dirfd itself when name is empty, through /proc/self/fd. With AT_FDCWD
+ *  name is returned as is.
+ */
+std::string ProcPath(int dirfd, const char *name);
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_NODES_H__
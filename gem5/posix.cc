@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/posix.h"
+#include "gem5fs/gem5/blockcache.h"
+#include "gem5fs/gem5/nodes.h"
+#include "gem5fs/gem5/sharedcache.h"
+
+#include <fcntl.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+/*
+ *  A directory open with a DIR*.
+ */
+class PosixDir : public BackendDir
+{
+  public:
+    PosixDir(DIR *dirp) : dirp(dirp) {}
+    ~PosixDir() { closedir(dirp); }
+
+    struct dirent *read() { return readdir(dirp); }
+    long tell() { return telldir(dirp); }
+
+    void seek(long position)
+    {
+        if (position == 0)
+            rewinddir(dirp);
+        else
+            seekdir(dirp, position);
+    }
+
+    int node() { return dirfd(dirp); }
+
+  private:
+    DIR *dirp;
+};
+
+/*
+ *  The /proc/self/fd link of a node already leads to the node itself, so
+ *  calls on it must not stop at the link with the l* variants.
+ */
+static bool NamesNode(int dir, const char *name)
+{
+    return (dir != AT_FDCWD && name[0] == '\0');
+}
+
+int PosixBackend::openNode(int dir, const char *name)
+{
+    /* O_NOFOLLOW so a symlink node refers to the link itself. */
+    return ::openat(dir, name, O_PATH | O_NOFOLLOW);
+}
+
+void PosixBackend::closeNode(int node)
+{
+    ::close(node);
+}
+
+int PosixBackend::stat(int dir, const char *name, struct stat *statbuf)
+{
+    return ::fstatat(dir, name, statbuf, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH);
+}
+
+ssize_t PosixBackend::readLink(int dir, const char *name, char *buf, size_t size)
+{
+    return ::readlinkat(dir, name, buf, size);
+}
+
+int PosixBackend::access(int dir, const char *name, int mask)
+{
+    return ::access(ProcPath(dir, name).c_str(), mask);
+}
+
+int PosixBackend::statfs(int dir, const char *name, struct statvfs *statbuf)
+{
+    return ::statvfs(ProcPath(dir, name).c_str(), statbuf);
+}
+
+int PosixBackend::truncate(int dir, const char *name, off_t length)
+{
+    std::string path = ProcPath(dir, name);
+    int rv = ::truncate(path.c_str(), length);
+
+    /* Drop the file's cached blocks. */
+    struct stat statbuf;
+
+    if (rv == 0 && (BlockCache::get()->enabled() || SharedCache::get()->enabled())
+        && ::stat(path.c_str(), &statbuf) == 0)
+    {
+        BlockCache::get()->invalidate(statbuf);
+        SharedCache::get()->invalidate(statbuf);
+    }
+
+    return rv;
+}
+
+int PosixBackend::chmod(int dir, const char *name, mode_t mode)
+{
+    return ::chmod(ProcPath(dir, name).c_str(), mode);
+}
+
+int PosixBackend::chown(int dir, const char *name, uid_t uid, gid_t gid)
+{
+    return ::fchownat(dir, name, uid, gid, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH);
+}
+
+int PosixBackend::mkdir(int dir, const char *name, mode_t mode)
+{
+    return ::mkdirat(dir, name, mode);
+}
+
+int PosixBackend::rmdir(int dir, const char *name)
+{
+    return ::unlinkat(dir, name, AT_REMOVEDIR);
+}
+
+int PosixBackend::unlink(int dir, const char *name)
+{
+    return ::unlinkat(dir, name, 0);
+}
+
+int PosixBackend::symlink(const char *target, int dir, const char *name)
+{
+    return ::symlinkat(target, dir, name);
+}
+
+int PosixBackend::rename(int dir, const char *name, int newDir, const char *newName)
+{
+    return ::renameat(dir, name, newDir, newName);
+}
+
+/*
+ *  The xattr calls set the attributes of a symlink itself. There doesn't
+ *  seem to be an interface for the user to specify which, so we always
+ *  use the l* variants unless the call names a node.
+ */
+int PosixBackend::setXAttr(int dir, const char *name, const char *xname, const void *value, size_t size, int flags)
+{
+    std::string path = ProcPath(dir, name);
+
+    return NamesNode(dir, name) ? ::setxattr(path.c_str(), xname, value, size, flags)
+                                : ::lsetxattr(path.c_str(), xname, value, size, flags);
+}
+
+ssize_t PosixBackend::getXAttr(int dir, const char *name, const char *xname, void *value, size_t size)
+{
+    std::string path = ProcPath(dir, name);
+
+    return NamesNode(dir, name) ? ::getxattr(path.c_str(), xname, value, size)
+                                : ::lgetxattr(path.c_str(), xname, value, size);
+}
+
+ssize_t PosixBackend::listXAttr(int dir, const char *name, char *list, size_t size)
+{
+    std::string path = ProcPath(dir, name);
+
+    return NamesNode(dir, name) ? ::listxattr(path.c_str(), list, size)
+                                : ::llistxattr(path.c_str(), list, size);
+}
+
+int PosixBackend::removeXAttr(int dir, const char *name, const char *xname)
+{
+    std::string path = ProcPath(dir, name);
+
+    return NamesNode(dir, name) ? ::removexattr(path.c_str(), xname)
+                                : ::lremovexattr(path.c_str(), xname);
+}
+
+BackendDir *PosixBackend::openDir(int dir, const char *name)
+{
+    int fd = ::openat(dir, (name[0] != '\0') ? name : ".", O_RDONLY | O_DIRECTORY);
+    DIR *dirp = (fd >= 0) ? fdopendir(fd) : NULL;
+
+    if (dirp == NULL)
+    {
+        if (fd >= 0)
+            ::close(fd);
+
+        return NULL;
+    }
+
+    return new PosixDir(dirp);
+}
+
+int PosixBackend::open(int dir, const char *name, int flags, mode_t mode)
+{
+    /* A node's O_PATH descriptor is opened again through /proc. */
+    int fd = (name[0] == '\0') ? ::open(ProcPath(dir, name).c_str(), flags, mode)
+                               : ::openat(dir, name, flags, mode);
+
+    if (fd >= 0)
+        BlockCache::get()->open(fd);
+
+    return fd;
+}
+
+int PosixBackend::close(int fd)
+{
+    BlockCache::get()->close(fd);
+
+    return ::close(fd);
+}
+
+ssize_t PosixBackend::read(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return BlockCache::get()->read(fd, iov, iovcnt, offset);
+}
+
+ssize_t PosixBackend::write(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t rv = ::pwritev(fd, iov, iovcnt, offset);
+
+    BlockCache::get()->invalidate(fd);
+    SharedCache::get()->invalidate(fd);
+
+    return rv;
+}
+
+int PosixBackend::ftruncate(int fd, off_t length)
+{
+    int rv = ::ftruncate(fd, length);
+
+    BlockCache::get()->invalidate(fd);
+    SharedCache::get()->invalidate(fd);
+
+    return rv;
+}
+
+int PosixBackend::fsync(int fd, bool datasync)
+{
+    return (datasync) ? ::fdatasync(fd) : ::fsync(fd);
+}
+
+int PosixBackend::fstat(int fd, struct stat *statbuf)
+{
+    return ::fstat(fd, statbuf);
+}
+
+void PosixBackend::willNeed(int fd, off_t offset, off_t length)
+{
+    (void)posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_POSIX_H__
+#define __GEM5FS_GEM5_POSIX_H__
+
+#include "gem5fs/gem5/backend.h"
+
+namespace gem5fs {
+
+/*
+ *  The host file system, through the POSIX calls. Node handles are O_PATH
+ *  descriptors, and reads of open files go through the BlockCache.
+ */
+class PosixBackend : public Backend
+{
+  public:
+    int openNode(int dir, const char *name);
+    void closeNode(int node);
+
+    int stat(int dir, const char *name, struct stat *statbuf);
+    ssize_t readLink(int dir, const char *name, char *buf, size_t size);
+    int access(int dir, const char *name, int mask);
+    int statfs(int dir, const char *name, struct statvfs *statbuf);
+
+    int truncate(int dir, const char *name, off_t length);
+    int chmod(int dir, const char *name, mode_t mode);
+    int chown(int dir, const char *name, uid_t uid, gid_t gid);
+    int mkdir(int dir, const char *name, mode_t mode);
+    int rmdir(int dir, const char *name);
+    int unlink(int dir, const char *name);
+    int symlink(const char *target, int dir, const char *name);
+    int rename(int dir, const char *name, int newDir, const char *newName);
+
+    int setXAttr(int dir, const char *name, const char *xname, const void *value, size_t size, int flags);
+    ssize_t getXAttr(int dir, const char *name, const char *xname, void *value, size_t size);
+    ssize_t listXAttr(int dir, const char *name, char *list, size_t size);
+    int removeXAttr(int dir, const char *name, const char *xname);
+
+    BackendDir *openDir(int dir, const char *name);
+
+    int open(int dir, const char *name, int flags, mode_t mode);
+    int close(int fd);
+    ssize_t read(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    ssize_t write(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    int ftruncate(int fd, off_t length);
+    int fsync(int fd, bool datasync);
+    int fstat(int fd, struct stat *statbuf);
+
+    void willNeed(int fd, off_t offset, off_t length);
+    int hostFd(int fd) { return fd; }
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_POSIX_H__
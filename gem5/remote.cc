@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/remote.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+RemoteHost *RemoteHost::get()
+{
+    static RemoteHost *remote = new RemoteHost();
+
+    return remote;
+}
+
+static_assert(GEM5FS_REMOTE_MAX_SIZE == GEM5FS_MAX_DATA_SIZE,
+              "the server must take the largest reads and writes");
+
+RemoteHost::RemoteHost()
+    : session(0), sessionSock(-1)
+{
+    const char *env = getenv("GEM5FS_SERVER");
+
+    if (env == NULL)
+        return;
+
+    socketPath = env;
+
+    if (socketPath.size() >= sizeof(((struct sockaddr_un*)NULL)->sun_path))
+        fatal("gem5fs: GEM5FS_SERVER path %s is too long.\n", env);
+}
+
+/*
+ *  Take an idle connection, or connect a new one, and the current session.
+ *  The session is started first if it is not yet.
+ */
+int RemoteHost::connection(uint64_t &current)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (session == 0 && !startSession())
+            return -1;
+
+        current = session;
+
+        if (!idle.empty())
+        {
+            int sock = idle.back();
+            idle.pop_back();
+            return sock;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        warn("gem5fs: could not connect to %s: %s\n", socketPath, strerror(errno));
+        ::close(sock);
+        lostSession(current);
+        return -1;
+    }
+
+    DPRINTF(gem5fs, "gem5fs: connected to server %s\n", socketPath);
+
+    return sock;
+}
+
+/*
+ *  Connect the session's connection and learn its id. Called with the lock
+ *  held.
+ */
+bool RemoteHost::startSession()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        warn("gem5fs: could not connect to %s: %s\n", socketPath, strerror(errno));
+
+        if (sock >= 0)
+            ::close(sock);
+
+        return false;
+    }
+
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteSession;
+
+    RemoteReply answer;
+    struct iovec out, in;
+    out.iov_base = &request;
+    out.iov_len = sizeof(RemoteRequest);
+    in.iov_base = &answer;
+    in.iov_len = sizeof(RemoteReply);
+
+    if (gem5fs_remote_sendv(sock, &out, 1, -1) != 0 || gem5fs_remote_recvv(sock, &in, 1, NULL) != 0
+        || answer.result <= 0)
+    {
+        warn("gem5fs: could not start a session with %s.\n", socketPath);
+        ::close(sock);
+        return false;
+    }
+
+    /* Left open until gem5 exits. */
+    sessionSock = sock;
+    session = answer.result;
+
+    DPRINTF(gem5fs, "gem5fs: started session %d with server %s\n", session, socketPath);
+
+    return true;
+}
+
+/*
+ *  Forget the session lost, unless another call already started a new
+ *  one. Idle connections go too, they may be to the same dead server.
+ */
+void RemoteHost::lostSession(uint64_t lost)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (session != lost)
+        return;
+
+    DPRINTF(gem5fs, "gem5fs: lost session %d with server %s\n", session, socketPath);
+
+    ::close(sessionSock);
+    sessionSock = -1;
+    session = 0;
+
+    for (auto iter = idle.begin(); iter != idle.end(); ++iter)
+        ::close(*iter);
+
+    idle.clear();
+}
+
+/*
+ *  Send a request with its data and fd, and read the reply's data into
+ *  reply. Returns the reply's result, or -1 with errno set.
+ */
+int64_t RemoteHost::call(RemoteRequest &request, const struct iovec *data, int datacnt,
+                         int fd, const struct iovec *reply, int replycnt)
+{
+    uint64_t current = 0;
+    int sock = connection(current);
+
+    if (sock < 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    request.session = current;
+
+    std::vector<struct iovec> out(1);
+    out[0].iov_base = &request;
+    out[0].iov_len = sizeof(RemoteRequest);
+    out.insert(out.end(), data, data + datacnt);
+
+    RemoteReply answer;
+    struct iovec in;
+    in.iov_base = &answer;
+    in.iov_len = sizeof(RemoteReply);
+
+    if (gem5fs_remote_sendv(sock, out.data(), out.size(), fd) != 0
+        || gem5fs_remote_recvv(sock, &in, 1, NULL) != 0)
+    {
+        warn("gem5fs: lost the connection to %s: %s\n", socketPath, strerror(errno));
+        ::close(sock);
+        lostSession(current);
+        errno = EIO;
+        return -1;
+    }
+
+    /* Read the data that follows into the front of reply. */
+    std::vector<struct iovec> rest;
+    uint64_t left = answer.size;
+
+    for (int i = 0; i < replycnt && left > 0; ++i)
+    {
+        rest.push_back(reply[i]);
+        rest.back().iov_len = std::min<uint64_t>(reply[i].iov_len, left);
+        left -= rest.back().iov_len;
+    }
+
+    if (left > 0)
+        errno = EPROTO;
+
+    if (left > 0 || gem5fs_remote_recvv(sock, rest.data(), rest.size(), NULL) != 0)
+    {
+        warn("gem5fs: lost the connection to %s: %s\n", socketPath, strerror(errno));
+        ::close(sock);
+        lostSession(current);
+        errno = EIO;
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        idle.push_back(sock);
+    }
+
+    if (answer.result < 0)
+        errno = answer.errnum;
+
+    return answer.result;
+}
+
+int RemoteHost::open(int dirfd, const char *name, int flags, mode_t mode)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteOpen;
+    request.flags = flags;
+    request.mode = mode;
+    request.size = strlen(name);
+
+    struct iovec data;
+    data.iov_base = (void*)name;
+    data.iov_len = request.size;
+
+    /* The server resolves relative paths from gem5's directory. */
+    if (dirfd == AT_FDCWD && name[0] != '/')
+    {
+        int cwd = ::open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+        if (cwd < 0)
+            return -1;
+
+        int rv = call(request, &data, 1, cwd, NULL, 0);
+        int error = errno;
+
+        ::close(cwd);
+        errno = error;
+
+        return rv;
+    }
+
+    return call(request, &data, 1, (dirfd == AT_FDCWD) ? -1 : dirfd, NULL, 0);
+}
+
+int RemoteHost::close(int handle)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteClose;
+    request.handle = handle;
+
+    return call(request, NULL, 0, -1, NULL, 0);
+}
+
+ssize_t RemoteHost::read(int handle, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteRead;
+    request.handle = handle;
+    request.offset = offset;
+
+    for (int i = 0; i < iovcnt; ++i)
+        request.size += iov[i].iov_len;
+
+    return call(request, NULL, 0, -1, iov, iovcnt);
+}
+
+ssize_t RemoteHost::write(int handle, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteWrite;
+    request.handle = handle;
+    request.offset = offset;
+
+    for (int i = 0; i < iovcnt; ++i)
+        request.size += iov[i].iov_len;
+
+    return call(request, iov, iovcnt, -1, NULL, 0);
+}
+
+int RemoteHost::truncate(int handle, off_t length)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteTruncate;
+    request.handle = handle;
+    request.offset = length;
+
+    return call(request, NULL, 0, -1, NULL, 0);
+}
+
+int RemoteHost::sync(int handle, bool datasync)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteSync;
+    request.handle = handle;
+    request.flags = (datasync) ? 1 : 0;
+
+    return call(request, NULL, 0, -1, NULL, 0);
+}
+
+int RemoteHost::stat(int handle, struct stat *statbuf)
+{
+    RemoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.oper = RemoteStat;
+    request.handle = handle;
+
+    struct iovec reply;
+    reply.iov_base = statbuf;
+    reply.iov_len = sizeof(struct stat);
+
+    return call(request, NULL, 0, -1, &reply, 1);
+}
+
+int RemoteBackend::open(int dir, const char *name, int flags, mode_t mode)
+{
+    return RemoteHost::get()->open(dir, name, flags, mode);
+}
+
+int RemoteBackend::close(int fd)
+{
+    return RemoteHost::get()->close(fd);
+}
+
+ssize_t RemoteBackend::read(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return RemoteHost::get()->read(fd, iov, iovcnt, offset);
+}
+
+ssize_t RemoteBackend::write(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return RemoteHost::get()->write(fd, iov, iovcnt, offset);
+}
+
+int RemoteBackend::ftruncate(int fd, off_t length)
+{
+    return RemoteHost::get()->truncate(fd, length);
+}
+
+int RemoteBackend::fsync(int fd, bool datasync)
+{
+    return RemoteHost::get()->sync(fd, datasync);
+}
+
+int RemoteBackend::fstat(int fd, struct stat *statbuf)
+{
+    return RemoteHost::get()->stat(fd, statbuf);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_REMOTE_H__
+#define __GEM5FS_GEM5_REMOTE_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+#include "gem5fs/gem5/backend.h"
+#include "gem5fs/server/protocol.h"
+
+#include <sys/uio.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gem5fs {
+
+/*
+ *  Client of a gem5fs-server on the same host, used for open files when
+ *  the GEM5FS_SERVER environment variable names the server's socket. The
+ *  server opens the files and does their I/O for every gem5 process on
+ *  the host, so they share its descriptors and the reads it schedules.
+ *  The handles it returns stand in for host fds in the guest.
+ *
+ *  Calls block until the server replies. They are made from worker
+ *  threads, each over a connection of its own, and fail with errno set
+ *  to EIO if the server can't be reached. The first call also starts a
+ *  session on a connection kept open until gem5 exits, so the server
+ *  closes the files left open then. A call that loses its connection ends
+ *  the session, and the next call starts a new one, since the server may
+ *  have restarted. Handles from before then fail with EBADF.
+ */
+class RemoteHost
+{
+  public:
+    static RemoteHost *get();
+
+    bool enabled() const { return !socketPath.empty(); }
+
+    /* Open name in dirfd, or dirfd itself if name is empty. */
+    int open(int dirfd, const char *name, int flags, mode_t mode);
+    int close(int handle);
+
+    ssize_t read(int handle, const struct iovec *iov, int iovcnt, off_t offset);
+    ssize_t write(int handle, const struct iovec *iov, int iovcnt, off_t offset);
+    int truncate(int handle, off_t length);
+    int sync(int handle, bool datasync);
+    int stat(int handle, struct stat *statbuf);
+
+  private:
+    RemoteHost();
+
+    int connection(uint64_t &current);
+    bool startSession();
+    void lostSession(uint64_t lost);
+    int64_t call(RemoteRequest &request, const struct iovec *data, int datacnt,
+                 int fd, const struct iovec *reply, int replycnt);
+
+    std::string socketPath;
+    uint64_t session;           // 0 until the session is started
+    int sessionSock;
+    std::vector<int> idle;      // Connections with no request in flight
+    std::mutex lock;
+};
+
+/*
+ *  Sends the calls on open files to the gem5fs-server, leaving the rest
+ *  to the backend it wraps.
+ */
+class RemoteBackend : public BackendDecorator
+{
+  public:
+    RemoteBackend(Backend *inner) : BackendDecorator(inner) {}
+
+    int open(int dir, const char *name, int flags, mode_t mode);
+    int close(int fd);
+    ssize_t read(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    ssize_t write(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    int ftruncate(int fd, off_t length);
+    int fsync(int fd, bool datasync);
+    int fstat(int fd, struct stat *statbuf);
+
+    /* The server reads ahead for itself, and its handles can't be mapped. */
+    void willNeed(int fd, off_t offset, off_t length) {}
+    int hostFd(int fd) { return -1; }
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_REMOTE_H__
@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#include "gem5fs/gem5/sharedcache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "base/misc.hh"
+#include "debug/gem5fs.hh"
+
+using namespace gem5fs;
+
+/* Size of a cached block. Blocks start at multiples of it. */
+#define GEM5FS_SHARED_BLOCK_SIZE (64 * 1024)
+
+/* Slots in each set. */
+#define GEM5FS_SHARED_WAYS 8
+
+/* Size of the segment when GEM5FS_SHARED_CACHE_MB is not set. */
+#define GEM5FS_SHARED_DEFAULT_MB 1024
+
+/*
+ *  Written last by the process that creates the segment. Changes with the
+ *  layout, so segments of other versions are not used.
+ */
+#define GEM5FS_SHARED_MAGIC 0x67656d3566736332ULL
+
+/* The header takes a cache line of its own. */
+#define GEM5FS_SHARED_HEADER_SIZE 64
+
+/* Write counts after the header, shared by the files hashed to each. */
+#define GEM5FS_SHARED_GENERATIONS 4096
+
+/* How long to wait for another process to set up the segment. */
+#define GEM5FS_SHARED_WAIT_US (10 * 1000 * 1000)
+
+SharedCache *SharedCache::get()
+{
+    static SharedCache *cache = new SharedCache();
+
+    return cache;
+}
+
+SharedCache::SharedCache()
+    : header(NULL), generations(NULL), slots(NULL), blocks(NULL)
+{
+    const char *name = getenv("GEM5FS_SHARED_CACHE");
+    const char *env = getenv("GEM5FS_SHARED_CACHE_MB");
+    uint64_t size = (env != NULL) ? strtoull(env, NULL, 10) : GEM5FS_SHARED_DEFAULT_MB;
+
+    if (name != NULL && !attach(name, size * 1024 * 1024))
+        warn("gem5fs: not using the shared cache %s.\n", name);
+}
+
+/*
+ *  Create the segment, or attach to the one another process created and
+ *  wait for it to be set up.
+ */
+bool SharedCache::attach(const char *name, uint64_t size)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool created = (fd >= 0);
+
+    if (!created && errno == EEXIST)
+        fd = shm_open(name, O_RDWR, 0);
+
+    if (fd < 0)
+    {
+        warn("gem5fs: could not open %s: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    struct stat statbuf;
+
+    if (created && ftruncate(fd, size) != 0)
+    {
+        warn("gem5fs: could not size %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        close(fd);
+        return false;
+    }
+
+    /* The creator may not have sized it yet. */
+    for (unsigned int waited = 0; !created; waited += 1000)
+    {
+        if (fstat(fd, &statbuf) != 0 || waited >= GEM5FS_SHARED_WAIT_US)
+        {
+            close(fd);
+            return false;
+        }
+
+        if (statbuf.st_size > 0)
+        {
+            size = statbuf.st_size;
+            break;
+        }
+
+        usleep(1000);
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED)
+    {
+        warn("gem5fs: could not map %s: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    Header *shared = (Header*)addr;
+
+    if (created)
+    {
+        uint64_t setSize = GEM5FS_SHARED_WAYS * (sizeof(Slot) + GEM5FS_SHARED_BLOCK_SIZE);
+        uint64_t start = GEM5FS_SHARED_HEADER_SIZE + GEM5FS_SHARED_GENERATIONS * sizeof(uint64_t);
+
+        shared->blockSize = GEM5FS_SHARED_BLOCK_SIZE;
+        shared->sets = (size > start) ? (size - start) / setSize : 0;
+
+        if (shared->sets == 0)
+        {
+            warn("gem5fs: %s is too small.\n", name);
+            munmap(addr, size);
+            shm_unlink(name);
+            return false;
+        }
+
+        shared->magic.store(GEM5FS_SHARED_MAGIC, std::memory_order_release);
+    }
+
+    uint64_t magic;
+
+    for (unsigned int waited = 0; (magic = shared->magic.load(std::memory_order_acquire)) == 0; waited += 1000)
+    {
+        if (waited >= GEM5FS_SHARED_WAIT_US)
+        {
+            munmap(addr, size);
+            return false;
+        }
+
+        usleep(1000);
+    }
+
+    if (magic != GEM5FS_SHARED_MAGIC || shared->blockSize != GEM5FS_SHARED_BLOCK_SIZE)
+    {
+        warn("gem5fs: %s was created by another version of gem5fs.\n", name);
+        munmap(addr, size);
+        return false;
+    }
+
+    header = shared;
+    generations = (std::atomic<uint64_t>*)((uint8_t*)addr + GEM5FS_SHARED_HEADER_SIZE);
+    slots = (Slot*)(generations + GEM5FS_SHARED_GENERATIONS);
+    blocks = (uint8_t*)(slots + header->sets * GEM5FS_SHARED_WAYS);
+
+    DPRINTF(gem5fs, "gem5fs: attached to %s with %d sets\n", name, header->sets);
+
+    return true;
+}
+
+/* The write count of a file. */
+std::atomic<uint64_t> *SharedCache::generation(uint64_t dev, uint64_t ino) const
+{
+    uint64_t hash = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 32;
+
+    return &generations[hash % GEM5FS_SHARED_GENERATIONS];
+}
+
+SharedCache::Slot *SharedCache::slot(uint64_t index) const
+{
+    return &slots[index];
+}
+
+uint8_t *SharedCache::data(uint64_t index) const
+{
+    return blocks + index * GEM5FS_SHARED_BLOCK_SIZE;
+}
+
+/* Hash a key to the first slot of its set. */
+uint64_t SharedCache::set(const Key &key) const
+{
+    const uint64_t *words = (const uint64_t*)&key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < sizeof(Key) / sizeof(uint64_t); ++i)
+    {
+        hash ^= words[i];
+        hash *= 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+
+    return (hash % header->sets) * GEM5FS_SHARED_WAYS;
+}
+
+/*
+ *  Copy a block out of the cache. Returns its length, or -1 if it is not
+ *  cached or was replaced while it was copied.
+ */
+int64_t SharedCache::lookup(const Key &key, uint8_t *buf)
+{
+    uint64_t first = set(key);
+
+    for (uint64_t index = first; index < first + GEM5FS_SHARED_WAYS; ++index)
+    {
+        Slot *cached = slot(index);
+        uint32_t sequence = cached->sequence.load(std::memory_order_acquire);
+
+        if (sequence == 0 || (sequence & 1))
+            continue;
+
+        Key found;
+        memcpy(&found, &cached->key, sizeof(Key));
+        uint32_t length = cached->length;
+
+        if (memcmp(&found, &key, sizeof(Key)) != 0 || length > GEM5FS_SHARED_BLOCK_SIZE)
+            continue;
+
+        memcpy(buf, data(index), length);
+
+        /* Keep the copy only if no writer started meanwhile. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (cached->sequence.load(std::memory_order_relaxed) != sequence)
+            return -1;
+
+        cached->hits.fetch_add(1, std::memory_order_relaxed);
+
+        return length;
+    }
+
+    return -1;
+}
+
+/*
+ *  Add a block in place of the least used one in its set. Gives up if
+ *  another process is writing the slot.
+ */
+void SharedCache::insert(const Key &key, const uint8_t *buf, uint32_t length)
+{
+    uint64_t first = set(key);
+    uint64_t victim = first;
+    uint32_t fewest = UINT32_MAX;
+
+    for (uint64_t index = first; index < first + GEM5FS_SHARED_WAYS; ++index)
+    {
+        Slot *cached = slot(index);
+        uint32_t sequence = cached->sequence.load(std::memory_order_acquire);
+
+        if (sequence == 0)
+        {
+            victim = index;
+            break;
+        }
+
+        /* Another process cached it first. */
+        if (!(sequence & 1) && memcmp(&cached->key, &key, sizeof(Key)) == 0)
+            return;
+
+        uint32_t hits = cached->hits.load(std::memory_order_relaxed);
+
+        if (!(sequence & 1) && hits < fewest)
+        {
+            victim = index;
+            fewest = hits;
+        }
+
+        /* Age the set so blocks used long ago can be replaced. */
+        cached->hits.compare_exchange_strong(hits, hits / 2, std::memory_order_relaxed);
+    }
+
+    Slot *cached = slot(victim);
+    uint32_t sequence = cached->sequence.load(std::memory_order_relaxed);
+
+    if ((sequence & 1) || !cached->sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acq_rel))
+        return;
+
+    memcpy(&cached->key, &key, sizeof(Key));
+    cached->length = length;
+    memcpy(data(victim), buf, length);
+    cached->hits.store(1, std::memory_order_relaxed);
+
+    cached->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+/* Copy data into the iovecs from the current segment on. */
+static void Scatter(const struct iovec *iov, int &segment, uint64_t &inSegment, const uint8_t *src, uint64_t length)
+{
+    for (uint64_t copied = 0; copied < length; )
+    {
+        uint64_t chunk = std::min<uint64_t>(length - copied, iov[segment].iov_len - inSegment);
+
+        memcpy((uint8_t*)iov[segment].iov_base + inSegment, src + copied, chunk);
+        copied += chunk;
+        inSegment += chunk;
+
+        if (inSegment == iov[segment].iov_len)
+        {
+            segment++;
+            inSegment = 0;
+        }
+    }
+}
+
+/*
+ *  Look up every block of the range first, then read each run of blocks
+ *  that missed with one pread, so a cold read costs about as many
+ *  syscalls as it would without the cache.
+ */
+ssize_t SharedCache::read(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    struct stat before;
+
+    if (!enabled() || offset < 0 || fstat(fd, &before) != 0 || !S_ISREG(before.st_mode))
+        return ::preadv(fd, iov, iovcnt, offset);
+
+    std::atomic<uint64_t> *changes = generation(before.st_dev, before.st_ino);
+
+    Key key;
+    key.dev = before.st_dev;
+    key.ino = before.st_ino;
+    key.size = before.st_size;
+    key.mtimeSec = before.st_mtim.tv_sec;
+    key.mtimeNsec = before.st_mtim.tv_nsec;
+    key.generation = changes->load(std::memory_order_acquire);
+
+    uint64_t total = 0;
+
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+
+    uint64_t end = std::min<uint64_t>(offset + total, before.st_size);
+
+    if ((uint64_t)offset >= end)
+        return 0;
+
+    uint64_t firstBlock = offset / GEM5FS_SHARED_BLOCK_SIZE;
+    uint64_t count = (end - 1) / GEM5FS_SHARED_BLOCK_SIZE - firstBlock + 1;
+    std::vector<uint8_t> buf(count * GEM5FS_SHARED_BLOCK_SIZE);
+    std::vector<int64_t> lengths(count);
+    std::vector<bool> missed(count);
+    uint64_t misses = 0;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        key.block = firstBlock + i;
+        lengths[i] = lookup(key, buf.data() + i * GEM5FS_SHARED_BLOCK_SIZE);
+        missed[i] = (lengths[i] < 0);
+        misses += missed[i];
+    }
+
+    /* Blocks from valid on are not read, after a failed read. */
+    uint64_t valid = count;
+    int error = 0;
+
+    for (uint64_t i = 0; i < count; )
+    {
+        if (lengths[i] >= 0)
+        {
+            i++;
+            continue;
+        }
+
+        uint64_t run = 1;
+
+        while (i + run < count && lengths[i + run] < 0)
+            run++;
+
+        ssize_t rv = ::pread(fd, buf.data() + i * GEM5FS_SHARED_BLOCK_SIZE, run * GEM5FS_SHARED_BLOCK_SIZE,
+                             (firstBlock + i) * GEM5FS_SHARED_BLOCK_SIZE);
+
+        if (rv < 0)
+        {
+            error = errno;
+            valid = i;
+            break;
+        }
+
+        for (uint64_t j = 0; j < run; ++j)
+        {
+            int64_t left = rv - (int64_t)(j * GEM5FS_SHARED_BLOCK_SIZE);
+
+            lengths[i + j] = std::max<int64_t>(0, std::min<int64_t>(left, GEM5FS_SHARED_BLOCK_SIZE));
+        }
+
+        i += run;
+    }
+
+    /*
+     *  Only cache data known to belong to this version of the file. A
+     *  write through gem5fs counts itself once it is done, so data read
+     *  during it is cached under the old count.
+     */
+    struct stat after;
+
+    if (misses > 0 && valid > 0 && changes->load(std::memory_order_acquire) == key.generation
+        && fstat(fd, &after) == 0 && after.st_size == before.st_size
+        && after.st_mtim.tv_sec == before.st_mtim.tv_sec
+        && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec)
+    {
+        for (uint64_t i = 0; i < valid; ++i)
+        {
+            if (!missed[i])
+                continue;
+
+            key.block = firstBlock + i;
+            insert(key, buf.data() + i * GEM5FS_SHARED_BLOCK_SIZE, lengths[i]);
+        }
+    }
+
+    uint64_t done = 0;
+    int segment = 0;
+    uint64_t inSegment = 0;
+    uint64_t inBlock = offset % GEM5FS_SHARED_BLOCK_SIZE;
+
+    for (uint64_t i = 0; i < valid && done < total; ++i)
+    {
+        if ((uint64_t)lengths[i] <= inBlock)
+            break;
+
+        uint64_t copy = std::min<uint64_t>(total - done, lengths[i] - inBlock);
+
+        Scatter(iov, segment, inSegment, buf.data() + i * GEM5FS_SHARED_BLOCK_SIZE + inBlock, copy);
+        done += copy;
+        inBlock = 0;
+
+        /* A short block is the end of the file. */
+        if (lengths[i] < GEM5FS_SHARED_BLOCK_SIZE)
+            break;
+    }
+
+    if (done == 0 && valid < count)
+    {
+        errno = error;
+        return -1;
+    }
+
+    return done;
+}
+
+ssize_t SharedCache::read(int fd, void *buf, size_t size, off_t offset)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    return read(fd, &iov, 1, offset);
+}
+
+void SharedCache::invalidate(int fd)
+{
+    struct stat statbuf;
+
+    if (enabled() && fstat(fd, &statbuf) == 0)
+        invalidate(statbuf);
+}
+
+void SharedCache::invalidate(const struct stat &statbuf)
+{
+    if (!enabled() || !S_ISREG(statbuf.st_mode))
+        return;
+
+    generation(statbuf.st_dev, statbuf.st_ino)->fetch_add(1, std::memory_order_acq_rel);
+}
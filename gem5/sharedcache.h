@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_GEM5_SHAREDCACHE_H__
+#define __GEM5FS_GEM5_SHAREDCACHE_H__
+
+#include "gem5fs/gem5/gem5fs.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <atomic>
+
+namespace gem5fs {
+
+/*
+ *  Cache of host file data in a POSIX shared memory segment, shared by
+ *  every gem5 process on the host that attaches to the same segment.
+ *  Setting the GEM5FS_SHARED_CACHE environment variable to a segment name
+ *  such as /gem5fs enables it, and GEM5FS_SHARED_CACHE_MB sets the size
+ *  of the segment when the first process creates it.
+ *
+ *  Blocks are keyed by the host file, the size and modification time it
+ *  had when they were read, and a count of the writes and truncates made
+ *  to it through gem5fs by any of the processes, kept in the segment. A
+ *  file that changes gets new keys and its old blocks age out. The counts
+ *  are hashed by device and inode into a fixed table, so files that share
+ *  a count also lose their blocks.
+ *
+ *  The rest of the segment is split into sets of a few slots each.
+ *  Readers take no locks: each slot carries a sequence number that is odd
+ *  while a writer fills it, and a reader copies a block out and keeps it
+ *  only if the number did not change meanwhile. Each slot also counts its
+ *  hits, halved whenever its set takes a new block, and a new block
+ *  replaces the slot in the set with the fewest.
+ */
+class SharedCache
+{
+  public:
+    static SharedCache *get();
+
+    bool enabled() const { return header != NULL; }
+
+    /* preadv through the cache. */
+    ssize_t read(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    ssize_t read(int fd, void *buf, size_t size, off_t offset);
+
+    /*
+     *  Count a write or truncate of the file open as fd, or of statbuf's
+     *  file, once it is done. Blocks cached before are not used again.
+     */
+    void invalidate(int fd);
+    void invalidate(const struct stat &statbuf);
+
+  private:
+    SharedCache();
+
+    /* Identifies one block of one version of a host file. */
+    struct Key
+    {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        uint64_t mtimeSec;
+        uint64_t mtimeNsec;
+        uint64_t generation;
+        uint64_t block;
+    };
+
+    struct Slot
+    {
+        std::atomic<uint32_t> sequence;     // Odd while written, 0 if empty
+        std::atomic<uint32_t> hits;
+        Key key;
+        uint32_t length;
+        uint32_t reserved;
+    };
+
+    struct Header
+    {
+        std::atomic<uint64_t> magic;        // Set once the segment is ready
+        uint64_t blockSize;
+        uint64_t sets;
+    };
+
+    bool attach(const char *name, uint64_t size);
+    std::atomic<uint64_t> *generation(uint64_t dev, uint64_t ino) const;
+    Slot *slot(uint64_t index) const;
+    uint8_t *data(uint64_t index) const;
+    uint64_t set(const Key &key) const;
+    int64_t lookup(const Key &key, uint8_t *buf);
+    void insert(const Key &key, const uint8_t *buf, uint32_t length);
+
+    Header *header;
+    std::atomic<uint64_t> *generations;
+    Slot *slots;
+    uint8_t *blocks;
+};
+
+}; // namespace gem5fs
+
+#endif // __GEM5FS_GEM5_SHAREDCACHE_H__
@@ -0,0 +1,626 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+/*
+ *  gem5fs-server serves the open files of every gem5 process on a host
+ *  that sets GEM5FS_SERVER to its socket. Files opened read-only by
+ *  several simulations share one descriptor, and reads and writes are
+ *  done by a fixed number of I/O threads that take waiting requests in
+ *  file and offset order, so the host file system sees a few sorted
+ *  streams instead of one per simulation. Handles belong to the session
+ *  of the gem5 process that opened them and are closed when it exits.
+ *
+ *  Usage: gem5fs-server [-t threads] socket
+ */
+
+#include "server/protocol.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+using namespace gem5fs;
+
+/* I/O threads when -t is not given. */
+#define GEM5FS_SERVER_THREADS 4
+
+/*
+ *  A host file opened for one or more handles. Read-only opens of the
+ *  same file with the same flags share one. Requests in flight hold a
+ *  reference, so a file closed meanwhile stays open until they are done.
+ */
+struct OpenFile
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    int flags;
+    unsigned int handles;
+
+    ~OpenFile()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+typedef std::tuple<dev_t, ino_t, int> FileKey;
+
+struct Handle
+{
+    std::shared_ptr<OpenFile> file;
+    uint64_t session;
+};
+
+static std::mutex tableLock;
+static std::map<int32_t, Handle> handles;
+static std::map<FileKey, std::shared_ptr<OpenFile> > sharedFiles;
+static std::map<uint64_t, std::set<int32_t> > sessions;
+static int32_t nextHandle = 1;
+static std::random_device sessionIds;
+
+/*
+ *  Reads, writes and syncs wait here for an I/O thread. Threads take the
+ *  first request at or after the last position served, going around to
+ *  the start when none is left past it.
+ */
+struct IoRequest
+{
+    RemoteRequest *request;
+    std::shared_ptr<OpenFile> file;
+    std::vector<uint8_t> *data;
+    RemoteReply *reply;
+    bool done;
+};
+
+typedef std::tuple<dev_t, ino_t, uint64_t> IoKey;
+
+static std::mutex ioLock;
+static std::condition_variable ioQueued;
+static std::condition_variable ioDone;
+static std::multimap<IoKey, IoRequest*> ioQueue;
+static IoKey ioPosition;
+
+/* The file of a handle, if it belongs to session. */
+static std::shared_ptr<OpenFile> findFile(int32_t handle, uint64_t session)
+{
+    std::lock_guard<std::mutex> guard(tableLock);
+
+    auto iter = handles.find(handle);
+
+    if (iter == handles.end() || iter->second.session != session)
+        return std::shared_ptr<OpenFile>();
+
+    return iter->second.file;
+}
+
+/*
+ *  Open name in dirfd, or dirfd itself if name is empty, and return a new
+ *  handle for it in session.
+ */
+static int64_t openFile(int dirfd, const std::string &name, int flags, mode_t mode, uint64_t session)
+{
+    {
+        std::lock_guard<std::mutex> guard(tableLock);
+
+        if (sessions.count(session) == 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    int fd;
+
+    if (name.empty() && dirfd != -1)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+        fd = open(path, flags | O_CLOEXEC, mode);
+    }
+    else
+    {
+        fd = openat((dirfd != -1) ? dirfd : AT_FDCWD, name.c_str(), flags | O_CLOEXEC, mode);
+    }
+
+    struct stat statbuf;
+
+    if (fd < 0 || fstat(fd, &statbuf) != 0)
+    {
+        int error = errno;
+
+        if (fd >= 0)
+            close(fd);
+
+        errno = error;
+        return -1;
+    }
+
+    bool shareable = ((flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC))
+                      && S_ISREG(statbuf.st_mode));
+    FileKey key(statbuf.st_dev, statbuf.st_ino, flags);
+
+    std::lock_guard<std::mutex> guard(tableLock);
+
+    /* The session may have ended while the file was opened. */
+    auto owner = sessions.find(session);
+
+    if (owner == sessions.end())
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::shared_ptr<OpenFile> file;
+    auto shared = sharedFiles.find(key);
+
+    if (shareable && shared != sharedFiles.end())
+    {
+        file = shared->second;
+        close(fd);
+    }
+    else
+    {
+        file = std::make_shared<OpenFile>();
+        file->fd = fd;
+        file->dev = statbuf.st_dev;
+        file->ino = statbuf.st_ino;
+        file->flags = flags;
+        file->handles = 0;
+
+        if (shareable)
+            sharedFiles[key] = file;
+    }
+
+    /* Handles are returned to the guest as fds, so keep them positive. */
+    while (handles.count(nextHandle) != 0 || nextHandle <= 0)
+        nextHandle = (nextHandle <= 0) ? 1 : nextHandle + 1;
+
+    int32_t handle = nextHandle++;
+
+    handles[handle].file = file;
+    handles[handle].session = session;
+    owner->second.insert(handle);
+    file->handles++;
+
+    return handle;
+}
+
+/* Drop a handle. Called with tableLock held. */
+static int64_t releaseHandle(std::map<int32_t, Handle>::iterator iter)
+{
+    std::shared_ptr<OpenFile> file = iter->second.file;
+    handles.erase(iter);
+
+    if (--file->handles > 0)
+        return 0;
+
+    auto shared = sharedFiles.find(FileKey(file->dev, file->ino, file->flags));
+
+    if (shared != sharedFiles.end() && shared->second == file)
+        sharedFiles.erase(shared);
+
+    /* A request in flight closes it once it is done. */
+    if (file.use_count() > 1)
+        return 0;
+
+    int rv = close(file->fd);
+    file->fd = -1;
+
+    return rv;
+}
+
+static int64_t closeHandle(int32_t handle, uint64_t session)
+{
+    std::lock_guard<std::mutex> guard(tableLock);
+
+    auto iter = handles.find(handle);
+
+    if (iter == handles.end() || iter->second.session != session)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    sessions[session].erase(handle);
+
+    return releaseHandle(iter);
+}
+
+/*
+ *  Sessions get random ids, so a gem5 process that outlived an earlier
+ *  server can't pass its old id and reach another process's handles.
+ */
+static uint64_t startSession()
+{
+    std::lock_guard<std::mutex> guard(tableLock);
+
+    uint64_t session;
+
+    do
+    {
+        /* Positive as an int64_t result, and never 0. */
+        session = (((uint64_t)sessionIds() << 32) | sessionIds()) & INT64_MAX;
+    } while (session == 0 || sessions.count(session) != 0);
+
+    sessions[session];
+
+    return session;
+}
+
+/* Close the handles a gem5 process left open. */
+static void endSession(uint64_t session)
+{
+    std::lock_guard<std::mutex> guard(tableLock);
+
+    auto owner = sessions.find(session);
+
+    if (owner == sessions.end())
+        return;
+
+    for (auto handle = owner->second.begin(); handle != owner->second.end(); ++handle)
+    {
+        auto iter = handles.find(*handle);
+
+        if (iter != handles.end())
+            (void)releaseHandle(iter);
+    }
+
+    sessions.erase(owner);
+}
+
+/*
+ *  Hold a session until its connection goes away. gem5 sends nothing
+ *  after RemoteSession, so anything else ends it too.
+ */
+static void serveSession(int sock, uint64_t session)
+{
+    char byte;
+
+    while (recv(sock, &byte, 1, 0) < 0 && errno == EINTR)
+        ;
+
+    endSession(session);
+}
+
+/*
+ *  Read and throw away size bytes of a request that is refused. Returns
+ *  0, or -1 if the connection went away.
+ */
+static int discard(int sock, uint64_t size)
+{
+    std::vector<uint8_t> buf(std::min<uint64_t>(size, 64 * 1024));
+
+    while (size > 0)
+    {
+        uint64_t chunk = std::min<uint64_t>(size, buf.size());
+        struct iovec in;
+        in.iov_base = buf.data();
+        in.iov_len = chunk;
+
+        if (gem5fs_remote_recvv(sock, &in, 1, NULL) != 0)
+            return -1;
+
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+/* Do a read, write or sync. Called by the I/O threads. */
+static void doIo(IoRequest *io)
+{
+    RemoteRequest *request = io->request;
+    int fd = io->file->fd;
+    int64_t rv = -1;
+
+    switch (request->oper)
+    {
+        case RemoteRead:
+            io->data->resize(request->size);
+            rv = pread(fd, io->data->data(), request->size, request->offset);
+            io->data->resize((rv > 0) ? rv : 0);
+            break;
+        case RemoteWrite:
+            rv = pwrite(fd, io->data->data(), io->data->size(), request->offset);
+            break;
+        case RemoteSync:
+            rv = (request->flags == 1) ? fdatasync(fd) : fsync(fd);
+            break;
+    }
+
+    io->reply->result = rv;
+    io->reply->errnum = (rv < 0) ? errno : 0;
+}
+
+static void ioThread()
+{
+    std::unique_lock<std::mutex> guard(ioLock);
+
+    while (true)
+    {
+        while (ioQueue.empty())
+            ioQueued.wait(guard);
+
+        auto iter = ioQueue.lower_bound(ioPosition);
+
+        if (iter == ioQueue.end())
+            iter = ioQueue.begin();
+
+        IoRequest *io = iter->second;
+        ioPosition = iter->first;
+        ioQueue.erase(iter);
+
+        guard.unlock();
+        doIo(io);
+        guard.lock();
+
+        io->done = true;
+        ioDone.notify_all();
+    }
+}
+
+/* Queue a read, write or sync and wait for an I/O thread to do it. */
+static void scheduleIo(IoRequest *io)
+{
+    std::unique_lock<std::mutex> guard(ioLock);
+
+    io->done = false;
+    ioQueue.insert(std::make_pair(IoKey(io->file->dev, io->file->ino, io->request->offset), io));
+    ioQueued.notify_one();
+
+    while (!io->done)
+        ioDone.wait(guard);
+}
+
+/* Serve the requests of one gem5 connection until it closes. */
+static void serveConnection(int sock)
+{
+    while (true)
+    {
+        RemoteRequest request;
+        int dirfd = -1;
+        struct iovec in;
+        in.iov_base = &request;
+        in.iov_len = sizeof(RemoteRequest);
+
+        if (gem5fs_remote_recvv(sock, &in, 1, &dirfd) != 0)
+            break;
+
+        /* The name or data that follows, thrown away if it is too large. */
+        bool follows = (request.oper == RemoteOpen || request.oper == RemoteWrite);
+        bool oversized = (request.size > GEM5FS_REMOTE_MAX_SIZE);
+        std::vector<uint8_t> data((follows && !oversized) ? request.size : 0);
+        in.iov_base = data.data();
+        in.iov_len = data.size();
+
+        if (gem5fs_remote_recvv(sock, &in, 1, NULL) != 0
+            || (follows && oversized && discard(sock, request.size) != 0))
+        {
+            if (dirfd != -1)
+                close(dirfd);
+            break;
+        }
+
+        RemoteReply reply;
+        memset(&reply, 0, sizeof(reply));
+        errno = 0;
+
+        std::shared_ptr<OpenFile> file;
+        struct stat statbuf;
+        struct iovec out[2];
+        out[0].iov_base = &reply;
+        out[0].iov_len = sizeof(RemoteReply);
+        out[1].iov_base = NULL;
+        out[1].iov_len = 0;
+
+        if (request.oper != RemoteOpen && request.oper != RemoteSession)
+            file = findFile(request.handle, request.session);
+
+        if (request.oper == RemoteSession)
+        {
+            if (dirfd != -1)
+                close(dirfd);
+
+            uint64_t session = startSession();
+            reply.result = session;
+
+            if (gem5fs_remote_sendv(sock, out, 1, -1) == 0)
+                serveSession(sock, session);
+            else
+                endSession(session);
+
+            break;
+        }
+        else if (oversized)
+        {
+            reply.result = -1;
+            errno = EINVAL;
+        }
+        else if (request.oper != RemoteOpen && !file)
+        {
+            reply.result = -1;
+            errno = EBADF;
+        }
+        else switch (request.oper)
+        {
+            case RemoteOpen:
+                reply.result = openFile(dirfd, std::string(data.begin(), data.end()), request.flags, request.mode, request.session);
+                break;
+            case RemoteClose:
+                reply.result = closeHandle(request.handle, request.session);
+                break;
+            case RemoteTruncate:
+                reply.result = ftruncate(file->fd, request.offset);
+                break;
+            case RemoteStat:
+                reply.result = fstat(file->fd, &statbuf);
+
+                if (reply.result == 0)
+                {
+                    out[1].iov_base = &statbuf;
+                    out[1].iov_len = reply.size = sizeof(struct stat);
+                }
+                break;
+            case RemoteRead:
+            case RemoteWrite:
+            case RemoteSync:
+            {
+                IoRequest io;
+                io.request = &request;
+                io.file = file;
+                io.data = &data;
+                io.reply = &reply;
+
+                scheduleIo(&io);
+
+                if (request.oper == RemoteRead)
+                {
+                    out[1].iov_base = data.data();
+                    out[1].iov_len = reply.size = data.size();
+                }
+
+                errno = reply.errnum;
+                break;
+            }
+            default:
+                reply.result = -1;
+                errno = ENOSYS;
+                break;
+        }
+
+        if (dirfd != -1)
+            close(dirfd);
+
+        if (reply.result < 0)
+            reply.errnum = errno;
+
+        if (gem5fs_remote_sendv(sock, out, 2, -1) != 0)
+            break;
+    }
+
+    close(sock);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int threads = GEM5FS_SERVER_THREADS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        if (opt == 't' && atoi(optarg) > 0)
+            threads = atoi(optarg);
+        else
+            optind = argc + 1;
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-t threads] socket\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(argv[optind]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "gem5fs-server: socket path %s is too long\n", argv[optind]);
+        return 1;
+    }
+
+    strncpy(addr.sun_path, argv[optind], sizeof(addr.sun_path) - 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    /* Replace the socket of a server that exited. */
+    unlink(addr.sun_path);
+
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listener, 64) != 0)
+    {
+        perror("gem5fs-server");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (unsigned int i = 0; i < threads; ++i)
+        std::thread(ioThread).detach();
+
+    while (true)
+    {
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+        if (sock < 0 && errno == EINTR)
+            continue;
+
+        if (sock < 0)
+        {
+            perror("gem5fs-server");
+            return 1;
+        }
+
+        std::thread(serveConnection, sock).detach();
+    }
+
+    return 0;
+}
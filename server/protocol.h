@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+#ifndef __GEM5FS_SERVER_PROTOCOL_H__
+#define __GEM5FS_SERVER_PROTOCOL_H__
+
+/*
+ *  Messages between gem5 and gem5fs-server. Both run on the same host, so
+ *  fields are in host byte order. Each request is a RemoteRequest followed
+ *  by size bytes (a name for RemoteOpen, the data for RemoteWrite), and is
+ *  answered with a RemoteReply followed by size bytes (the data read for
+ *  RemoteRead, a struct stat for RemoteStat). A connection carries one
+ *  request at a time, so gem5 opens one per request in flight.
+ *
+ *  Each gem5 process first sends RemoteSession on a connection it keeps
+ *  open and sends nothing else on. The result is the session the handles
+ *  it opens belong to, passed with every other request. The server closes
+ *  the handles of a session when that connection goes away, which it does
+ *  when gem5 exits.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+namespace gem5fs {
+#endif
+
+enum RemoteOperation
+{
+    RemoteOpen = 1,     // Open name in the directory passed with the request
+    RemoteRead,
+    RemoteWrite,
+    RemoteTruncate,
+    RemoteSync,
+    RemoteClose,
+    RemoteStat,
+    RemoteSession       // Start a session, see above
+};
+
+/*
+ *  Most bytes of a name, read or write, the same as GEM5FS_MAX_DATA_SIZE
+ *  in gem5/gem5fs.h, which the server does not include.
+ */
+#define GEM5FS_REMOTE_MAX_SIZE (1U << 30)
+
+struct RemoteRequest
+{
+    uint32_t oper;
+    int32_t handle;     // Returned by RemoteOpen
+    uint32_t flags;     // Open flags, or 1 for fdatasync
+    uint32_t mode;      // Mode of a file created by RemoteOpen
+    uint64_t offset;    // Offset to read or write at, or length to truncate to
+    uint64_t size;      // Bytes that follow, or bytes to read
+    uint64_t session;   // Returned by RemoteSession
+};
+
+struct RemoteReply
+{
+    int64_t result;     // -1 on error
+    int32_t errnum;
+    uint32_t reserved;
+    uint64_t size;      // Bytes that follow
+};
+
+/*
+ *  Send all of iov, passing fd along with it when fd is not -1. iov is
+ *  updated as it is sent. Returns 0, or -1 with errno set.
+ */
+static inline int gem5fs_remote_sendv(int sock, struct iovec *iov, int iovcnt, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+
+    while (iovcnt > 0)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        if (fd != -1)
+        {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+            return -1;
+
+        /* The fd goes with the first byte. */
+        fd = -1;
+
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *  Fill all of iov. An fd passed along with the data is stored in *fd if
+ *  fd is not NULL, and closed otherwise. iov is updated as it is filled.
+ *  Returns 0, or -1 with errno set, ECONNRESET if the peer went away.
+ */
+static inline int gem5fs_remote_recvv(int sock, struct iovec *iov, int iovcnt, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+
+    /* Empty entries would make recvmsg wait or look like end of file. */
+    while (iovcnt > 0 && iov->iov_len == 0)
+    {
+        iov++;
+        iovcnt--;
+    }
+
+    while (iovcnt > 0)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0)
+            return -1;
+
+        if (received == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+
+            if (fd != NULL)
+                *fd = passed;
+            else
+                close(passed);
+        }
+
+        while (iovcnt > 0 && (size_t)received >= iov->iov_len)
+        {
+            received -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + received;
+            iov->iov_len -= received;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef __cplusplus
+}; // namespace gem5fs
+#endif
+
+#endif // __GEM5FS_SERVER_PROTOCOL_H__
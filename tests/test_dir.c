@@ -63,6 +63,32 @@ const char *testPath = "sandbox";
 const char *testFile1 = "foo";
 const char *testFile2 = "bar";
 
+/*
+ *  A directory with enough entries that gem5 sends its listing in many
+ *  chunks, with names long enough to fill them quickly.
+ */
+const char *bigPath = "sandbox/big";
+#define BIG_ENTRIES 1000
+
+void bigName(char *filepath, int index)
+{
+    snprintf(filepath, PATH_MAX, "%s/entry-with-a-long-name-%04d", bigPath, index);
+}
+
+void cleanupBig()
+{
+    char filepath[PATH_MAX];
+    int i;
+
+    for (i = 0; i < BIG_ENTRIES; ++i)
+    {
+        bigName(filepath, i);
+        (void)unlink(filepath);
+    }
+
+    (void)rmdir(bigPath);
+}
+
 int fail(const char *testName)
 {
     char filepath[PATH_MAX];
@@ -72,6 +98,8 @@ int fail(const char *testName)
     perror(testName);
     errno = 0;
 
+    cleanupBig();
+
     // Clean up the test directory if it exists.
     snprintf(filepath, PATH_MAX, "%s/%s", testPath, testFile1);
     (void)unlink(filepath);
@@ -115,6 +143,8 @@ int main()
     int warnings = 0;
     int fd = 0;
     int dirCount = 0;
+    int i;
+    static char seen[BIG_ENTRIES];
 
     /* Ignore umask, this can fail the test. */
     mode_t user_mask = umask(0);
@@ -289,6 +319,161 @@ int main()
     if (rv != 0 || resultDir != NULL || dirCount != 4)
         return fail("readdir_r");
 
+    errno = 0;
+    rv = closedir(dirp);
+
+    if (rv < 0)
+        return fail("closedir");
+
+
+    /* Test listing a directory larger than one chunk. */
+    printf("Testing readdir on a large directory...\n");
+
+    errno = 0;
+    rv = mkdir(bigPath, 0777);
+
+    if (rv < 0)
+        return fail("mkdir");
+
+    for (i = 0; i < BIG_ENTRIES; ++i)
+    {
+        bigName(filepath, i);
+
+        errno = 0;
+        rv = creat(filepath, 0666);
+
+        if (rv < 0)
+            return fail("creat");
+
+        closerv(rv);
+    }
+
+    errno = 0;
+    dirp = opendir(bigPath);
+
+    if (dirp == NULL)
+        return fail("opendir");
+
+    long position = -1;
+    char positionName[NAME_MAX + 1];
+    struct stat entryStat;
+
+    memset(seen, 0, sizeof(seen));
+    dirCount = 0;
+
+    while (1)
+    {
+        errno = 0;
+        entry = readdir(dirp);
+
+        if (entry == NULL && errno != 0)
+            return fail("readdir");
+
+        if (entry == NULL)
+            break;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (sscanf(entry->d_name, "entry-with-a-long-name-%d", &i) != 1 || i < 0 || i >= BIG_ENTRIES)
+        {
+            printf("Warning: Expected only test entries but saw '%s'.\n", entry->d_name);
+            ++warnings;
+            continue;
+        }
+
+        if (seen[i])
+        {
+            printf("Warning: Saw '%s' twice.\n", entry->d_name);
+            ++warnings;
+        }
+
+        seen[i] = 1;
+        dirCount++;
+
+        /*
+         *  The names were looked up along with the listing, so stat must
+         *  agree with the inode readdir gave.
+         */
+        bigName(filepath, i);
+
+        errno = 0;
+        rv = lstat(filepath, &entryStat);
+
+        if (rv < 0)
+            return fail("lstat");
+
+        if (entryStat.st_ino != entry->d_ino || !S_ISREG(entryStat.st_mode))
+        {
+            printf("Warning: lstat of '%s' disagrees with readdir.\n", entry->d_name);
+            ++warnings;
+        }
+
+        /* Remember a position in the middle of the listing. */
+        if (dirCount == BIG_ENTRIES / 2)
+        {
+            position = telldir(dirp);
+            entry = readdir(dirp);
+
+            if (entry == NULL)
+                return fail("readdir");
+
+            strcpy(positionName, entry->d_name);
+            seekdir(dirp, position);
+        }
+    }
+
+    if (dirCount != BIG_ENTRIES)
+    {
+        printf("Warning: Expected %d entries but saw %d.\n", BIG_ENTRIES, dirCount);
+        ++warnings;
+    }
+
+    /* A position from an earlier chunk must still be valid. */
+    seekdir(dirp, position);
+
+    errno = 0;
+    entry = readdir(dirp);
+
+    if (entry == NULL)
+        return fail("seekdir");
+
+    if (strcmp(entry->d_name, positionName) != 0)
+    {
+        printf("Warning: seekdir expected '%s' but saw '%s'.\n", positionName, entry->d_name);
+        ++warnings;
+    }
+
+    /* Listing again from the start gives every entry again. */
+    rewinddir(dirp);
+    dirCount = 0;
+
+    while ((entry = readdir(dirp)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+            dirCount++;
+    }
+
+    if (dirCount != BIG_ENTRIES)
+    {
+        printf("Warning: rewinddir expected %d entries but saw %d.\n", BIG_ENTRIES, dirCount);
+        ++warnings;
+    }
+
+    errno = 0;
+    rv = closedir(dirp);
+
+    if (rv < 0)
+        return fail("closedir");
+
+    cleanupBig();
+
+    errno = 0;
+    rv = access(bigPath, F_OK);
+
+    if (rv == 0)
+        return fail("rmdir");
+
 
     /* Clean up the test files. */
     // Remove file 1
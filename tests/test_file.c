@@ -71,28 +71,27 @@ void mountpoint(char *mntpt)
     struct FileOperation request;
     struct FileOperation response;
 
-    request.oper = GetMountpoint;
-    request.opType = RequestOperation;
-    request.path = NULL;
-    request.pathLength = 0;
-    request.opStruct = NULL;
-    request.structSize = 0;
+    /* Requests are sent in gem5fs's wire format, see gem5fs.h. */
+    memset(&request, 0, sizeof(struct FileOperation));
+    request.oper = gem5fs_le32(GetMountpoint);
+    request.opType = gem5fs_le32(RequestOperation);
+    request.responseBuf = gem5fs_le64((uintptr_t)mntpt);
+    request.responseCapacity = gem5fs_le32(PATH_MAX);
 
     m5_gem5fs_call(NULL, (void*)&request, (void*)&response);
 
-    request.oper = GetResult;
-    request.opType = RequestOperation;
-    request.path = NULL;
-    request.pathLength = 0;
-    request.opStruct = (uint8_t*)malloc(response.structSize);
-    request.structSize = response.structSize;
-    request.result = response.result;
-
-    memset(request.opStruct, 0, response.structSize);
-
-    m5_gem5fs_call(NULL, (void*)&request, (void*)&response);
-
-    memcpy(mntpt, request.opStruct, request.structSize);
+    /* Collect the mountpoint if gem5 did not write it in place. */
+    if (response.result != 0)
+    {
+        memset(&request, 0, sizeof(struct FileOperation));
+        request.oper = gem5fs_le32(GetResult);
+        request.opType = gem5fs_le32(RequestOperation);
+        request.opStruct = gem5fs_le64((uintptr_t)mntpt);
+        request.structSize = response.structSize;
+        request.result = response.result;
+
+        m5_gem5fs_call(NULL, (void*)&request, (void*)mntpt);
+    }
 }
 
 int fail(const char *testName, const char *flag)
@@ -144,9 +143,12 @@ int main()
     char filepath[PATH_MAX];
     char linkpath[PATH_MAX];
     char readbuf[1024];
+    static char largebuf[65536];
     int rv = 0;
     int warnings = 0;
     int fd = 0;
+    int writefd = 0;
+    int i;
 
     /* Ignore umask, this can fail the test. */
     mode_t user_mask = umask(0);
@@ -542,6 +544,132 @@ int main()
 
     closerv(fd);
 
+    /* Test that data read ahead is not used after it is overwritten. */
+    printf("Testing readahead after an overwrite...\n");
+
+    errno = 0;
+    rv = open(filepath, O_TRUNC | O_WRONLY);
+
+    if (rv < 0)
+        return fail("open", "readahead (writer)");
+
+    writefd = rv;
+
+    memset(largebuf, 'a', sizeof(largebuf));
+
+    errno = 0;
+    rv = write(writefd, largebuf, sizeof(largebuf));
+
+    if (rv != (int)sizeof(largebuf))
+        return fail("write", "readahead");
+
+    errno = 0;
+    rv = fsync(writefd);
+
+    if (rv < 0)
+        return fail("fsync", "readahead");
+
+    errno = 0;
+    rv = open(filepath, O_RDONLY);
+
+    if (rv < 0)
+        return fail("open", "readahead (reader)");
+
+    fd = rv;
+
+    /* Two sequential reads start a readahead window past them. */
+    errno = 0;
+    rv = read(fd, readbuf, 1024);
+
+    if (rv != 1024)
+        return fail("read", "readahead (first)");
+
+    errno = 0;
+    rv = read(fd, readbuf, 1024);
+
+    if (rv != 1024)
+        return fail("read", "readahead (second)");
+
+    memset(largebuf, 'b', 1024);
+
+    errno = 0;
+    rv = pwrite(writefd, largebuf, 1024, 4096);
+
+    if (rv != 1024)
+        return fail("pwrite", "readahead");
+
+    errno = 0;
+    rv = pread(fd, readbuf, 1024, 4096);
+
+    if (rv != 1024)
+        return fail("pread", "readahead");
+
+    if (readbuf[0] != 'b' || readbuf[1023] != 'b')
+    {
+        printf("Warning: readahead expected the overwritten data but saw '%c'.\n", readbuf[0]);
+        ++warnings;
+    }
+
+    closerv(fd);
+    closerv(writefd);
+
+    /* Test that small buffered writes are seen before the file is closed. */
+    printf("Testing write-back...\n");
+
+    errno = 0;
+    rv = open(filepath, O_TRUNC | O_WRONLY);
+
+    if (rv < 0)
+        return fail("open", "write-back (writer)");
+
+    writefd = rv;
+
+    for (i = 0; i < 8; ++i)
+    {
+        errno = 0;
+        rv = write(writefd, "0123456789abcdef", 16);
+
+        if (rv != 16)
+            return fail("write", "write-back");
+    }
+
+    errno = 0;
+    rv = stat(filepath, &fileStat);
+
+    if (rv < 0)
+        return fail("stat", "write-back");
+
+    if (fileStat.st_size != 128)
+    {
+        printf("Warning: write-back expected file of size 128 bytes but saw %d bytes.\n", fileStat.st_size);
+        ++warnings;
+    }
+
+    errno = 0;
+    rv = open(filepath, O_RDONLY);
+
+    if (rv < 0)
+        return fail("open", "write-back (reader)");
+
+    fd = rv;
+
+    memset(readbuf, 0, 1024);
+
+    errno = 0;
+    rv = read(fd, readbuf, 1024);
+
+    if (rv < 0)
+        return fail("read", "write-back");
+
+    if (rv != 128 || memcmp(readbuf + 112, "0123456789abcdef", 16) != 0)
+    {
+        printf("Warning: write-back expected to read 128 bytes but read %d.\n", rv);
+        ++warnings;
+    }
+
+    closerv(fd);
+    closerv(writefd);
+
     /* Clean up the test files. */
     printf("Cleaning up test files...\n");
 
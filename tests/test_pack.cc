@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2013, The Microsystems Design Laboratory (MDL)
+ * Department of Computer Science and Engineering, The Pennsylvania State University
+ * All rights reserved
+ *
+ * The license below extends only to copyright in the software and shall
+ * not be construed as granting a license to any other intellectual
+ * property including but not limited to intellectual property relating
+ * to a hardware implementation of the functionality of the software
+ * licensed hereunder.  You may use the software subject to the license
+ * terms below provided that you ensure that this notice is replicated
+ * unmodified and in its entirety in all distributions of the software,
+ * modified or unmodified, in source code or in binary form.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer;
+ * redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution;
+ * neither the name of the copyright holders nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Authors: Matt Poremba
+ */
+
+/*
+ *  Host test of gem5fs-pack and the image layout the archive backend
+ *  serves. Packs a small tree twice, checks that both images are the
+ *  same, and looks up names and reads data from the image the way the
+ *  backend does.
+ *
+ *  Usage: test_pack path/to/gem5fs-pack
+ */
+
+#include "archive/format.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using namespace gem5fs;
+
+const int exit_success = 0;
+const int exit_failure = 1;
+
+static char workPath[] = "/tmp/gem5fs-packXXXXXX";
+static const char *bigFile = "dir/c.bin";
+static const size_t bigSize = 100000;
+
+static std::string WorkFile(const char *name)
+{
+    return std::string(workPath) + "/" + name;
+}
+
+static void cleanup()
+{
+    (void)unlink(WorkFile("tree/dir/link").c_str());
+    (void)unlink(WorkFile("tree/dir/c.bin").c_str());
+    (void)rmdir(WorkFile("tree/dir").c_str());
+    (void)unlink(WorkFile("tree/b.txt").c_str());
+    (void)unlink(WorkFile("tree/a.txt").c_str());
+    (void)rmdir(WorkFile("tree").c_str());
+    (void)unlink(WorkFile("first.img").c_str());
+    (void)unlink(WorkFile("second.img").c_str());
+    (void)rmdir(workPath);
+}
+
+static int fail(const char *testName, const char *flag)
+{
+    if (flag == NULL)
+        printf("%s test FAILED! errno is %d.\n", testName, errno);
+    else
+        printf("%s test FAILED on %s! errno is %d.\n", testName, flag, errno);
+
+    cleanup();
+
+    return exit_failure;
+}
+
+static bool WriteFile(const std::string &path, const char *data, size_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        return false;
+
+    bool written = (write(fd, data, size) == (ssize_t)size);
+
+    return (close(fd) == 0 && written);
+}
+
+static bool ReadFile(const std::string &path, std::vector<char> &data)
+{
+    struct stat statbuf;
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &statbuf) != 0)
+        return false;
+
+    data.resize(statbuf.st_size);
+
+    bool read_all = (pread(fd, data.data(), data.size(), 0) == (ssize_t)data.size());
+
+    close(fd);
+
+    return read_all;
+}
+
+/* Run gem5fs-pack on the test tree. */
+static bool Pack(const char *packer, const std::string &image)
+{
+    std::string tree = WorkFile("tree");
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+
+    if ((pid = fork()) == 0)
+    {
+        execl(packer, packer, tree.c_str(), image.c_str(), (char*)NULL);
+        _exit(127);
+    }
+
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return false;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ *  Find a path in the image with a binary search among the children of
+ *  each directory. Returns NULL if it is not there.
+ */
+static const ArchiveEntry *Lookup(const char *image, const char *path)
+{
+    const ArchiveHeader *header = (const ArchiveHeader*)image;
+    const ArchiveEntry *table = (const ArchiveEntry*)(image + header->entryOffset);
+    const char *names = image + header->nameOffset;
+    const ArchiveEntry *entry = &table[0];
+    std::string rest = path;
+
+    while (!rest.empty())
+    {
+        size_t slash = rest.find('/');
+        std::string name = rest.substr(0, slash);
+        rest = (slash == std::string::npos) ? "" : rest.substr(slash + 1);
+
+        uint32_t low = entry->firstChild;
+        uint32_t high = entry->firstChild + entry->childCount;
+        const ArchiveEntry *found = NULL;
+
+        if (!S_ISDIR(entry->mode))
+            return NULL;
+
+        while (low < high && found == NULL)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            std::string candidate(names + table[middle].nameOffset, table[middle].nameLength);
+            int order = candidate.compare(name);
+
+            if (order == 0)
+                found = &table[middle];
+            else if (order < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        if (found == NULL)
+            return NULL;
+
+        entry = found;
+    }
+
+    return entry;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<char> first, second;
+    std::vector<char> big(bigSize);
+    int warnings = 0;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s path/to/gem5fs-pack\n", argv[0]);
+        return exit_failure;
+    }
+
+    /* Make a small tree with a file larger than the alignment. */
+    printf("Making test tree...\n");
+
+    if (mkdtemp(workPath) == NULL)
+        return fail("mkdtemp", NULL);
+
+    for (size_t i = 0; i < bigSize; ++i)
+        big[i] = (char)(i * 7 + i / 256);
+
+    if (mkdir(WorkFile("tree").c_str(), 0755) != 0
+        || mkdir(WorkFile("tree/dir").c_str(), 0755) != 0)
+        return fail("mkdir", NULL);
+
+    if (!WriteFile(WorkFile("tree/b.txt"), "bravo", 5)
+        || !WriteFile(WorkFile("tree/a.txt"), "alpha", 5)
+        || !WriteFile(WorkFile("tree/dir/c.bin"), big.data(), big.size()))
+        return fail("write", NULL);
+
+    if (symlink("../a.txt", WorkFile("tree/dir/link").c_str()) != 0)
+        return fail("symlink", NULL);
+
+    /* The same tree must give the same image. */
+    printf("Testing packing twice...\n");
+
+    if (!Pack(argv[1], WorkFile("first.img")) || !Pack(argv[1], WorkFile("second.img")))
+        return fail("pack", NULL);
+
+    if (!ReadFile(WorkFile("first.img"), first) || !ReadFile(WorkFile("second.img"), second))
+        return fail("read", "image");
+
+    if (first != second)
+        return fail("pack", "deterministic layout");
+
+    /* Check the header and the table. */
+    printf("Testing the image layout...\n");
+
+    const ArchiveHeader *header = (const ArchiveHeader*)first.data();
+
+    if (first.size() < sizeof(ArchiveHeader)
+        || memcmp(header->magic, GEM5FS_ARCHIVE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != GEM5FS_ARCHIVE_VERSION
+        || header->byteOrder != GEM5FS_ARCHIVE_BYTE_ORDER
+        || header->size != first.size())
+        return fail("layout", "header");
+
+    /* The root, a.txt, b.txt, dir, c.bin and link. */
+    if (header->entryCount != 6)
+    {
+        printf("Warning: expected 6 entries but saw %u.\n", header->entryCount);
+        ++warnings;
+    }
+
+    const ArchiveEntry *table = (const ArchiveEntry*)(first.data() + header->entryOffset);
+
+    if (!S_ISDIR(table[0].mode) || table[0].childCount != 3 || table[0].firstChild != 1)
+        return fail("layout", "root");
+
+    /* Look names up and read the data they lead to. */
+    printf("Testing lookups and reads...\n");
+
+    const ArchiveEntry *entry = Lookup(first.data(), "a.txt");
+
+    if (entry == NULL || !S_ISREG(entry->mode) || entry->size != 5)
+        return fail("lookup", "a.txt");
+
+    if (entry->dataOffset % GEM5FS_ARCHIVE_ALIGN != 0
+        || memcmp(first.data() + entry->dataOffset, "alpha", 5) != 0)
+        return fail("read", "a.txt");
+
+    entry = Lookup(first.data(), bigFile);
+
+    if (entry == NULL || !S_ISREG(entry->mode) || entry->size != bigSize)
+        return fail("lookup", bigFile);
+
+    if (entry->dataOffset + entry->size > first.size()
+        || memcmp(first.data() + entry->dataOffset, big.data(), bigSize) != 0)
+        return fail("read", bigFile);
+
+    entry = Lookup(first.data(), "dir/link");
+
+    if (entry == NULL || !S_ISLNK(entry->mode) || entry->size != 8
+        || memcmp(first.data() + entry->dataOffset, "../a.txt", 8) != 0)
+        return fail("lookup", "dir/link");
+
+    entry = Lookup(first.data(), "dir");
+
+    if (entry == NULL || !S_ISDIR(entry->mode) || entry->childCount != 2)
+        return fail("lookup", "dir");
+
+    if (Lookup(first.data(), "c.bin") != NULL || Lookup(first.data(), "a.txt/x") != NULL
+        || Lookup(first.data(), "dir/missing") != NULL)
+        return fail("lookup", "missing names");
+
+    /* Clean up the test tree. */
+    printf("Cleaning up test files...\n");
+
+    cleanup();
+
+    /* Print the test result. */
+    printf("Test PASSED with 0 errors and %d warnings.\n", warnings);
+
+    return exit_success;
+}